@@ -0,0 +1,1112 @@
+// Benchmarks for the simulator core.
+// Every result is printed as one JSON object per line so runs can be diffed and graphed.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <new>
+#include <utility>
+
+#include "Types.h"
+#include "Decoder.h"
+#include "StringifyTypes.h"
+#include "MappedFile.h"
+#include "Executor.h"
+#include "Program.h"
+#include "Decompiler.h"
+#include "BufferedWriter.h"
+#include "ThreadPool.h"
+#include "Encoder.h"
+#include "RoundTrip.h"
+#include "BatchRunner.h"
+#include "Lockstep.h"
+#include "SaveState.h"
+#include "DecodeCache.h"
+#include "SimulatorApi.h"
+
+//----------------------------------------------
+// Allocation counting
+// Every heap allocation in the process goes through these
+//----------------------------------------------
+static long long allocationCount = 0;
+static long long allocationBytes = 0;
+
+void* operator new(size_t size) {
+	allocationCount++;
+	allocationBytes += size;
+	void* memory = malloc(size ? size : 1);
+	if (memory == nullptr) throw std::bad_alloc();
+	return memory;
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void* memory) noexcept {
+	free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+	free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+	free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept {
+	free(memory);
+}
+
+//----------------------------------------------
+// Helpers
+//----------------------------------------------
+double NowMicroseconds() {
+	using namespace std::chrono;
+	return duration<double, std::micro>(steady_clock::now().time_since_epoch()).count();
+}
+
+void Report(const char* name, double value, const char* unit) {
+	printf("{\"benchmark\": \"%s\", \"value\": %.3f, \"unit\": \"%s\"}\n", name, value, unit);
+}
+
+// Fills an image with a repeating mix of mov/add/cmp/jnz so it decodes cleanly end to end
+Buffer MakeSyntheticImage(int size) {
+	static const byte pattern[] = {
+		0x89, 0xd8,                 // mov ax, bx
+		0x83, 0xc0, 0x05,           // add ax, 5
+		0x3b, 0x46, 0x02,           // cmp ax, [bp+2]
+		0xc6, 0x46, 0x01, 0xff,     // mov [bp+1], byte 255
+		0x75, 0x00,                 // jnz to the next instruction
+	};
+	static const byte filler[] = { 0x89, 0xd8 };
+
+	Buffer buffer = { new byte[size], size };
+	int bp = 0;
+	while (bp + (int)sizeof(pattern) <= size) {
+		memcpy(&buffer.data[bp], pattern, sizeof(pattern));
+		bp += sizeof(pattern);
+	}
+	while (bp + (int)sizeof(filler) <= size) {
+		memcpy(&buffer.data[bp], filler, sizeof(filler));
+		bp += sizeof(filler);
+	}
+	return buffer;
+}
+
+void WriteWholeFile(const char* filename, Buffer& buffer) {
+	FILE* file = fopen(filename, "wb");
+	fwrite(buffer.data, 1, buffer.size, file);
+	fclose(file);
+}
+
+// The old way of loading, kept to compare against: read the whole file into a heap copy
+Buffer ReadWholeFile(const char* filename) {
+	FILE* file = fopen(filename, "rb");
+	fseek(file, 0, SEEK_END);
+	int size = (int)ftell(file);
+	fseek(file, 0, SEEK_SET);
+	Buffer buffer = { new byte[size], size };
+	fread(buffer.data, 1, size, file);
+	fclose(file);
+	return buffer;
+}
+
+//----------------------------------------------
+// Startup
+// Time from a file on disk to a decoded program
+//----------------------------------------------
+void IgnoreWindow(List<InstructionGeneric>&, void*) {
+}
+
+void BenchmarkStartup() {
+	struct ImageSize {
+		const char* name;
+		int size;
+		int repetitions;
+	};
+	ImageSize sizes[] = {
+		{ "1KB", 1024, 200 },
+		{ "64KB", 64 * 1024, 20 },
+		{ "1MB", 1024 * 1024, 5 },
+	};
+	const char* filename = "benchmark_image.bin";
+
+	for (ImageSize& imageSize : sizes) {
+		Buffer image = MakeSyntheticImage(imageSize.size);
+		WriteWholeFile(filename, image);
+		delete[] image.data;
+
+		double bestRead = 1e30, bestMapped = 1e30, bestStreamed = 1e30;
+		for (int rep = 0; rep < imageSize.repetitions; rep++) {
+			double start = NowMicroseconds();
+			{
+				Buffer buffer = ReadWholeFile(filename);
+				List<InstructionGeneric> instructions = Decoder::Decode(buffer);
+				delete[] buffer.data;
+			}
+			double read = NowMicroseconds() - start;
+
+			start = NowMicroseconds();
+			{
+				MappedFile file;
+				file.Open(filename);
+				List<InstructionGeneric> instructions = Decoder::Decode(file.buffer);
+			}
+			double mapped = NowMicroseconds() - start;
+
+			start = NowMicroseconds();
+			{
+				MappedFile file;
+				file.Open(filename);
+				Decoder::DecodeStream(file.buffer, 4096, IgnoreWindow, nullptr);
+			}
+			double streamed = NowMicroseconds() - start;
+
+			if (read < bestRead) bestRead = read;
+			if (mapped < bestMapped) bestMapped = mapped;
+			if (streamed < bestStreamed) bestStreamed = streamed;
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "startup.read.%s", imageSize.name);
+		Report(name, bestRead, "us");
+		snprintf(name, sizeof(name), "startup.mmap.%s", imageSize.name);
+		Report(name, bestMapped, "us");
+		snprintf(name, sizeof(name), "startup.mmap_stream.%s", imageSize.name);
+		Report(name, bestStreamed, "us");
+	}
+
+	remove(filename);
+}
+
+//----------------------------------------------
+// Decode
+// Serial decode against chunked parallel decode of a large image already in memory
+//----------------------------------------------
+// The parallel decode has to give exactly the serial one's list
+bool SameDecode(List<InstructionGeneric>& a, List<InstructionGeneric>& b) {
+	if (a.Size() != b.Size()) return false;
+	for (int i = 0; i < a.Size(); i++) {
+		if (a[i].address != b[i].address || a[i].index != b[i].index || strcmp(a[i].asString.c_str(), b[i].asString.c_str()) != 0) return false;
+		if (a[i].type == InstructionType::JUMP && a[i].jump.instructionIndex != b[i].jump.instructionIndex) return false;
+	}
+	return true;
+}
+
+void BenchmarkDecode() {
+	const int size = 4 * 1024 * 1024;
+	const int repetitions = 2;
+	Buffer image = MakeSyntheticImage(size);
+
+	List<InstructionGeneric> serial;
+	double serialBest = 1e30;
+	for (int rep = 0; rep < repetitions; rep++) {
+		double start = NowMicroseconds();
+		serial = Decoder::Decode(image);
+		double elapsed = NowMicroseconds() - start;
+		if (elapsed < serialBest) serialBest = elapsed;
+	}
+	Report("decode.serial.4MB", serialBest, "us");
+
+	int threadCounts[] = { 2, 4, 8 };
+	for (int threadCount : threadCounts) {
+		double best = 1e30;
+		for (int rep = 0; rep < repetitions; rep++) {
+			double start = NowMicroseconds();
+			List<InstructionGeneric> instructions = Decoder::DecodeParallel(image, threadCount);
+			double elapsed = NowMicroseconds() - start;
+			if (elapsed < best) best = elapsed;
+			if (rep == 0 && !SameDecode(serial, instructions)) printf("decode: %d threads differ from the serial decode\n", threadCount);
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "decode.parallel.%d.4MB", threadCount);
+		Report(name, best, "us");
+		snprintf(name, sizeof(name), "decode.parallel.%d.speedup", threadCount);
+		Report(name, serialBest / best, "x");
+	}
+
+	delete[] image.data;
+}
+
+//----------------------------------------------
+// Instruction forms
+// One form per opcode class, for decoding images made of nothing else and for stepping through them
+//----------------------------------------------
+struct InstructionForm {
+	const char* name;
+	byte code[4];
+	int size;
+};
+
+static const InstructionForm instructionForms[] = {
+	{ "mov_reg_reg", { 0x89, 0xd8 }, 2 },              // mov ax, bx
+	{ "mov_reg_imm", { 0xb8, 0x34, 0x12 }, 3 },        // mov ax, 1234h
+	{ "mov_reg_mem", { 0x8b, 0x47, 0x10 }, 3 },        // mov ax, [bx+10h]
+	{ "mov_mem_reg", { 0x89, 0x47, 0x10 }, 3 },        // mov [bx+10h], ax
+	{ "mov_acc_mem", { 0xa1, 0x10, 0x00 }, 3 },        // mov ax, [10h]
+	{ "add_reg_reg", { 0x01, 0xd8 }, 2 },              // add ax, bx
+	{ "add_reg_imm", { 0x83, 0xc0, 0x05 }, 3 },        // add ax, 5
+	{ "add_mem_imm", { 0x83, 0x47, 0x10, 0x05 }, 4 },  // add word [bx+10h], 5
+	{ "sub_reg_reg", { 0x29, 0xd8 }, 2 },              // sub ax, bx
+	{ "cmp_reg_mem", { 0x3b, 0x47, 0x10 }, 3 },        // cmp ax, [bx+10h]
+	{ "jnz", { 0x75, 0x00 }, 2 },                      // jnz to the next instruction
+	{ "loop", { 0xe2, 0x00 }, 2 },                     // loop to the next instruction
+	{ "int", { 0xcd, 0x80 }, 2 },                      // int 80h, nothing handles it
+};
+
+// The form repeated "count" times and a jmp back to the first one
+Buffer MakeFormImage(InstructionForm const& form, int count) {
+	int size = form.size * count + 3;
+	Buffer buffer = { new byte[size], size };
+	for (int i = 0; i < count; i++) {
+		memcpy(&buffer.data[i * form.size], form.code, form.size);
+	}
+	word back = (word)-size;
+	buffer.data[size - 3] = 0xe9;
+	buffer.data[size - 2] = (byte)back;
+	buffer.data[size - 1] = (byte)(back >> 8);
+	return buffer;
+}
+
+void BenchmarkDecodeClasses() {
+	const int repetitions = 3;
+	const int rounds = 8;
+	for (InstructionForm const& form : instructionForms) {
+		// The closing jmp has to reach the start, so an image stays under 32KB and is decoded a few times
+		Buffer image = MakeFormImage(form, 30 * 1024 / form.size);
+
+		double best = 1e30;
+		for (int rep = 0; rep < repetitions; rep++) {
+			double start = NowMicroseconds();
+			for (int round = 0; round < rounds; round++) {
+				List<InstructionGeneric> instructions = Decoder::Decode(image);
+			}
+			double elapsed = NowMicroseconds() - start;
+			if (elapsed < best) best = elapsed;
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "decode.class.%s", form.name);
+		Report(name, (double)image.size * rounds / best, "MB/s");
+		delete[] image.data;
+	}
+}
+
+void BenchmarkStepForms() {
+	const int repetitions = 3;
+	const qword steps = 2000000;
+	for (InstructionForm const& form : instructionForms) {
+		Buffer image = MakeFormImage(form, 1000);
+		Program* program = Program::Create(image);
+
+		double best = 1e30;
+		for (int rep = 0; rep < repetitions; rep++) {
+			CPU cpu;
+			cpu.LoadProgram(program);
+			double start = NowMicroseconds();
+			for (qword i = 0; i < steps; i++) {
+				cpu.Step();
+			}
+			double elapsed = NowMicroseconds() - start;
+			if (elapsed < best) best = elapsed;
+			if (cpu.IsHalted()) printf("step.%s halted\n", form.name);
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "step.%s", form.name);
+		Report(name, best * 1000 / steps, "ns/instruction");
+		program->Release();
+		delete[] image.data;
+	}
+}
+
+//----------------------------------------------
+// Flags
+// The flags add, sub and cmp compute, over operands spread across the carry, overflow and parity cases
+//----------------------------------------------
+void BenchmarkFlags() {
+	const int repetitions = 3;
+	const int count = 4096;
+	const int rounds = 256;
+	word operands[count];
+	unsigned int seed = 1;
+	for (int i = 0; i < count; i++) {
+		seed = seed * 1103515245 + 12345;
+		operands[i] = (word)(seed >> 16);
+	}
+
+	for (int subtract = 0; subtract <= 1; subtract++) {
+		word combined = 0;
+		double best = 1e30;
+		for (int rep = 0; rep < repetitions; rep++) {
+			double start = NowMicroseconds();
+			for (int round = 0; round < rounds; round++) {
+				for (int i = 0; i + 1 < count; i++) {
+					combined ^= subtract ? CPU::SubtractFlags(operands[i], operands[i + 1]) : CPU::AddFlags(operands[i], operands[i + 1]);
+				}
+				// Keeps the compiler from computing the rounds once
+				operands[round] ^= combined;
+			}
+			double elapsed = NowMicroseconds() - start;
+			if (elapsed < best) best = elapsed;
+		}
+		Report(subtract ? "flags.subtract" : "flags.add", best * 1000 / ((double)rounds * (count - 1)), "ns/call");
+	}
+}
+
+//----------------------------------------------
+// Formatting
+// Turning decoded instructions back into text, the allocating way and into a caller's buffer
+//----------------------------------------------
+void BenchmarkFormatting() {
+	const int repetitions = 3;
+	List<InstructionGeneric> instructions;
+	for (InstructionForm const& form : instructionForms) {
+		Buffer image = MakeFormImage(form, 2000);
+		List<InstructionGeneric> decoded = Decoder::Decode(image);
+		for (int i = 0; i < decoded.Size(); i++) {
+			instructions.Add(decoded[i]);
+		}
+		delete[] image.data;
+	}
+
+	long long characters = 0;
+	double best = 1e30;
+	for (int rep = 0; rep < repetitions; rep++) {
+		double start = NowMicroseconds();
+		for (int i = 0; i < instructions.Size(); i++) {
+			characters += InstructionToString(instructions[i]).c_str()[0];
+		}
+		double elapsed = NowMicroseconds() - start;
+		if (elapsed < best) best = elapsed;
+	}
+	Report("format.instruction_to_string", best * 1000 / instructions.Size(), "ns/instruction");
+
+	char text[128];
+	best = 1e30;
+	for (int rep = 0; rep < repetitions; rep++) {
+		double start = NowMicroseconds();
+		for (int i = 0; i < instructions.Size(); i++) {
+			characters += FormatInstruction(instructions[i], text, sizeof(text));
+		}
+		double elapsed = NowMicroseconds() - start;
+		if (elapsed < best) best = elapsed;
+	}
+	Report("format.format_instruction", best * 1000 / instructions.Size(), "ns/instruction");
+	if (characters == 0) printf("format produced nothing\n");
+}
+
+//----------------------------------------------
+// Decode cache
+// What a launch pays to get the listing and Program for a binary: decoding with no cache, decoding and
+// writing the cache file on the first launch, and mapping it on every launch after
+//----------------------------------------------
+void BenchmarkDecodeCache() {
+	const int size = 1024 * 1024;
+	const int repetitions = 3;
+	const char* directory = ".";
+	Buffer image = MakeSyntheticImage(size);
+	String filename = DecodeCache::Filename(directory, DecodeCache::Key(image));
+
+	const char* names[] = { "decodecache.none.1MB", "decodecache.cold.1MB", "decodecache.warm.1MB" };
+	for (int mode = 0; mode < 3; mode++) {
+		double best = 1e30;
+		for (int rep = 0; rep < repetitions; rep++) {
+			if (mode == 1) remove(filename.c_str());
+
+			Arena arena;
+			MappedFile cacheFile;
+			DecodeCache::Decoded decoded;
+			double start = NowMicroseconds();
+			DecodeCache::Load(image, mode == 0 ? nullptr : directory, arena, cacheFile, decoded);
+			double elapsed = NowMicroseconds() - start;
+			if (elapsed < best) best = elapsed;
+			decoded.program->Release();
+		}
+		Report(names[mode], best, "us");
+	}
+
+	MappedFile cacheFile;
+	cacheFile.Open(filename.c_str());
+	Report("decodecache.file_bytes.1MB", cacheFile.buffer.size, "bytes");
+	cacheFile.Close();
+	remove(filename.c_str());
+
+	delete[] image.data;
+}
+
+//----------------------------------------------
+// Allocations
+// Heap allocations made by one decode, with and without an arena
+//----------------------------------------------
+void BenchmarkAllocations() {
+	struct ImageSize {
+		const char* name;
+		int size;
+	};
+	ImageSize sizes[] = {
+		{ "64KB", 64 * 1024 },
+		{ "1MB", 1024 * 1024 },
+	};
+
+	for (ImageSize& imageSize : sizes) {
+		Buffer image = MakeSyntheticImage(imageSize.size);
+
+		long long before = allocationCount;
+		{
+			List<InstructionGeneric> instructions = Decoder::Decode(image);
+		}
+		long long heap = allocationCount - before;
+
+		before = allocationCount;
+		double start = NowMicroseconds();
+		{
+			Arena arena;
+			Decoder::Decode(image, arena);
+		}
+		double elapsed = NowMicroseconds() - start;
+		long long arena = allocationCount - before;
+
+		char name[64];
+		snprintf(name, sizeof(name), "decode.allocations.heap.%s", imageSize.name);
+		Report(name, (double)heap, "allocations");
+		snprintf(name, sizeof(name), "decode.allocations.arena.%s", imageSize.name);
+		Report(name, (double)arena, "allocations");
+		snprintf(name, sizeof(name), "decode.arena.%s", imageSize.name);
+		Report(name, elapsed, "us");
+
+		delete[] image.data;
+	}
+
+	// A whole decompile, decode plus writing the assembly out
+	Buffer image = MakeSyntheticImage(1024 * 1024);
+	const char* filename = "benchmark_decompiled.asm";
+	FILE* file = fopen(filename, "wb");
+
+	long long before = allocationCount;
+	double start = NowMicroseconds();
+	{
+		List<InstructionGeneric> instructions = Decoder::Decode(image);
+		BufferedWriter output(file);
+		Decompiler::Write(image, instructions, output);
+	}
+	double elapsed = NowMicroseconds() - start;
+	Report("decompile.allocations.1MB", (double)(allocationCount - before), "allocations");
+	Report("decompile.1MB", elapsed, "us");
+
+	fclose(file);
+	remove(filename);
+	delete[] image.data;
+}
+
+//----------------------------------------------
+// Decompile throughput
+// Megabytes of assembly written per second, to a file
+//----------------------------------------------
+void BenchmarkDecompileThroughput() {
+	Buffer image = MakeSyntheticImage(4 * 1024 * 1024);
+	const char* filename = "benchmark_decompiled.asm";
+
+	for (int streamed = 0; streamed <= 1; streamed++) {
+		FILE* file = fopen(filename, "wb");
+		setvbuf(file, nullptr, _IONBF, 0);
+
+		double start = NowMicroseconds();
+		{
+			BufferedWriter output(file, 1024 * 1024);
+			if (streamed) {
+				Decompiler::WriteStreamed(image, output);
+			}
+			else {
+				List<InstructionGeneric> instructions = Decoder::Decode(image);
+				Decompiler::Write(image, instructions, output);
+			}
+		}
+		double elapsed = NowMicroseconds() - start;
+		double megabytes = ftell(file) / (1024.0 * 1024.0);
+		fclose(file);
+
+		Report(streamed ? "decompile.throughput.streamed.4MB" : "decompile.throughput.labels.4MB", megabytes / (elapsed / 1e6), "MB/s");
+	}
+
+	remove(filename);
+	delete[] image.data;
+}
+
+//----------------------------------------------
+// Batch
+// Many small images decoded one after another, then on the thread pool
+//----------------------------------------------
+void DecodeImage(void* userData) {
+	Buffer& image = *(Buffer*)userData;
+	List<InstructionGeneric> instructions = Decoder::Decode(image);
+}
+
+void BenchmarkBatch() {
+	const int imageCount = 256;
+	Buffer image = MakeSyntheticImage(16 * 1024);
+
+	double start = NowMicroseconds();
+	for (int i = 0; i < imageCount; i++) {
+		DecodeImage(&image);
+	}
+	Report("batch.serial.256x16KB", NowMicroseconds() - start, "us");
+
+	ThreadPool pool;
+	start = NowMicroseconds();
+	for (int i = 0; i < imageCount; i++) {
+		pool.Submit(DecodeImage, &image);
+	}
+	pool.Wait();
+
+	char name[64];
+	snprintf(name, sizeof(name), "batch.pool.%d.256x16KB", pool.ThreadCount());
+	Report(name, NowMicroseconds() - start, "us");
+
+	delete[] image.data;
+}
+
+//----------------------------------------------
+// Batch runner
+// One guest per job on the pool, one thread against every thread. Each job gets its own bx
+// so no two runs are the same, all of them share one decoded Program
+//----------------------------------------------
+void BenchmarkBatchRunner() {
+	const int jobCount = 2000;
+	Buffer image = MakeSyntheticImage(16 * 1024);
+
+	BatchRunner::Batch batch;
+	batch.programs.Add(Program::Create(image));
+	batch.jobs = new BatchRunner::Job[jobCount];
+	batch.jobCount = jobCount;
+	for (int i = 0; i < jobCount; i++) {
+		batch.jobs[i].programFilename = "synthetic";
+		batch.jobs[i].program = batch.programs[0];
+		batch.jobs[i].stepLimit = BatchRunner::DEFAULT_STEP_LIMIT;
+		batch.jobs[i].registers.Add({ Register::BX, (word)i });
+	}
+
+	int threadCounts[] = { 1, 0 };
+	for (int lockstep = 0; lockstep <= 1; lockstep++) {
+		for (int threads : threadCounts) {
+			double start = NowMicroseconds();
+			BatchRunner::RunJobs(batch, threads, lockstep != 0);
+			double elapsed = NowMicroseconds() - start;
+
+			char name[96];
+			snprintf(name, sizeof(name), "batch_runner.jobs_per_second.%s.%s", lockstep ? "lockstep" : "per_job", threads ? "1_thread" : "all_threads");
+			Report(name, jobCount / (elapsed / 1e6), "jobs/s");
+		}
+	}
+
+	delete[] image.data;
+}
+
+// Fills the framebuffer with a gradient, 64 rows of 64 pixels from bp onwards
+static const byte pixelKernel[] = {
+	0xba, 0x00, 0x00,           // mov dx, 0
+	0xb9, 0x00, 0x00,           // y: mov cx, 0
+	0x89, 0xd0,                 // x: mov ax, dx
+	0x89, 0xcb,                 // mov bx, cx
+	0x83, 0xc0, 0x32,           // add ax, 50
+	0x83, 0xc3, 0x32,           // add bx, 50
+	0x88, 0x46, 0x00,           // mov [bp+0], al
+	0xc6, 0x46, 0x01, 0x00,     // mov [bp+1], byte 0
+	0x88, 0x5e, 0x02,           // mov [bp+2], bl
+	0xc6, 0x46, 0x03, 0xff,     // mov [bp+3], byte 255
+	0x83, 0xc5, 0x04,           // add bp, 4
+	0x83, 0xc1, 0x01,           // add cx, 1
+	0x83, 0xf9, 0x40,           // cmp cx, 64
+	0x75, 0xdd,                 // jnz x
+	0x83, 0xc2, 0x01,           // add dx, 1
+	0x83, 0xfa, 0x40,           // cmp dx, 64
+	0x75, 0xd2,                 // jnz y
+};
+
+//----------------------------------------------
+// Lockstep
+// The pixel fill loop from Testing/test.asm on many CPUs, each drawing to its own address,
+// one CPU at a time and then in Lockstep groups. Single threaded, so this is the gain per core
+//----------------------------------------------
+void BenchmarkLockstep() {
+	const int cpuCount = 256;
+	Buffer image = { (byte*)pixelKernel, (int)sizeof(pixelKernel) };
+	Program* program = Program::Create(image);
+	CPU* cpus = new CPU[cpuCount];
+	CPU* pointers[cpuCount];
+
+	for (int lockstep = 0; lockstep <= 1; lockstep++) {
+		for (int i = 0; i < cpuCount; i++) {
+			cpus[i].Reset();
+			cpus[i].LoadProgram(program);
+			cpus[i].bp = (word)(0x00f0 + i * 4);
+			pointers[i] = &cpus[i];
+		}
+
+		double start = NowMicroseconds();
+		if (lockstep) {
+			Lockstep::Run(pointers, cpuCount, 1 << 20);
+		}
+		else {
+			for (int i = 0; i < cpuCount; i++) {
+				cpus[i].Run(1 << 20);
+			}
+		}
+		double elapsed = NowMicroseconds() - start;
+
+		qword instructions = 0;
+		for (int i = 0; i < cpuCount; i++) {
+			instructions += cpus[i].instructionCount;
+		}
+		Report(lockstep ? "lockstep.mips.pixel_kernel" : "scalar.mips.pixel_kernel", instructions / elapsed, "MIPS");
+	}
+
+	delete[] cpus;
+	program->Release();
+}
+
+//----------------------------------------------
+// Fork
+// Many what-if runs from one point part way through a program, forked copy-on-write
+// against replaying the program from the start each time
+//----------------------------------------------
+void BenchmarkFork() {
+	const int forkCount = 4096;
+	const int replayCount = 256;
+	const qword warmup = 20000;
+	const qword whatIf = 1000;
+	Buffer image = { (byte*)pixelKernel, (int)sizeof(pixelKernel) };
+	Program* program = Program::Create(image);
+
+	CPU parent;
+	parent.LoadProgram(program);
+	parent.bp = 0x00f0;
+	parent.Run(warmup);
+
+	CPU** children = new CPU*[forkCount];
+	long long before = allocationBytes;
+	double start = NowMicroseconds();
+	for (int i = 0; i < forkCount; i++) {
+		children[i] = parent.Fork();
+	}
+	double elapsed = NowMicroseconds() - start;
+	Report("fork.time", elapsed / forkCount, "us");
+	Report("fork.bytes_per_fork", (double)(allocationBytes - before) / forkCount, "bytes");
+
+	// Every child takes a different row and draws into it, copying only the pages it writes
+	long long ownedPages = 0;
+	for (int i = 0; i < forkCount; i++) {
+		children[i]->dx = (word)(i & 63);
+		children[i]->Run(whatIf);
+		ownedPages += children[i]->memory.OwnedPages();
+	}
+	Report("fork.owned_bytes_after_run", (double)ownedPages * GuestMemory::PAGE_SIZE / forkCount, "bytes");
+
+	for (int i = 0; i < forkCount; i++) {
+		delete children[i];
+	}
+	delete[] children;
+
+	CPU replay;
+	start = NowMicroseconds();
+	for (int i = 0; i < replayCount; i++) {
+		replay.Reset();
+		replay.LoadProgram(program);
+		replay.bp = 0x00f0;
+		replay.Run(warmup);
+	}
+	elapsed = NowMicroseconds() - start;
+	Report("fork.replay_time", elapsed / replayCount, "us");
+
+	program->Release();
+}
+
+//----------------------------------------------
+// Reset
+// Getting back to a freshly loaded program after a short run, by resetting and loading again or by
+// putting back the pages the run wrote. The pixel loop touches more pages the longer it runs
+//----------------------------------------------
+void BenchmarkReset() {
+	const int repetitions = 2000;
+	Buffer image = { (byte*)pixelKernel, (int)sizeof(pixelKernel) };
+	Program* program = Program::Create(image);
+	qword runLengths[] = { 1000, 50000 };
+
+	for (qword run : runLengths) {
+		CPU cpu;
+		for (int baseline = 0; baseline <= 1; baseline++) {
+			cpu.Reset();
+			cpu.LoadProgram(program);
+			cpu.bp = 0x00f0;
+			cpu.SaveBaseline();
+
+			double resetTime = 0;
+			for (int i = 0; i < repetitions; i++) {
+				cpu.Run(run);
+
+				double start = NowMicroseconds();
+				if (baseline) {
+					cpu.ResetToBaseline();
+				}
+				else {
+					cpu.Reset();
+					cpu.LoadProgram(program);
+					cpu.bp = 0x00f0;
+				}
+				resetTime += NowMicroseconds() - start;
+			}
+
+			char name[96];
+			snprintf(name, sizeof(name), "reset.%s.after_%llu", baseline ? "baseline" : "full", (unsigned long long)run);
+			Report(name, resetTime / repetitions, "us");
+		}
+	}
+
+	program->Release();
+}
+
+//----------------------------------------------
+// Save state
+// Writing a running machine to disk and getting it back, against replaying the run that got it there
+//----------------------------------------------
+void BenchmarkSaveState() {
+	const int repetitions = 200;
+	const qword run = 40000;
+	const char* filename = "benchmark.state";
+	Buffer image = { (byte*)pixelKernel, (int)sizeof(pixelKernel) };
+	Program* program = Program::Create(image);
+
+	CPU cpu;
+	cpu.LoadProgram(program);
+	cpu.bp = 0x00f0;
+	cpu.Run(run);
+
+	double writeTime = 0;
+	for (int i = 0; i < repetitions; i++) {
+		double start = NowMicroseconds();
+		SaveState::Write(cpu, filename);
+		writeTime += NowMicroseconds() - start;
+	}
+
+	// The kernel is still running at 40000, so the restored machine has 1000 more to go.
+	// Restoring alone only maps the file, the first run after it pays for the pages it touches
+	double restoreTime = 0;
+	double firstRunTime = 0;
+	CPU restored;
+	for (int i = 0; i < repetitions; i++) {
+		double start = NowMicroseconds();
+		SaveState::Read(filename, restored);
+		double restoredAt = NowMicroseconds();
+		restored.Run(1000);
+		restoreTime += restoredAt - start;
+		firstRunTime += NowMicroseconds() - restoredAt;
+	}
+
+	double replayTime = 0;
+	CPU replayed;
+	for (int i = 0; i < repetitions; i++) {
+		double start = NowMicroseconds();
+		replayed.Reset();
+		replayed.LoadProgram(program);
+		replayed.bp = 0x00f0;
+		replayed.Run(run);
+		replayTime += NowMicroseconds() - start;
+	}
+
+	MappedFile file;
+	file.Open(filename);
+	Report("savestate.file_bytes", file.buffer.size, "bytes");
+	file.Close();
+	remove(filename);
+
+	Report("savestate.write", writeTime / repetitions, "us");
+	Report("savestate.restore", restoreTime / repetitions, "us");
+	Report("savestate.restore_then_1000", (restoreTime + firstRunTime) / repetitions, "us");
+	Report("savestate.replay_40000", replayTime / repetitions, "us");
+
+	program->Release();
+}
+
+//----------------------------------------------
+// C API
+// What a host pays to cross the API per call, stepping one instruction at a time against one long run
+//----------------------------------------------
+void BenchmarkApi() {
+	const int calls = 1000000;
+	const qword instructions = 1000000;
+	// add ax, 1 / jmp back to it, so the machine never halts
+	static const byte loop[] = { 0x05, 0x01, 0x00, 0xE9, 0xFA, 0xFF };
+
+	SimMachine* machine = sim_create();
+	sim_load(machine, loop, (int)sizeof(loop));
+
+	double start = NowMicroseconds();
+	for (int i = 0; i < calls; i++) {
+		sim_run(machine, 1);
+	}
+	double elapsed = NowMicroseconds() - start;
+	Report("api.run_1", elapsed * 1000 / calls, "ns/call");
+
+	start = NowMicroseconds();
+	sim_run(machine, instructions);
+	elapsed = NowMicroseconds() - start;
+	Report("api.run_1e6", elapsed * 1000 / instructions, "ns/instruction");
+
+	// The same run straight on the CPU, without the API in between
+	CPU cpu;
+	cpu.LoadProgram(Buffer{ (byte*)loop, (int)sizeof(loop) });
+	start = NowMicroseconds();
+	cpu.Run(instructions);
+	elapsed = NowMicroseconds() - start;
+	Report("api.direct_run_1e6", elapsed * 1000 / instructions, "ns/instruction");
+
+	if (sim_instruction_count(machine) != calls + instructions) printf("api ran %llu instructions\n", (unsigned long long)sim_instruction_count(machine));
+	sim_destroy(machine);
+}
+
+//----------------------------------------------
+// Limits
+// Throughput of a loop that never halts, with no limits and with all three set too high to be reached
+//----------------------------------------------
+int CompareDoubles(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+void BenchmarkLimits() {
+	// The cost is far below the noise of one long run. Many short runs take turns instead, the one going first
+	// alternating, and the overhead is the median over the pairs of one against the other. A busy stretch then
+	// lands on both runs of a pair, or on one pair of many
+	const int repetitions = 1001;
+	const qword instructions = 200000;
+	// mov [bx], ax / add ax, 1 / jmp back to the mov, one write every three instructions
+	static const byte loop[] = { 0x89, 0x07, 0x05, 0x01, 0x00, 0xE9, 0xF8, 0xFF };
+	Program* program = Program::Create(Buffer{ (byte*)loop, (int)sizeof(loop) });
+
+	// Each side keeps its CPU, so both run with warm caches
+	CPU* cpus = new CPU[2];
+	double* overheads = new double[repetitions];
+	double best[2] = { 1e30, 1e30 };
+	for (int rep = 0; rep < repetitions; rep++) {
+		double elapsed[2];
+		for (int turn = 0; turn <= 1; turn++) {
+			int limited = turn ^ (rep & 1);
+			CPU& cpu = cpus[limited];
+			cpu.Reset();
+			cpu.LoadProgram(program);
+			cpu.bx = 0x1000;
+			if (limited) cpu.limits = { instructions * 2, 3600ull * 1000000, instructions };
+
+			double start = NowMicroseconds();
+			cpu.Run(instructions);
+			elapsed[limited] = NowMicroseconds() - start;
+			if (elapsed[limited] < best[limited]) best[limited] = elapsed[limited];
+			if (cpu.IsHalted()) printf("limits: the loop halted, %s\n", CPU::ExitReasonName(cpu.exitReason));
+		}
+		overheads[rep] = (elapsed[1] - elapsed[0]) * 100 / elapsed[0];
+	}
+	qsort(overheads, repetitions, sizeof(double), CompareDoubles);
+	Report("limits.mips.none", instructions / best[0], "MIPS");
+	Report("limits.mips.all", instructions / best[1], "MIPS");
+	Report("limits.overhead", overheads[repetitions / 2], "%");
+
+	delete[] overheads;
+	delete[] cpus;
+	program->Release();
+}
+
+//----------------------------------------------
+// Lists
+// Growing, copying and moving the lists a decode produces
+//----------------------------------------------
+void BenchmarkLists() {
+	const int repetitions = 5;
+	const int count = 1 << 20;
+
+	double best = 1e30;
+	for (int rep = 0; rep < repetitions; rep++) {
+		double start = NowMicroseconds();
+		List<int> numbers;
+		for (int i = 0; i < count; i++) {
+			numbers.Add(i);
+		}
+		double elapsed = NowMicroseconds() - start;
+		if (elapsed < best) best = elapsed;
+	}
+	Report("list.add.int.1M", best, "us");
+
+	best = 1e30;
+	InstructionGeneric instruction = {};
+	for (int rep = 0; rep < repetitions; rep++) {
+		double start = NowMicroseconds();
+		List<InstructionGeneric> instructions;
+		for (int i = 0; i < count; i++) {
+			instruction.address = i;
+			instructions.Add(instruction);
+		}
+		double elapsed = NowMicroseconds() - start;
+		if (elapsed < best) best = elapsed;
+	}
+	Report("list.add.instruction.1M", best, "us");
+
+	Buffer image = MakeSyntheticImage(256 * 1024);
+	List<InstructionGeneric> decoded = Decoder::Decode(image);
+
+	best = 1e30;
+	for (int rep = 0; rep < repetitions; rep++) {
+		double start = NowMicroseconds();
+		List<InstructionGeneric> copy = decoded;
+		double elapsed = NowMicroseconds() - start;
+		if (elapsed < best) best = elapsed;
+	}
+	Report("list.copy.instructions.256KB", best, "us");
+
+	best = 1e30;
+	for (int rep = 0; rep < repetitions; rep++) {
+		List<InstructionGeneric> source = decoded;
+		double start = NowMicroseconds();
+		List<InstructionGeneric> moved = std::move(source);
+		double elapsed = NowMicroseconds() - start;
+		if (elapsed < best) best = elapsed;
+	}
+	Report("list.move.instructions.256KB", best, "us");
+
+	best = 1e30;
+	for (int rep = 0; rep < repetitions; rep++) {
+		double start = NowMicroseconds();
+		List<InstructionGeneric> instructions = Decoder::Decode(image);
+		double elapsed = NowMicroseconds() - start;
+		if (elapsed < best) best = elapsed;
+	}
+	Report("decode.heap.256KB", best, "us");
+
+	delete[] image.data;
+}
+
+//----------------------------------------------
+// Sweep
+// Many CPUs running the same binary, each with its own decoded copy or all sharing one Program
+//----------------------------------------------
+void BenchmarkSweep() {
+	const int cpuCount = 100;
+	Buffer image = MakeSyntheticImage(16 * 1024);
+	CPU* cpus[cpuCount];
+
+	for (int shared = 0; shared <= 1; shared++) {
+		Program* program = shared ? Program::Create(image) : nullptr;
+
+		long long before = allocationBytes;
+		double start = NowMicroseconds();
+		for (int i = 0; i < cpuCount; i++) {
+			cpus[i] = new CPU();
+			if (shared) cpus[i]->LoadProgram(program);
+			else cpus[i]->LoadProgram(image);
+			while (!cpus[i]->IsHalted()) {
+				cpus[i]->Run(1 << 20);
+			}
+		}
+		double elapsed = NowMicroseconds() - start;
+		long long bytes = allocationBytes - before;
+
+		for (int i = 0; i < cpuCount; i++) {
+			delete cpus[i];
+		}
+		if (program) program->Release();
+
+		Report(shared ? "sweep.bytes_per_cpu.shared" : "sweep.bytes_per_cpu.private", (double)bytes / cpuCount, "bytes");
+		Report(shared ? "sweep.time.shared" : "sweep.time.private", elapsed, "us");
+	}
+
+	delete[] image.data;
+}
+
+//----------------------------------------------
+// Round trip
+// Decode, encode and decode again over every encoding the round trip tester enumerates
+//----------------------------------------------
+void BenchmarkRoundTrip() {
+	const int repetitions = 3;
+
+	double best = 1e30;
+	RoundTrip::Result result;
+	for (int rep = 0; rep < repetitions; rep++) {
+		double start = NowMicroseconds();
+		RoundTrip::Run(result, 0);
+		double elapsed = NowMicroseconds() - start;
+		if (elapsed < best) best = elapsed;
+	}
+	Report("roundtrip.encodings_per_second", result.checked / (best / 1e6), "encodings/s");
+
+	// Encoding alone, over a decoded image
+	Buffer image = MakeSyntheticImage(1024 * 1024);
+	List<InstructionGeneric> decoded = Decoder::Decode(image);
+	byte encoded[Encoder::MAX_INSTRUCTION_SIZE];
+	long long encodedBytes = 0;
+
+	best = 1e30;
+	for (int rep = 0; rep < repetitions; rep++) {
+		double start = NowMicroseconds();
+		for (int i = 0; i < decoded.Size(); i++) {
+			encodedBytes += Encoder::EncodeInstruction(decoded[i], encoded);
+		}
+		double elapsed = NowMicroseconds() - start;
+		if (elapsed < best) best = elapsed;
+	}
+	Report("encode.instructions_per_second.1MB", decoded.Size() / (best / 1e6), "instructions/s");
+	if (encodedBytes == 0) printf("encode produced nothing\n");
+
+	delete[] image.data;
+}
+
+// Every benchmark by name, the command line picks them by prefix: "Benchmark step flags" runs
+// step.* and flags.*, no arguments runs everything
+struct BenchmarkEntry {
+	const char* name;
+	void (*run)();
+};
+
+static const BenchmarkEntry benchmarks[] = {
+	{ "startup", BenchmarkStartup },
+	{ "decode", BenchmarkDecode },
+	{ "decode.class", BenchmarkDecodeClasses },
+	{ "decodecache", BenchmarkDecodeCache },
+	{ "step", BenchmarkStepForms },
+	{ "flags", BenchmarkFlags },
+	{ "format", BenchmarkFormatting },
+	{ "allocations", BenchmarkAllocations },
+	{ "decompile", BenchmarkDecompileThroughput },
+	{ "batch", BenchmarkBatch },
+	{ "batchrunner", BenchmarkBatchRunner },
+	{ "lockstep", BenchmarkLockstep },
+	{ "fork", BenchmarkFork },
+	{ "reset", BenchmarkReset },
+	{ "savestate", BenchmarkSaveState },
+	{ "api", BenchmarkApi },
+	{ "limits", BenchmarkLimits },
+	{ "list", BenchmarkLists },
+	{ "sweep", BenchmarkSweep },
+	{ "roundtrip", BenchmarkRoundTrip },
+};
+
+int main(int argc, char* argv[]) {
+	int ran = 0;
+	for (BenchmarkEntry const& benchmark : benchmarks) {
+		bool selected = (argc < 2);
+		for (int i = 1; i < argc && !selected; i++) {
+			selected = strncmp(benchmark.name, argv[i], strlen(argv[i])) == 0;
+		}
+		if (!selected) continue;
+		benchmark.run();
+		ran++;
+	}
+	if (ran == 0) {
+		printf("No benchmark starts with");
+		for (int i = 1; i < argc; i++) printf(" \"%s\"", argv[i]);
+		printf("\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,34 @@
+// libFuzzer target for the decoder and the instruction formatting.
+// Any image has to decode without reading outside the buffer, crashing or leaking, whether or not it is valid code.
+// Built and run by fuzz.sh, see the README.
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Types.h"
+#include "Decoder.h"
+#include "Arena.h"
+#include "StringifyTypes.h"
+
+static Arena arena;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	// The decoder never writes to the buffer, so the fuzzer's own allocation is used
+	// as is and a read past its end is caught by the address sanitizer
+	Buffer buffer = { (byte*)data, (int)size };
+
+	// Linear sweep, stops at the first unsupported opcode
+	List<InstructionGeneric> instructions = Decoder::Decode(buffer);
+
+	arena.Reset();
+	Decoder::Decode(buffer, arena);
+
+	// Following jumps keeps whatever decoded before a bad opcode, so most inputs reach the formatting
+	List<InstructionGeneric> reachable = Decoder::DecodeReachable(buffer);
+	char text[16];
+	for (int i = 0; i < reachable.Size(); i++) {
+		String full = InstructionToString(reachable[i]);
+		// A buffer too small for most instructions exercises the truncation
+		FormatInstruction(reachable[i], text, sizeof(text));
+	}
+	return 0;
+}
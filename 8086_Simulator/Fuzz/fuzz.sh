@@ -0,0 +1,17 @@
+#!/bin/sh
+# Builds the decoder fuzz target with clang's libFuzzer and the address and undefined behaviour sanitizers,
+# seeds the corpus and runs it. Extra arguments go to libFuzzer, for example -max_total_time=60 or -jobs=8.
+# Local only, needs clang (and nasm for the seeds)
+set -e
+cd "$(dirname "$0")"
+SIMULATOR=../Simulator
+
+clang++ -std=c++14 -g -O1 -pthread -fsanitize=fuzzer,address,undefined -I$SIMULATOR \
+	FuzzDecoder.cpp $SIMULATOR/Decoder.cpp $SIMULATOR/Arena.cpp $SIMULATOR/String.cpp $SIMULATOR/StringifyTypes.cpp \
+	-o fuzz_decoder
+
+./make_corpus.sh
+
+# Decode errors go to stdout, closing it keeps the exec rate up, and so do short inputs.
+# New inputs that find coverage are added to corpus/
+./fuzz_decoder -close_fd_mask=1 -max_len=128 "$@" corpus
@@ -0,0 +1,14 @@
+#!/bin/sh
+# Seed corpus for the decoder fuzz target: every Testing/*.asm assembled with nasm, plus the prebuilt test binary
+set -e
+cd "$(dirname "$0")"
+mkdir -p corpus
+
+if command -v nasm > /dev/null; then
+	for source in ../../Testing/*.asm; do
+		nasm "$source" -o "corpus/$(basename "$source" .asm)"
+	done
+else
+	echo "nasm not found, seeding with the prebuilt binaries only"
+fi
+cp ../../Testing/test corpus/test_prebuilt
@@ -0,0 +1,74 @@
+#include "Arena.h"
+#include <string.h>
+
+Arena::Arena(size_t blockSize)
+	: blockAllocations(0), head(nullptr), blockSize(blockSize)
+{
+}
+
+Arena::~Arena() {
+	while (head) {
+		Block* next = head->next;
+		delete[] (char*)head;
+		head = next;
+	}
+}
+
+void Arena::AddBlock(size_t capacity) {
+	if (capacity < blockSize) capacity = blockSize;
+
+	Block* block = (Block*)new char[sizeof(Block) + capacity];
+	block->next = head;
+	block->capacity = capacity;
+	block->used = 0;
+	head = block;
+	blockAllocations++;
+}
+
+void* Arena::Allocate(size_t size, size_t alignment) {
+	if (head) {
+		size_t start = (head->used + alignment - 1) & ~(alignment - 1);
+		if (start + size <= head->capacity) {
+			head->used = start + size;
+			return BlockData(head) + start;
+		}
+	}
+
+	// Blocks start max aligned, so a fresh one always fits the allocation at offset 0
+	AddBlock(size);
+	head->used = size;
+	return BlockData(head);
+}
+
+bool Arena::Extend(void* allocation, size_t oldSize, size_t newSize) {
+	if (head == nullptr || (char*)allocation < BlockData(head) || (char*)allocation > BlockData(head) + head->used) return false;
+
+	size_t start = (char*)allocation - BlockData(head);
+	if (start + oldSize != head->used || start + newSize > head->capacity) return false;
+
+	head->used = start + newSize;
+	return true;
+}
+
+void Arena::Reserve(size_t bytes) {
+	if (head && head->capacity - head->used >= bytes) return;
+	AddBlock(bytes);
+}
+
+void Arena::Reset() {
+	if (head == nullptr) return;
+
+	while (head->next) {
+		Block* next = head->next->next;
+		delete[] (char*)head->next;
+		head->next = next;
+	}
+	head->used = 0;
+}
+
+char* Arena::CopyString(const char* str, int length) {
+	char* copy = (char*)Allocate(length + 1, 1);
+	memcpy(copy, str, length);
+	copy[length] = '\0';
+	return copy;
+}
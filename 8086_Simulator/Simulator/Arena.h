@@ -0,0 +1,58 @@
+#pragma once
+#include <stddef.h>
+#include <new>
+
+//----------------------------------------------
+// Arena
+// Bump allocator. Allocations are carved out of large blocks and are never
+// freed one by one, Reset releases everything at once. Nothing allocated here
+// has its destructor run, so only put things in it whose memory lives here too
+//----------------------------------------------
+class Arena {
+public:
+	explicit Arena(size_t blockSize = 64 * 1024);
+	~Arena();
+
+	void* Allocate(size_t size, size_t alignment = alignof(max_align_t));
+
+	// Grow the most recent allocation in place. Fails if something was allocated after it or the block is full
+	bool Extend(void* allocation, size_t oldSize, size_t newSize);
+
+	// Make sure the next "bytes" worth of allocations fit in the current block
+	void Reserve(size_t bytes);
+
+	// Frees every allocation. The current block is kept to be reused
+	void Reset();
+
+	template <typename T>
+	T* AllocateArray(int count) {
+		return (T*)Allocate(sizeof(T) * count, alignof(T));
+	}
+
+	template <typename T, typename... Args>
+	T* New(Args&&... args) {
+		return new (Allocate(sizeof(T), alignof(T))) T(static_cast<Args&&>(args)...);
+	}
+
+	// Null terminated copy of "length" characters
+	char* CopyString(const char* str, int length);
+
+	// Number of blocks taken from the heap since construction
+	int blockAllocations;
+
+private:
+	Arena(const Arena&) = delete;
+	void operator=(const Arena&) = delete;
+
+	struct Block {
+		Block* next;
+		size_t capacity;
+		size_t used;
+	};
+
+	void AddBlock(size_t capacity);
+	inline char* BlockData(Block* block) { return (char*)(block + 1); }
+
+	Block* head;
+	size_t blockSize;
+};
@@ -0,0 +1,360 @@
+#include "BatchRunner.h"
+#include <stdlib.h>
+#include <string.h>
+#include "BufferedWriter.h"
+#include "DosServices.h"
+#include "Lockstep.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+
+namespace BatchRunner {
+	Batch::Batch() : jobs(nullptr), jobCount(0) {}
+
+	Batch::~Batch() {
+		delete[] jobs;
+		for (int i = 0; i < programs.Size(); i++) {
+			programs[i]->Release();
+		}
+	}
+
+	//----------------------------------------------
+	// Manifest
+	//----------------------------------------------
+	struct RegisterName {
+		const char* name;
+		Register reg;
+	};
+
+	static const RegisterName registerNames[] = {
+		{ "ax", Register::AX }, { "bx", Register::BX }, { "cx", Register::CX }, { "dx", Register::DX },
+		{ "sp", Register::SP }, { "bp", Register::BP }, { "si", Register::SI }, { "di", Register::DI },
+		{ "cs", Register::CS }, { "ds", Register::DS }, { "ss", Register::SS }, { "es", Register::ES },
+		{ "ip", Register::IP }, { "flags", Register::FLAGS },
+	};
+
+	bool ParseNumber(const char* text, qword& value) {
+		char* end;
+		value = strtoull(text, &end, 0);
+		return end != text && *end == '\0';
+	}
+
+	int HexDigit(char c) {
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+		return -1;
+	}
+
+	// "<address>:<hex bytes>"
+	bool ParsePatch(char* text, Job& job) {
+		char* colon = strchr(text, ':');
+		if (colon == nullptr) return false;
+		*colon = '\0';
+
+		qword address;
+		if (!ParseNumber(text, address) || address >= CPU::MEMORY_SIZE) return false;
+
+		MemoryPatch& patch = job.patches.EmplaceBack();
+		patch.address = (word)address;
+		patch.start = job.memoryBytes.Size();
+		for (char* c = colon + 1; *c; c += 2) {
+			int high = HexDigit(c[0]);
+			int low = (high >= 0) ? HexDigit(c[1]) : -1;
+			if (low < 0) return false;
+			job.memoryBytes.Add((byte)((high << 4) | low));
+		}
+		patch.size = job.memoryBytes.Size() - patch.start;
+		return patch.size > 0;
+	}
+
+	bool ParseSetting(char* token, Job& job) {
+		char* equals = strchr(token, '=');
+		if (equals == nullptr) return false;
+		*equals = '\0';
+		char* value = equals + 1;
+
+		if (strcmp(token, "mem") == 0) return ParsePatch(value, job);
+
+		qword number;
+		if (!ParseNumber(value, number)) return false;
+		if (strcmp(token, "steps") == 0) {
+			job.stepLimit = number;
+			return true;
+		}
+		if (strcmp(token, "time") == 0) {
+			job.limits.microseconds = number * 1000;
+			return true;
+		}
+		if (strcmp(token, "writes") == 0) {
+			job.limits.memoryWrites = number;
+			return true;
+		}
+
+		for (auto& name : registerNames) {
+			if (strcmp(token, name.name) == 0 && number <= 0xffff) {
+				job.registers.Add({ name.reg, (word)number });
+				return true;
+			}
+		}
+		return false;
+	}
+
+	Program* FindOrLoadProgram(const char* filename, List<String>& names, Batch& batch) {
+		for (int i = 0; i < names.Size(); i++) {
+			if (names[i].Equals(filename)) return batch.programs[i];
+		}
+
+		MappedFile file;
+		if (!file.Open(filename)) return nullptr;
+		names.Add(filename);
+		batch.programs.Add(Program::Create(file.buffer));
+		return batch.programs[batch.programs.Size() - 1];
+	}
+
+	bool ReadManifest(const char* filename, Batch& batch) {
+		FILE* manifest = fopen(filename, "rb");
+		if (manifest == nullptr) {
+			printf("Error: Could not open %s\n", filename);
+			return false;
+		}
+
+		// Lines are kept until the count is known, so the jobs can go in one array the pool points into
+		List<String> lines;
+		char line[4096];
+		while (fgets(line, sizeof(line), manifest)) {
+			// Without a newline it either ran into the end of the file or didn't fit, and the rest would be read as a line of its own
+			if (strchr(line, '\n') == nullptr && !feof(manifest)) {
+				printf("Error: %s line %i is longer than %i characters\n", filename, lines.Size() + 1, (int)sizeof(line) - 2);
+				fclose(manifest);
+				return false;
+			}
+			lines.Add(line);
+		}
+		fclose(manifest);
+
+		batch.jobs = new Job[lines.Size()];
+		batch.jobCount = 0;
+		List<String> programNames;
+		for (int i = 0; i < lines.Size(); i++) {
+			strncpy(line, lines[i].c_str(), sizeof(line) - 1);
+			line[sizeof(line) - 1] = '\0';
+
+			const char* separators = " \t\r\n";
+			char* token = strtok(line, separators);
+			if (token == nullptr || token[0] == '#') continue;
+
+			Job& job = batch.jobs[batch.jobCount];
+			job.programFilename = token;
+			job.stepLimit = DEFAULT_STEP_LIMIT;
+			job.limits = { 0, 0, 0 };
+			job.program = FindOrLoadProgram(token, programNames, batch);
+			if (job.program == nullptr) return false;
+
+			while ((token = strtok(nullptr, separators)) != nullptr) {
+				String setting = token;
+				if (!ParseSetting(token, job)) {
+					printf("Error: %s line %i: can't read \"%s\"\n", filename, i + 1, setting.c_str());
+					return false;
+				}
+			}
+			batch.jobCount++;
+		}
+		return true;
+	}
+
+	//----------------------------------------------
+	// Running
+	//----------------------------------------------
+	qword HashMemory(GuestMemory const& memory) {
+		// Four lanes side by side so the multiplies don't wait on each other, folded together at the end
+		const qword prime = 1099511628211ull;
+		qword lanes[4] = { 14695981039346656037ull, 14695981039346656037ull, 14695981039346656037ull, 14695981039346656037ull };
+		for (int page = 0; page < GuestMemory::PAGE_COUNT; page++) {
+			byte const* data = memory.PageData(page);
+			for (int i = 0; i < GuestMemory::PAGE_SIZE; i += 4 * sizeof(qword)) {
+				qword chunks[4];
+				memcpy(chunks, &data[i], sizeof(chunks));
+				lanes[0] = (lanes[0] ^ chunks[0]) * prime;
+				lanes[1] = (lanes[1] ^ chunks[1]) * prime;
+				lanes[2] = (lanes[2] ^ chunks[2]) * prime;
+				lanes[3] = (lanes[3] ^ chunks[3]) * prime;
+			}
+		}
+
+		qword hash = lanes[0];
+		for (int i = 1; i < 4; i++) {
+			hash = (hash ^ lanes[i]) * prime;
+		}
+		return hash;
+	}
+
+	// The CPUs are kept from job to job. One that last ran the same program only puts back the pages it wrote
+	void PrepareJob(Job& job, CPU& cpu) {
+		if (cpu.baseline && cpu.baseline->program == job.program) {
+			cpu.ResetToBaseline();
+		}
+		else {
+			cpu.Reset();
+			cpu.printErrors = false;
+			cpu.LoadProgram(job.program);
+			cpu.SaveBaseline();
+		}
+		cpu.limits = job.limits;
+		for (int i = 0; i < job.registers.Size(); i++) {
+			RegisterValue& setting = job.registers[i];
+			if (setting.reg == Register::FLAGS) cpu.flags = setting.value;
+			else cpu.SetRegister(setting.reg, setting.value);
+		}
+		// Written through the CPU, so a patch over the program's code is decoded fresh
+		for (int i = 0; i < job.patches.Size(); i++) {
+			MemoryPatch& patch = job.patches[i];
+			for (int b = 0; b < patch.size; b++) {
+				cpu.SetMemory(EffectiveAddress::DIRECT_ADDRESS, (word)(patch.address + b), job.memoryBytes[patch.start + b]);
+			}
+		}
+	}
+
+	void FinishJob(Job& job, CPU& cpu) {
+		Result& result = job.result;
+		result.ax = cpu.ax, result.bx = cpu.bx, result.cx = cpu.cx, result.dx = cpu.dx;
+		result.sp = cpu.sp, result.bp = cpu.bp, result.si = cpu.si, result.di = cpu.di;
+		result.cs = cpu.cs, result.ds = cpu.ds, result.ss = cpu.ss, result.es = cpu.es;
+		result.ip = cpu.ip, result.flags = cpu.flags;
+		result.steps = cpu.instructionCount;
+		result.exitReason = cpu.exitReason;
+		result.exitCode = cpu.exitCode;
+		result.memoryHash = HashMemory(cpu.memory);
+	}
+
+	void RunJob(void* userData) {
+		Job& job = *(Job*)userData;
+
+		static thread_local CPU cpu;
+		PrepareJob(job, cpu);
+
+		// Thousands of guests printing at once would only interleave, their output is dropped
+		BufferedWriter discard(nullptr, 256);
+		Dos::Install(cpu, discard);
+		cpu.Run(job.stepLimit);
+		FinishJob(job, cpu);
+	}
+
+	//----------------------------------------------
+	// Lockstep groups
+	// Jobs running the same program for the same number of steps go to Lockstep together,
+	// wherever they are in the manifest. Lockstep doesn't check limits between steps, limited jobs run on their own
+	//----------------------------------------------
+	struct JobGroup {
+		Job* jobs[Lockstep::LANES];
+		int count;
+	};
+
+	bool RunsAlone(Job const& job) {
+		return job.limits.instructions != 0 || job.limits.microseconds != 0 || job.limits.memoryWrites != 0;
+	}
+
+	void GroupJobs(Batch& batch, List<JobGroup>& groups) {
+		// Per program, the group still taking jobs or -1
+		List<int> open;
+		for (int p = 0; p < batch.programs.Size(); p++) {
+			open.Add(-1);
+		}
+
+		for (int i = 0; i < batch.jobCount; i++) {
+			Job& job = batch.jobs[i];
+			if (RunsAlone(job)) continue;
+			int p = 0;
+			while (p < batch.programs.Size() && batch.programs[p] != job.program) p++;
+
+			int g = (p < open.Size()) ? open[p] : -1;
+			if (g < 0 || groups[g].count == Lockstep::LANES || groups[g].jobs[0]->stepLimit != job.stepLimit) {
+				g = groups.Size();
+				groups.EmplaceBack().count = 0;
+				if (p < open.Size()) open[p] = g;
+			}
+			groups[g].jobs[groups[g].count++] = &job;
+		}
+	}
+
+	void RunJobGroup(void* userData) {
+		JobGroup& group = *(JobGroup*)userData;
+
+		static thread_local CPU cpus[Lockstep::LANES];
+		CPU* lanes[Lockstep::LANES];
+		BufferedWriter discard(nullptr, 256);
+		for (int i = 0; i < group.count; i++) {
+			PrepareJob(*group.jobs[i], cpus[i]);
+			Dos::Install(cpus[i], discard);
+			lanes[i] = &cpus[i];
+		}
+
+		Lockstep::Run(lanes, group.count, group.jobs[0]->stepLimit);
+
+		for (int i = 0; i < group.count; i++) {
+			FinishJob(*group.jobs[i], cpus[i]);
+		}
+	}
+
+	void RunJobs(Batch& batch, int threadCount, bool lockstep) {
+		ThreadPool pool(threadCount);
+		if (!lockstep) {
+			for (int i = 0; i < batch.jobCount; i++) {
+				pool.Submit(RunJob, &batch.jobs[i]);
+			}
+			pool.Wait();
+			return;
+		}
+
+		// Every group is in place before the first is handed out, the list doesn't move under the workers
+		List<JobGroup> groups;
+		GroupJobs(batch, groups);
+		for (int i = 0; i < groups.Size(); i++) {
+			pool.Submit(RunJobGroup, &groups[i]);
+		}
+		for (int i = 0; i < batch.jobCount; i++) {
+			if (RunsAlone(batch.jobs[i])) pool.Submit(RunJob, &batch.jobs[i]);
+		}
+		pool.Wait();
+	}
+
+	//----------------------------------------------
+	// Results
+	//----------------------------------------------
+	// A job still running when its steps ran out has no exit reason of its own
+	const char* ExitReasonName(Result const& result) {
+		if (result.exitReason == CPU::ExitReason::NONE) return "step_limit";
+		return CPU::ExitReasonName(result.exitReason);
+	}
+
+	// Quotes and backslashes (Windows paths) are escaped, nothing else in a filename needs it
+	void WriteJsonString(BufferedWriter& output, const char* text) {
+		output.WriteChar('"');
+		for (const char* c = text; *c; c++) {
+			if (*c == '"' || *c == '\\') output.WriteChar('\\');
+			output.WriteChar(*c);
+		}
+		output.WriteChar('"');
+	}
+
+	void WriteResults(Batch& batch, FILE* file) {
+		BufferedWriter output(file, 1024 * 1024);
+		const int lineCapacity = 512;
+		for (int i = 0; i < batch.jobCount; i++) {
+			Job& job = batch.jobs[i];
+			Result& r = job.result;
+
+			char* out = output.Reserve(lineCapacity);
+			output.Commit(String::FormatTo(out, lineCapacity, "{\"job\": %i, \"program\": ", i));
+			WriteJsonString(output, job.programFilename.c_str());
+
+			out = output.Reserve(lineCapacity);
+			output.Commit(String::FormatTo(out, lineCapacity,
+				", \"exit\": \"%s\", \"exit_code\": %i, \"steps\": %llu, "
+				"\"ax\": %u, \"bx\": %u, \"cx\": %u, \"dx\": %u, \"sp\": %u, \"bp\": %u, \"si\": %u, \"di\": %u, "
+				"\"cs\": %u, \"ds\": %u, \"ss\": %u, \"es\": %u, \"ip\": %u, \"flags\": %u, \"memory_hash\": \"%016llx\"}\n",
+				ExitReasonName(r), r.exitCode, (unsigned long long)r.steps,
+				r.ax, r.bx, r.cx, r.dx, r.sp, r.bp, r.si, r.di,
+				r.cs, r.ds, r.ss, r.es, r.ip, r.flags, (unsigned long long)r.memoryHash));
+		}
+	}
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <stdio.h>
+#include "Types.h"
+#include "List.h"
+#include "String.h"
+#include "Executor.h"
+#include "Program.h"
+#include "BufferedWriter.h"
+
+//----------------------------------------------
+// BatchRunner
+// Runs many guests in one process on a work stealing ThreadPool. Jobs running the same program
+// go in Lockstep groups, one group per task.
+// Jobs come from a manifest, one per line:
+//   <program> [steps=<n>] [time=<ms>] [writes=<n>] [<register>=<value>]... [mem=<address>:<hex bytes>]...
+// Registers are ax..di, sp, bp, cs, ds, ss, es, ip and flags, numbers are decimal or 0x hex.
+// Every job naming the same program shares one decoded Program. Jobs with a time or write limit run on their own
+// rather than in lockstep.
+// Results are written one JSON object per line, in manifest order
+//----------------------------------------------
+namespace BatchRunner {
+	struct RegisterValue {
+		Register reg;
+		word value;
+	};
+
+	// "size" bytes starting at "start" in Job::memoryBytes are written to "address" before the run
+	struct MemoryPatch {
+		word address;
+		int start;
+		int size;
+	};
+
+	struct Result {
+		word ax, bx, cx, dx, sp, bp, si, di;
+		word cs, ds, ss, es, ip, flags;
+		qword steps;
+		CPU::ExitReason exitReason;
+		int exitCode;
+		qword memoryHash;
+	};
+
+	struct Job {
+		String programFilename;
+		Program* program;
+		qword stepLimit;
+		CPU::Limits limits;
+		List<RegisterValue> registers;
+		List<MemoryPatch> patches;
+		List<byte> memoryBytes;
+
+		Result result;
+	};
+
+	// Owns the jobs and the Programs they share
+	struct Batch {
+		Batch();
+		~Batch();
+
+		Job* jobs;
+		int jobCount;
+		List<Program*> programs;
+
+	private:
+		Batch(const Batch&) = delete;
+		void operator=(const Batch&) = delete;
+	};
+
+	// Jobs without a steps= setting stop after this many instructions
+	const qword DEFAULT_STEP_LIMIT = 100000000;
+
+	// Parses the manifest and loads every program it names. Prints the first problem and returns false
+	bool ReadManifest(const char* filename, Batch& batch);
+
+	// Runs every job, 0 threads uses every hardware thread. Without lockstep every job is a task on its own
+	void RunJobs(Batch& batch, int threadCount = 0, bool lockstep = true);
+
+	// One job on "cpu" the way RunJobs runs it alone. PrepareJob loads the program and applies the settings,
+	// FinishJob stores the final state in job.result
+	void PrepareJob(Job& job, CPU& cpu);
+	void FinishJob(Job& job, CPU& cpu);
+
+	void WriteResults(Batch& batch, FILE* file);
+
+	// The "exit" of a result line, "step_limit" for a job still running when its steps ran out
+	const char* ExitReasonName(Result const& result);
+
+	// Quoted, with quotes and backslashes escaped
+	void WriteJsonString(BufferedWriter& output, const char* text);
+
+	// FNV-1a over the whole address space, taken 64 bits at a time in four interleaved lanes
+	qword HashMemory(GuestMemory const& memory);
+}
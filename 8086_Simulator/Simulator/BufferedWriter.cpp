@@ -0,0 +1,38 @@
+#include "BufferedWriter.h"
+#include <string.h>
+
+BufferedWriter::BufferedWriter(FILE* file, int capacity)
+	: file(file), buffer(new char[capacity]), size(0), capacity(capacity)
+{
+}
+
+BufferedWriter::~BufferedWriter() {
+	Flush();
+	delete[] buffer;
+}
+
+void BufferedWriter::Write(const char* data, int length) {
+	if (size + length > capacity) {
+		Flush();
+
+		// Too big to ever fit, skip the copy and write it straight out
+		if (length > capacity) {
+			if (file) fwrite(data, 1, length, file);
+			return;
+		}
+	}
+
+	memcpy(buffer + size, data, length);
+	size += length;
+}
+
+void BufferedWriter::Flush() {
+	if (size == 0) return;
+	if (file == nullptr) {
+		size = 0;
+		return;
+	}
+	fwrite(buffer, 1, size, file);
+	fflush(file);
+	size = 0;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <stdio.h>
+
+//----------------------------------------------
+// BufferedWriter
+// Collects output in memory and hands it to the file in large chunks,
+// so writing one character costs a copy instead of a stdio call
+//----------------------------------------------
+class BufferedWriter {
+public:
+	// A null file throws everything written away
+	BufferedWriter(FILE* file, int capacity = 64 * 1024);
+	~BufferedWriter();
+
+	void Write(const char* data, int length);
+	void Flush();
+
+	inline void WriteChar(char c) {
+		if (size >= capacity) Flush();
+		buffer[size++] = c;
+	}
+
+	// Room for up to "length" bytes to be formatted straight into the buffer, follow with Commit.
+	// "length" has to be no more than the capacity
+	inline char* Reserve(int length) {
+		if (size + length > capacity) Flush();
+		return buffer + size;
+	}
+
+	inline void Commit(int length) {
+		size += length;
+	}
+
+private:
+	FILE* file;
+	char* buffer;
+	int size;
+	int capacity;
+};
@@ -0,0 +1,416 @@
+#include "DecodeCache.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <utility>
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "Decoder.h"
+#include "String.h"
+
+namespace DecodeCache {
+	static_assert(sizeof(InstructionMove) >= sizeof(InstructionJump) && sizeof(InstructionMove) >= sizeof(InstructionInterrupt),
+		"a record's operands hold every kind of instruction");
+	static_assert(sizeof(Header) % alignof(Record) == 0, "records start right after the header");
+
+	//----------------------------------------------
+	// Key
+	// XXH64. Every bit of the image reaches every bit of the key, so images that differ in a few bits don't share one
+	//----------------------------------------------
+	const qword PRIME1 = 11400714785074694791ull;
+	const qword PRIME2 = 14029467366897019727ull;
+	const qword PRIME3 = 1609587929392839161ull;
+	const qword PRIME4 = 9650029242287828579ull;
+	const qword PRIME5 = 2870177450012600261ull;
+
+	inline qword RotateLeft(qword value, int bits) {
+		return (value << bits) | (value >> (64 - bits));
+	}
+
+	inline qword Round(qword accumulator, qword input) {
+		return RotateLeft(accumulator + input * PRIME2, 31) * PRIME1;
+	}
+
+	inline qword MergeRound(qword hash, qword lane) {
+		return (hash ^ Round(0, lane)) * PRIME1 + PRIME4;
+	}
+
+	qword Key(Buffer const& image) {
+		const byte* data = image.data;
+		int size = image.size;
+		int i = 0;
+		qword hash;
+		if (size >= 32) {
+			qword lanes[4] = { DECODER_VERSION + PRIME1 + PRIME2, DECODER_VERSION + PRIME2, DECODER_VERSION, DECODER_VERSION - PRIME1 };
+			for (; i + 32 <= size; i += 32) {
+				qword chunks[4];
+				memcpy(chunks, &data[i], sizeof(chunks));
+				lanes[0] = Round(lanes[0], chunks[0]);
+				lanes[1] = Round(lanes[1], chunks[1]);
+				lanes[2] = Round(lanes[2], chunks[2]);
+				lanes[3] = Round(lanes[3], chunks[3]);
+			}
+			hash = RotateLeft(lanes[0], 1) + RotateLeft(lanes[1], 7) + RotateLeft(lanes[2], 12) + RotateLeft(lanes[3], 18);
+			for (int lane = 0; lane < 4; lane++) {
+				hash = MergeRound(hash, lanes[lane]);
+			}
+		}
+		else {
+			hash = DECODER_VERSION + PRIME5;
+		}
+		hash += (qword)size;
+
+		for (; i + 8 <= size; i += 8) {
+			qword chunk;
+			memcpy(&chunk, &data[i], sizeof(chunk));
+			hash = RotateLeft(hash ^ Round(0, chunk), 27) * PRIME1 + PRIME4;
+		}
+		if (i + 4 <= size) {
+			unsigned int chunk;
+			memcpy(&chunk, &data[i], sizeof(chunk));
+			hash = RotateLeft(hash ^ (chunk * PRIME1), 23) * PRIME2 + PRIME3;
+			i += 4;
+		}
+		for (; i < size; i++) {
+			hash = RotateLeft(hash ^ (data[i] * PRIME5), 11) * PRIME1;
+		}
+
+		// Avalanche
+		hash ^= hash >> 33;
+		hash *= PRIME2;
+		hash ^= hash >> 29;
+		hash *= PRIME3;
+		hash ^= hash >> 32;
+		return hash;
+	}
+
+	String Filename(const char* directory, qword key) {
+		return String::Format("%s/%016llx.decoded", directory, (unsigned long long)key);
+	}
+
+	//----------------------------------------------
+	// Reading
+	//----------------------------------------------
+	bool InBounds(Buffer const& file, int offset, long long size) {
+		return offset >= (int)sizeof(Header) && size >= 0 && offset + size <= file.size;
+	}
+
+	bool ReadHeader(Buffer const& file, Buffer const& image, qword key, Header& header) {
+		if (file.size < (int)sizeof(Header)) return false;
+		memcpy(&header, file.data, sizeof(Header));
+		if (header.magic != MAGIC || header.version != VERSION || header.headerSize != sizeof(Header) ||
+			header.decoderVersion != DECODER_VERSION || header.hash != key || header.imageSize != image.size) {
+			return false;
+		}
+
+		// Written by another build or cut short, everything it points at has to be inside the file
+		bool valid = header.recordOffset % alignof(Record) == 0 && header.reachableOffset % alignof(int) == 0 &&
+			header.listingCount >= 0 && header.listingCount <= header.recordCount &&
+			InBounds(file, header.recordOffset, (long long)header.recordCount * sizeof(Record)) &&
+			InBounds(file, header.reachableOffset, (long long)header.reachableCount * sizeof(int)) &&
+			InBounds(file, header.textOffset, header.textSize) &&
+			header.textSize > 0 && file.data[header.textOffset + header.textSize - 1] == '\0' &&
+			InBounds(file, header.imageOffset, header.imageSize);
+
+		// A key is only 64 bits, the decode is only trusted for the image it was made from
+		return valid && (image.size == 0 || memcmp(file.data + header.imageOffset, image.data, image.size) == 0);
+	}
+
+	// Longest instruction the decoder handles
+	const int MAX_INSTRUCTION_SIZE = 6;
+
+	// Only what the decoder can produce, the stringifier and the executor index tables with these
+	bool ValidOperand(Operand const& operand) {
+		if (operand.dataSize < ExplicitDataSize::NONE || operand.dataSize > ExplicitDataSize::WORD) return false;
+		switch (operand.type) {
+		case Operand::Type::NONE:
+		case Operand::Type::IMMEDIATE:
+			return true;
+		case Operand::Type::REGISTER:
+			return operand.reg >= Register::AL && operand.reg <= Register::ES;
+		case Operand::Type::MEMORY_LOC:
+			return operand.mem.effectiveAddress >= EffectiveAddress::BX_SI && operand.mem.effectiveAddress <= EffectiveAddress::DIRECT_ADDRESS;
+		default:
+			return false;
+		}
+	}
+
+	bool ValidCondition(InstructionJump::Condition condition) {
+		switch (condition) {
+		case InstructionJump::JumpAlways: case InstructionJump::JumpOnEqualOrZero: case InstructionJump::JumpOnLess:
+		case InstructionJump::JumpOnLessOrEqual: case InstructionJump::JumpOnBelow: case InstructionJump::JumpOnBelowOrEqual:
+		case InstructionJump::JumpOnParity: case InstructionJump::JumpOnOverflow: case InstructionJump::JumpOnSign:
+		case InstructionJump::JumpOnNotEqualOrZero: case InstructionJump::JumpOnGreaterOrEqual: case InstructionJump::JumpOnGreater:
+		case InstructionJump::JumpOnAboveOrEqual: case InstructionJump::JumpOnAbove: case InstructionJump::JumpOnNotParity:
+		case InstructionJump::JumpOnNotOverflow: case InstructionJump::JumpOnNotSign: case InstructionJump::Loop:
+		case InstructionJump::LoopEqualOrZero: case InstructionJump::LoopNotEqualOrZero: case InstructionJump::JumpOnCXZero:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	// Fills in everything but the index. A damaged record that would send the stringifier or the executor
+	// outside their tables drops the whole file. "listCount" bounds a jump's stored instruction index
+	bool ReadRecord(Header const& header, Record const& record, char const* text, int listCount, InstructionGeneric& instruction) {
+		if (record.textOffset < 0 || record.textOffset >= header.textSize || record.address < 0 ||
+			record.size < 1 || record.size > MAX_INSTRUCTION_SIZE || record.address + record.size > header.imageSize ||
+			record.type <= InstructionType::NONE || record.type > InstructionType::INTERRUPT || record.isWide > 1) {
+			return false;
+		}
+
+		instruction.type = (InstructionType)record.type;
+		instruction.address = record.address;
+		instruction.size = record.size;
+		instruction.isWide = record.isWide != 0;
+		memcpy(&instruction.move, record.operands, sizeof(record.operands));
+		instruction.asString = String::Borrow(text + record.textOffset);
+
+		switch (instruction.type) {
+		case InstructionType::JUMP:
+			return ValidCondition(instruction.jump.condition) &&
+				instruction.jump.instructionIndex >= -1 && instruction.jump.instructionIndex < listCount;
+		case InstructionType::INTERRUPT:
+			return true;
+		default:
+			return ValidOperand(instruction.move.source) && ValidOperand(instruction.move.dest);
+		}
+	}
+
+	// The records are shared, so a reachable instruction's jump target is worked out again here, the way
+	// Decoder::DecodeReachable does. Its text is borrowed from "text", the Program's copy of the file's
+	bool ReadReachable(Buffer const& file, Header const& header, char const* text, List<InstructionGeneric>& out) {
+		Record const* records = (Record const*)(file.data + header.recordOffset);
+		int const* numbers = (int const*)(file.data + header.reachableOffset);
+		int* reachableAt = new int[header.imageSize];
+		for (int i = 0; i < header.imageSize; i++) {
+			reachableAt[i] = -1;
+		}
+
+		bool ok = true;
+		out.Resize(header.reachableCount);
+		for (int i = 0; i < header.reachableCount && ok; i++) {
+			InstructionGeneric& instruction = out[i];
+			ok = numbers[i] >= 0 && numbers[i] < header.recordCount && ReadRecord(header, records[numbers[i]], text, header.listingCount, instruction);
+			instruction.index = i;
+			if (ok) reachableAt[instruction.address] = i;
+		}
+		for (int i = 0; i < out.Size() && ok; i++) {
+			InstructionGeneric& instruction = out[i];
+			if (instruction.type != InstructionType::JUMP) continue;
+			int target = instruction.jump.byteLocation;
+			instruction.jump.instructionIndex = (target >= 0 && target < header.imageSize) ? reachableAt[target] : -1;
+		}
+
+		delete[] reachableAt;
+		return ok;
+	}
+
+	// The Program's list is rebuilt in place from the records, sized once, with its text borrowed from one copy
+	// it frees with itself. A binary that is all reachable code has the same list twice, the listing is then the
+	// Program's. Otherwise it's rebuilt in the arena too, borrowing its text from the mapping
+	bool Read(Buffer const& file, Buffer& image, qword key, Arena& arena, Decoded& out) {
+		Header header;
+		if (!ReadHeader(file, image, key, header)) return false;
+
+		char const* text = (char const*)file.data + header.textOffset;
+		char* programText = new char[header.textSize];
+		memcpy(programText, text, header.textSize);
+		List<InstructionGeneric> reachable;
+		if (!ReadReachable(file, header, programText, reachable)) {
+			delete[] programText;
+			return false;
+		}
+
+		int const* numbers = (int const*)(file.data + header.reachableOffset);
+		bool same = header.reachableCount == header.listingCount;
+		for (int i = 0; i < header.reachableCount && same; i++) {
+			same = numbers[i] == i;
+		}
+
+		List<InstructionGeneric>* listing = nullptr;
+		if (!same) {
+			Record const* records = (Record const*)(file.data + header.recordOffset);
+			listing = arena.New<List<InstructionGeneric>>(arena);
+			listing->Resize(header.listingCount);
+			for (int i = 0; i < header.listingCount; i++) {
+				InstructionGeneric& instruction = (*listing)[i];
+				if (!ReadRecord(header, records[i], text, header.listingCount, instruction)) {
+					delete[] programText;
+					return false;
+				}
+				instruction.index = i;
+			}
+		}
+
+		out.program = Program::Create(image, std::move(reachable), programText);
+		out.listing = same ? &out.program->instructions : listing;
+		return true;
+	}
+
+	//----------------------------------------------
+	// Writing
+	//----------------------------------------------
+	int WriteText(const char* str, char* text, int& textUsed) {
+		int offset = textUsed;
+		int length = (int)strlen(str) + 1;
+		memcpy(&text[textUsed], str, length);
+		textUsed += length;
+		return offset;
+	}
+
+	void ToRecord(InstructionGeneric const& instruction, Record& record) {
+		memset(&record, 0, sizeof(record));
+		record.address = instruction.address;
+		record.type = (byte)instruction.type;
+		record.size = (byte)instruction.size;
+		record.isWide = instruction.isWide;
+		memcpy(record.operands, &instruction.move, sizeof(record.operands));
+	}
+
+	// Decoded the same at the same address, apart from where each one is in its own list
+	bool SameDecode(InstructionGeneric const& a, InstructionGeneric const& b) {
+		if (a.type != b.type || a.size != b.size || a.isWide != b.isWide || strcmp(a.asString.c_str(), b.asString.c_str()) != 0) {
+			return false;
+		}
+		byte operands[2][sizeof(InstructionMove)];
+		memcpy(operands[0], &a.move, sizeof(InstructionMove));
+		memcpy(operands[1], &b.move, sizeof(InstructionMove));
+		if (a.type == InstructionType::JUMP) {
+			int none = -1;
+			memcpy(operands[0] + offsetof(InstructionJump, instructionIndex), &none, sizeof(none));
+			memcpy(operands[1] + offsetof(InstructionJump, instructionIndex), &none, sizeof(none));
+		}
+		return memcmp(operands[0], operands[1], sizeof(InstructionMove)) == 0;
+	}
+
+	int TextSize(List<InstructionGeneric> const& instructions) {
+		int size = 0;
+		for (int i = 0; i < instructions.Size(); i++) {
+			size += (int)strlen(instructions[i].asString.c_str()) + 1;
+		}
+		return size;
+	}
+
+	bool Write(const char* filename, qword key, Buffer const& image, List<InstructionGeneric> const& listing, List<InstructionGeneric> const& reachable) {
+		// A terminator up front, so even an empty program has the text ReadHeader expects
+		char* text = new char[1 + TextSize(listing) + TextSize(reachable)];
+		text[0] = '\0';
+		int textUsed = 1;
+
+		// The listing's records, then one for each reachable instruction that decoded differently from it
+		Record* records = new Record[listing.Size() + reachable.Size()];
+		int recordCount = 0;
+		int* listingAt = new int[image.size];
+		for (int i = 0; i < image.size; i++) {
+			listingAt[i] = -1;
+		}
+		for (int i = 0; i < listing.Size(); i++) {
+			ToRecord(listing[i], records[recordCount]);
+			records[recordCount].textOffset = WriteText(listing[i].asString.c_str(), text, textUsed);
+			listingAt[listing[i].address] = recordCount++;
+		}
+
+		int* reachableRecords = new int[reachable.Size()];
+		for (int i = 0; i < reachable.Size(); i++) {
+			InstructionGeneric const& instruction = reachable[i];
+			int same = listingAt[instruction.address];
+			if (same >= 0 && SameDecode(listing[same], instruction)) {
+				reachableRecords[i] = same;
+				continue;
+			}
+			ToRecord(instruction, records[recordCount]);
+			records[recordCount].textOffset = WriteText(instruction.asString.c_str(), text, textUsed);
+			reachableRecords[i] = recordCount++;
+		}
+		delete[] listingAt;
+
+		Header header;
+		memset(&header, 0, sizeof(header));
+		header.magic = MAGIC;
+		header.version = VERSION;
+		header.headerSize = sizeof(Header);
+		header.decoderVersion = DECODER_VERSION;
+		header.imageSize = image.size;
+		header.hash = key;
+		header.recordCount = recordCount;
+		header.recordOffset = sizeof(Header);
+		header.listingCount = listing.Size();
+		header.reachableCount = reachable.Size();
+		header.reachableOffset = header.recordOffset + recordCount * (int)sizeof(Record);
+		header.textOffset = header.reachableOffset + reachable.Size() * (int)sizeof(int);
+		header.textSize = textUsed;
+		header.imageOffset = header.textOffset + textUsed;
+
+		// Other processes may be decoding the same binary, each writes its own file and the last rename wins
+#ifdef _WIN32
+		String temporary = String::Format("%s.%i.tmp", filename, _getpid());
+#else
+		String temporary = String::Format("%s.%i.tmp", filename, (int)getpid());
+#endif
+		bool ok = false;
+		FILE* file = fopen(temporary.c_str(), "wb");
+		if (file) {
+			ok = fwrite(&header, sizeof(header), 1, file) == 1;
+			ok = ok && (recordCount == 0 || fwrite(records, sizeof(Record), recordCount, file) == (size_t)recordCount);
+			ok = ok && (reachable.Size() == 0 || fwrite(reachableRecords, sizeof(int), reachable.Size(), file) == (size_t)reachable.Size());
+			ok = ok && fwrite(text, header.textSize, 1, file) == 1;
+			ok = ok && (image.size == 0 || fwrite(image.data, image.size, 1, file) == 1);
+			ok = (fclose(file) == 0) && ok;
+#ifdef _WIN32
+			// rename doesn't replace an existing file on Windows
+			if (ok) remove(filename);
+#endif
+			ok = ok && rename(temporary.c_str(), filename) == 0;
+			if (!ok) remove(temporary.c_str());
+		}
+
+		delete[] reachableRecords;
+		delete[] records;
+		delete[] text;
+		return ok;
+	}
+
+	void MakeDirectory(const char* directory) {
+		// Fails harmlessly if it's already there, and if it really can't be made the write after it fails too
+#ifdef _WIN32
+		_mkdir(directory);
+#else
+		mkdir(directory, 0755);
+#endif
+	}
+
+	//----------------------------------------------
+	// Main
+	//----------------------------------------------
+	void Load(Buffer& image, const char* directory, Arena& arena, MappedFile& cacheFile, Decoded& out) {
+		cacheFile.Close();
+		out.fromCache = false;
+
+		qword key = 0;
+		String filename;
+		if (directory) {
+			key = Key(image);
+			filename = Filename(directory, key);
+			if (cacheFile.Open(filename.c_str(), false) && Read(cacheFile.buffer, image, key, arena, out)) {
+				out.fromCache = true;
+				return;
+			}
+			cacheFile.Close();
+		}
+
+		out.listing = Decoder::Decode(image, arena);
+		out.program = Program::Create(image);
+
+		// A listing that didn't decode has printed why, it isn't kept so the next start says so again
+		if (directory && (out.listing->Size() > 0 || image.size == 0)) {
+			MakeDirectory(directory);
+			Write(filename.c_str(), key, image, *out.listing, out.program->instructions);
+		}
+	}
+}
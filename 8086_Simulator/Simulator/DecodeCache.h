@@ -0,0 +1,77 @@
+#pragma once
+#include "Types.h"
+#include "List.h"
+#include "Arena.h"
+#include "MappedFile.h"
+#include "Program.h"
+
+//----------------------------------------------
+// DecodeCache
+// Decoded programs kept on disk, one file per binary named after a hash of its bytes. A file holds the
+// linear listing with its text and resolved jumps, and the reachable instructions a Program runs, as flat
+// records with offsets instead of pointers, so a warm start maps the file and rebuilds both lists from it
+// without decoding anything. A copy of the binary is kept too, a file is only used if it matches byte for byte
+//----------------------------------------------
+namespace DecodeCache {
+	const unsigned int MAGIC = 0x43443638; // "86DC"
+	const unsigned short VERSION = 3;
+
+	// Part of the key, bump it whenever the decoder or the text it writes changes so stale files are never used
+	const unsigned int DECODER_VERSION = 1;
+
+	struct Header {
+		unsigned int magic;
+		unsigned short version;
+		unsigned short headerSize;
+		unsigned int decoderVersion;
+		int imageSize;
+		qword hash;
+
+		// The records, the listing's first, then the record number of every reachable instruction, every
+		// instruction's text null terminated and the image, all as offsets from the start of the file
+		int recordCount;
+		int recordOffset;
+		int listingCount;
+		int reachableCount;
+		int reachableOffset;
+		int textOffset;
+		int textSize;
+		int imageOffset;
+	};
+
+	// InstructionGeneric without its String or its index, which is where it is in its list. The operands are
+	// copied as they are and checked on reading. A reachable instruction that decoded the same as the listing's
+	// at its address shares its record, its jump target is its own
+	struct Record {
+		int address;
+		int textOffset;
+		byte type;
+		byte size;
+		byte isWide;
+		byte unused;
+		byte operands[sizeof(InstructionMove)];
+	};
+
+	struct Decoded {
+		// Lives in the arena, and its text in the cache file, it's valid until either is reset or closed.
+		// From a cache file where the listing and the reachable instructions are the same, it's the Program's
+		// own list instead, valid for as long as the Program is
+		List<InstructionGeneric>* listing;
+
+		// A reference the caller releases
+		Program* program;
+
+		bool fromCache;
+	};
+
+	// 64 bit hash of the image, seeded with DECODER_VERSION, that names its cache file
+	qword Key(Buffer const& image);
+
+	// Where the cache file for "key" lives in "directory"
+	String Filename(const char* directory, qword key);
+
+	// Decodes "image", or maps the matching file from "directory" into "cacheFile" if there is one.
+	// A fresh decode is written to the directory for next time, created if needed. Problems with the cache
+	// only cost the decode, a null directory turns it off
+	void Load(Buffer& image, const char* directory, Arena& arena, MappedFile& cacheFile, Decoded& out);
+}
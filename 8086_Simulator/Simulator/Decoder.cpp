@@ -1,8 +1,10 @@
 #include "Decoder.h"
 
 #include <stdio.h>
+#include <thread>
 
 #include "String.h"
+#include "ThreadPool.h"
 #include "Types.h"
 #include "StringifyTypes.h"
 #include "List.h"
@@ -80,7 +82,7 @@ namespace Decoder {
 		return Register::INVALID;
 	}
 
-	int CalculateOperandFromRegMem(char mod, byte* bufferPossibleMemStart, bool isWide, char regMem, Operand& out) {
+	int CalculateOperandFromRegMem(char mod, byte const* bufferPossibleMemStart, bool isWide, char regMem, Operand& out) {
 		// Account for rm being 110, which is a special case with 16-bit displacement
 		bool directAddress = (mod == 0b00) && (regMem == 0b110);
 		if (directAddress) {
@@ -124,7 +126,7 @@ namespace Decoder {
 		}
 	}
 
-	int ParseImmediateData(byte* buffer, bool isWide) {
+	int ParseImmediateData(byte const* buffer, bool isWide) {
 		if (isWide) {
 			return (signed short)((buffer[1] << 8) | buffer[0]);
 		}
@@ -134,7 +136,7 @@ namespace Decoder {
 	}
 
 	// Function that given a mod byte, returns the mode, memory offset (if applicable), and number of bytes to read
-	int CalculateSourceAndDestFromMode(char mod, byte* bufferPossibleMemStart, bool destinationIsRegister, bool isWide, char reg, char regMem, Operand& source, Operand& dest) {
+	int CalculateSourceAndDestFromMode(char mod, byte const* bufferPossibleMemStart, bool destinationIsRegister, bool isWide, char reg, char regMem, Operand& source, Operand& dest) {
 		Operand& slotReg = destinationIsRegister ? dest : source;
 		CalculateReg(mod, isWide, reg, slotReg);
 
@@ -145,7 +147,7 @@ namespace Decoder {
 	//----------------------------------------------
 	// MOVE Register/memory to/from register
 	//----------------------------------------------
-	int OperationMoveToFromRegMemParse(unsigned char* buffer, InstructionMove& move) {
+	int OperationMoveToFromRegMemParse(unsigned char const* buffer, InstructionMove& move) {
 		bool destIsReg = buffer[0] & 0b00000010;
 		bool isWide = buffer[0] & 0b00000001;
 		char mod = (buffer[1] & 0b11000000) >> 6;
@@ -159,7 +161,7 @@ namespace Decoder {
 	//----------------------------------------------
 	// MOVE immediate to register/memory
 	//----------------------------------------------
-	int OperationMoveImmediateToRegMemParse(byte* buffer, InstructionMove& move) {
+	int OperationMoveImmediateToRegMemParse(byte const* buffer, InstructionMove& move) {
 		bool isDataWide = buffer[0] & 0b00000001;
 		char mod = (buffer[1] & 0b11000000) >> 6;
 		char regMem = (buffer[1] & 0b00000111);
@@ -168,7 +170,7 @@ namespace Decoder {
 
 		// Calc effective address
 		int byteOffset = CalculateOperandFromRegMem(mod, &buffer[2], isDataWide, regMem, move.dest);
-		byte* dataLocation = buffer + 2 + byteOffset;
+		byte const* dataLocation = buffer + 2 + byteOffset;
 		move.source.type = Operand::Type::IMMEDIATE;
 		move.source.immediate = ParseImmediateData(dataLocation, isDataWide);
 		return 2 + byteOffset + (isDataWide ? 2 : 1);
@@ -177,7 +179,7 @@ namespace Decoder {
 	//----------------------------------------------
 	// MOVE immediate to register
 	//----------------------------------------------
-	int OperationMoveImmediateToRegisterParse(unsigned char* buffer, InstructionMove& move) {
+	int OperationMoveImmediateToRegisterParse(unsigned char const* buffer, InstructionMove& move) {
 		bool isWide = buffer[0] & 0b00001000;
 		char reg = (buffer[0] & 0b00000111);
 		move.dest.type = Operand::Type::REGISTER;
@@ -190,50 +192,37 @@ namespace Decoder {
 	//----------------------------------------------
 	// MOVE memory to accumulator
 	//----------------------------------------------
-	int OperationMoveMemoryToAccumulatorParse(unsigned char* buffer, InstructionMove& move) {
+	int OperationMoveMemoryToAccumulatorParse(unsigned char const* buffer, InstructionMove& move) {
 		bool isWide = buffer[0] & 0b00000001;
 		move.dest.type = Operand::Type::REGISTER;
 		move.dest.reg = isWide ? Register::AX : Register::AL;
 
+		// The address is 16 bits wide whatever the width of the data
 		move.source.type = Operand::Type::MEMORY_LOC;
 		move.source.mem.effectiveAddress = EffectiveAddress::DIRECT_ADDRESS;
-
-		if (isWide) {
-			move.source.mem.memoryOffset = (signed short)((buffer[2] << 8) | buffer[1]);
-			return 3;
-		}
-		else {
-			move.source.mem.memoryOffset = (signed char)buffer[1];
-			return 2;
-		}
+		move.source.mem.memoryOffset = (signed short)((buffer[2] << 8) | buffer[1]);
+		return 3;
 	}
 
 	//----------------------------------------------
 	// MOVE accumulator to memory
 	//----------------------------------------------
-	int OperationMoveAccumulatorToMemoryParse(unsigned char* buffer, InstructionMove& move) {
+	int OperationMoveAccumulatorToMemoryParse(unsigned char const* buffer, InstructionMove& move) {
 		bool isWide = buffer[0] & 0b00000001;
 
 		move.source.type = Operand::Type::REGISTER;
-		move.source.reg = Register::AX;
+		move.source.reg = isWide ? Register::AX : Register::AL;
 
 		move.dest.type = Operand::Type::MEMORY_LOC;
 		move.dest.mem.effectiveAddress = EffectiveAddress::DIRECT_ADDRESS;
-
-		if (isWide) {
-			move.dest.mem.memoryOffset = (signed short)((buffer[2] << 8) | buffer[1]);
-			return 3;
-		}
-		else {
-			move.dest.mem.memoryOffset = (signed char)(buffer[1]);
-			return 2;
-		}
+		move.dest.mem.memoryOffset = (signed short)((buffer[2] << 8) | buffer[1]);
+		return 3;
 	}
 
 	//----------------------------------------------
 	// MOVE RegMem to segment register
 	//----------------------------------------------
-	int OperationMoveRegMemToSegmentRegisterParse(unsigned char* buffer, InstructionMove& move) {
+	int OperationMoveRegMemToSegmentRegisterParse(unsigned char const* buffer, InstructionMove& move) {
 		bool isWide = true;
 		char mod = (buffer[1] & 0b11000000) >> 6;
 		char sr = (buffer[1] & 0b00011000) >> 3;
@@ -250,7 +239,7 @@ namespace Decoder {
 	//----------------------------------------------
 	// MOVE segment register to RegMem
 	//----------------------------------------------
-	int OperationMoveSegmentRegisterToRegMemParse(unsigned char* buffer, InstructionMove& move) {
+	int OperationMoveSegmentRegisterToRegMemParse(unsigned char const* buffer, InstructionMove& move) {
 		bool isWide = true;
 		char mod = (buffer[1] & 0b11000000) >> 6;
 		char sr = (buffer[1] & 0b00011000) >> 3;
@@ -266,7 +255,7 @@ namespace Decoder {
 	//----------------------------------------------
 	// ADD immediate to register/memory
 	//----------------------------------------------
-	int OperationAddImmediateToRegMemParse(unsigned char* buffer, InstructionAdd& add) {
+	int OperationAddImmediateToRegMemParse(unsigned char const* buffer, InstructionAdd& add) {
 		bool isWide = buffer[0] & 0b00000001;
 		char mod = (buffer[1] & 0b11000000) >> 6;
 		char regMem = (buffer[1] & 0b00000111);
@@ -276,7 +265,7 @@ namespace Decoder {
 
 		// Calc effective address
 		int addressOffset = CalculateOperandFromRegMem(mod, &buffer[2], isWide, regMem, add.dest);
-		byte* dataLocation = buffer + 2 + addressOffset;
+		byte const* dataLocation = buffer + 2 + addressOffset;
 
 		if (add.dest.type == Operand::Type::MEMORY_LOC) {
 			add.dest.dataSize = isWide ? ExplicitDataSize::WORD : ExplicitDataSize::BYTE;
@@ -290,7 +279,7 @@ namespace Decoder {
 	//----------------------------------------------
 	// ADD to from register memory
 	//----------------------------------------------
-	int OperationAddToFromRegMemParse(unsigned char* buffer, InstructionAdd& add) {
+	int OperationAddToFromRegMemParse(unsigned char const* buffer, InstructionAdd& add) {
 		bool isWide = buffer[0] & 0b00000001;
 		bool destIsReg = buffer[0] & 0b00000010;
 		char mod = (buffer[1] & 0b11000000) >> 6;
@@ -305,7 +294,7 @@ namespace Decoder {
 	//----------------------------------------------
 	// ADD immediate to accumulator
 	//----------------------------------------------
-	int OperationAddImmediateToAccumulatorParse(unsigned char* buffer, InstructionAdd& add) {
+	int OperationAddImmediateToAccumulatorParse(unsigned char const* buffer, InstructionAdd& add) {
 		bool isWide = buffer[0] & 0b00000001; // explicit wide
 
 		add.dest.type = Operand::Type::REGISTER;
@@ -320,7 +309,7 @@ namespace Decoder {
 	//----------------------------------------------
 	// SUB to from register memory
 	//----------------------------------------------
-	int OperationSubToFromRegMemParse(unsigned char* buffer, InstructionSub& sub) {
+	int OperationSubToFromRegMemParse(unsigned char const* buffer, InstructionSub& sub) {
 		bool isWide = buffer[0] & 0b00000001;
 		bool destIsReg = buffer[0] & 0b00000010;
 		char mod = (buffer[1] & 0b11000000) >> 6;
@@ -335,7 +324,7 @@ namespace Decoder {
 	//----------------------------------------------
 	// SUB immediate from reg/mem
 	//----------------------------------------------
-	int OperationSubImmediateFromRegMemParse(unsigned char* buffer, InstructionSub& sub) {
+	int OperationSubImmediateFromRegMemParse(unsigned char const* buffer, InstructionSub& sub) {
 		bool isWide = buffer[0] & 0b00000001;
 		char mod = (buffer[1] & 0b11000000) >> 6;
 		char reg = (buffer[1] & 0b00111000) >> 3;
@@ -346,7 +335,7 @@ namespace Decoder {
 
 		// Calc effective address
 		int addressOffset = CalculateOperandFromRegMem(mod, &buffer[2], isWide, regMem, sub.dest);
-		byte* dataLocation = buffer + 2 + addressOffset;
+		byte const* dataLocation = buffer + 2 + addressOffset;
 
 		if (sub.dest.type == Operand::Type::MEMORY_LOC) {
 			sub.dest.dataSize = isWide ? ExplicitDataSize::WORD : ExplicitDataSize::BYTE;
@@ -360,7 +349,7 @@ namespace Decoder {
 	//----------------------------------------------
 	// SUB immediate from accumulator
 	//----------------------------------------------
-	int OperationSubImmediateFromAccumulatorParse(unsigned char* buffer, InstructionSub& sub) {
+	int OperationSubImmediateFromAccumulatorParse(unsigned char const* buffer, InstructionSub& sub) {
 		bool isWide = buffer[0] & 0b00000001; // explicit wide
 
 		sub.dest.type = Operand::Type::REGISTER;
@@ -375,7 +364,7 @@ namespace Decoder {
 	//----------------------------------------------
 	// CMP reg and reg/mem
 	//----------------------------------------------
-	int OperationCompareRegWithRegMemParse(unsigned char* buffer, InstructionCompare& cmp) {
+	int OperationCompareRegWithRegMemParse(unsigned char const* buffer, InstructionCompare& cmp) {
 		bool isWide = buffer[0] & 0b00000001;
 		bool destIsReg = buffer[0] & 0b00000010;
 		char mod = (buffer[1] & 0b11000000) >> 6;
@@ -391,7 +380,7 @@ namespace Decoder {
 	// CMP immediate and reg/mem
 	//----------------------------------------------
 
-	int OperationCompareImmediateWithRegMemParse(unsigned char* buffer, InstructionCompare& cmp) {
+	int OperationCompareImmediateWithRegMemParse(unsigned char const* buffer, InstructionCompare& cmp) {
 		bool isWide = buffer[0] & 0b00000001;
 		char mod = (buffer[1] & 0b11000000) >> 6;
 		char reg = (buffer[1] & 0b00111000) >> 3;
@@ -402,7 +391,7 @@ namespace Decoder {
 
 		// Calc effective address
 		int addressOffset = CalculateOperandFromRegMem(mod, &buffer[2], isWide, regMem, cmp.dest);
-		byte* dataLocation = buffer + 2 + addressOffset;
+		byte const* dataLocation = buffer + 2 + addressOffset;
 
 		if (cmp.dest.type == Operand::Type::MEMORY_LOC) {
 			cmp.dest.dataSize = isWide ? ExplicitDataSize::WORD : ExplicitDataSize::BYTE;
@@ -416,7 +405,7 @@ namespace Decoder {
 	//----------------------------------------------
 	// CMP immediate and accumulator
 	//----------------------------------------------
-	int OperationCompareImmediateWithAccumulatorParse(unsigned char* buffer, InstructionCompare& cmp) {
+	int OperationCompareImmediateWithAccumulatorParse(unsigned char const* buffer, InstructionCompare& cmp) {
 		bool isWide = buffer[0] & 0b00000001; // explicit wide
 
 		cmp.dest.type = Operand::Type::REGISTER;
@@ -430,7 +419,7 @@ namespace Decoder {
 	//----------------------------------------------
 	// JUMP conditional
 	//----------------------------------------------
-	int OperationJumpConditionalParse(unsigned char* buffer, InstructionJump& jump, int myByte, bool isWide = false) {
+	int OperationJumpConditionalParse(unsigned char const* buffer, InstructionJump& jump, int myByte, bool isWide = false) {
 		// Jump offsets are relative to the next instruction in bytes
 		jump.condition = (InstructionJump::Condition)buffer[0];
 		int jumpByteOffset = ParseImmediateData(&buffer[1], isWide);
@@ -443,190 +432,585 @@ namespace Decoder {
 	}
 
 	//----------------------------------------------
-	// Testing stuff
+	// Operation width
 	//----------------------------------------------
-	Buffer LoadBufferFromFile(String filename) {
-		FILE* file;
-		fopen_s(&file, filename.c_str(), "rb");
-		if (file == NULL) {
-			printf("Error: Could not open file %s\n", filename.c_str());
-			return {};
+	bool IsWideOperation(OpCode code, byte opcodeByte) {
+		switch (code) {
+		case OpCode::MOVE_IMMEDIATE_TO_REG: return opcodeByte & 0b00001000;
+		case OpCode::MOVE_REGMEM_TO_SEGMENT:
+		case OpCode::MOVE_SEGMENT_TO_REGMEM: return true;
+		default: return opcodeByte & 0b00000001;
+		}
+	}
+
+	//----------------------------------------------
+	// Single instruction
+	//----------------------------------------------
+	int DecodeInstruction(byte const* data, int address, InstructionGeneric& instruction) {
+		OpCode code = ParseOpCode(data[0], data[1]);
+		int bytes = 0;
+		switch (code) {
+		case OpCode::MOVE_TOFROM_REGMEM:
+			instruction.type = InstructionType::MOVE;
+			bytes = OperationMoveToFromRegMemParse(data, instruction.move);
+			break;
+		case OpCode::MOVE_IMMEDIATE_TO_REGMEM:
+			instruction.type = InstructionType::MOVE;
+			bytes = OperationMoveImmediateToRegMemParse(data, instruction.move);
+			break;
+		case OpCode::MOVE_IMMEDIATE_TO_REG:
+			instruction.type = InstructionType::MOVE;
+			bytes = OperationMoveImmediateToRegisterParse(data, instruction.move);
+			break;
+		case OpCode::MOVE_MEMORY_TO_ACCUMULATOR:
+			instruction.type = InstructionType::MOVE;
+			bytes = OperationMoveMemoryToAccumulatorParse(data, instruction.move);
+			break;
+		case OpCode::MOVE_ACCUMULATOR_TO_MEMORY:
+			instruction.type = InstructionType::MOVE;
+			bytes = OperationMoveAccumulatorToMemoryParse(data, instruction.move);
+			break;
+		case OpCode::MOVE_REGMEM_TO_SEGMENT:
+			instruction.type = InstructionType::MOVE;
+			bytes = OperationMoveRegMemToSegmentRegisterParse(data, instruction.move);
+			break;
+		case OpCode::MOVE_SEGMENT_TO_REGMEM:
+			instruction.type = InstructionType::MOVE;
+			bytes = OperationMoveSegmentRegisterToRegMemParse(data, instruction.move);
+			break;
+		case OpCode::ADD_IMMEDIATE_TO_ACCUMULATOR:
+			instruction.type = InstructionType::ADD;
+			bytes = OperationAddImmediateToAccumulatorParse(data, instruction.add);
+			break;
+		case OpCode::ADD_TOFROM_REGMEM:
+			instruction.type = InstructionType::ADD;
+			bytes = OperationAddToFromRegMemParse(data, instruction.add);
+			break;
+		case OpCode::ADD_IMMEDIATE_TO_REGMEM:
+			instruction.type = InstructionType::ADD;
+			bytes = OperationAddImmediateToRegMemParse(data, instruction.add);
+			break;
+		case OpCode::SUB_TOFROM_REGMEM:
+			instruction.type = InstructionType::SUB;
+			bytes = OperationSubToFromRegMemParse(data, instruction.sub);
+			break;
+		case OpCode::SUB_IMMEDIATE_TO_REGMEM:
+			instruction.type = InstructionType::SUB;
+			bytes = OperationSubImmediateFromRegMemParse(data, instruction.sub);
+			break;
+		case OpCode::SUB_IMMEDIATE_TO_ACCUMULATOR:
+			instruction.type = InstructionType::SUB;
+			bytes = OperationSubImmediateFromAccumulatorParse(data, instruction.sub);
+			break;
+		case OpCode::CMP_REG_WITH_REGMEM:
+			instruction.type = InstructionType::COMPARE;
+			bytes = OperationCompareRegWithRegMemParse(data, instruction.compare);
+			break;
+		case OpCode::CMP_IMMEDIATE_WITH_REGMEM:
+			instruction.type = InstructionType::COMPARE;
+			bytes = OperationCompareImmediateWithRegMemParse(data, instruction.compare);
+			break;
+		case OpCode::CMP_IMMEDIATE_WITH_ACCUMULATOR:
+			instruction.type = InstructionType::COMPARE;
+			bytes = OperationCompareImmediateWithAccumulatorParse(data, instruction.compare);
+			break;
+		case OpCode::JUMP_ALWAYS_RELATIVE_WIDE:
+		case OpCode::JUMP_ON_EQUAL_OR_ZERO:
+		case OpCode::JUMP_ON_LESS:
+		case OpCode::JUMP_ON_LESS_OR_EQUAL:
+		case OpCode::JUMP_ON_BELOW:
+		case OpCode::JUMP_ON_BELOW_OR_EQUAL:
+		case OpCode::JUMP_ON_PARITY:
+		case OpCode::JUMP_ON_OVERFLOW:
+		case OpCode::JUMP_ON_SIGN:
+		case OpCode::JUMP_ON_NOT_EQUAL_OR_ZERO:
+		case OpCode::JUMP_ON_GREATER_OR_EQUAL:
+		case OpCode::JUMP_ON_GREATER:
+		case OpCode::JUMP_ON_ABOVE_OR_EQUAL:
+		case OpCode::JUMP_ON_ABOVE:
+		case OpCode::JUMP_ON_NOT_PARITY:
+		case OpCode::JUMP_ON_NOT_OVERFLOW:
+		case OpCode::JUMP_ON_NOT_SIGN:
+		case OpCode::LOOP_CX_TIMES:
+		case OpCode::LOOP_WHILE_ZERO:
+		case OpCode::LOOP_WHILE_NOT_ZERO:
+		case OpCode::JUMP_ON_CX_ZERO:
+			{
+				instruction.type = InstructionType::JUMP;
+				bool isWide = (code == OpCode::JUMP_ALWAYS_RELATIVE_WIDE);
+				bytes = OperationJumpConditionalParse(data, instruction.jump, address, isWide);
+			}
+			break;
+		case OpCode::INTERRUPT:
+			instruction.type = InstructionType::INTERRUPT;
+			instruction.interrupt.interruptNumber = data[1];
+			bytes = 2;
+			break;
+		default:
+			return 0;
+		}
+
+		instruction.address = address;
+		instruction.size = bytes;
+		instruction.isWide = IsWideOperation(code, data[0]);
+		return bytes;
+	}
+
+	//----------------------------------------------
+	// Bounds
+	// DecodeInstruction reads up to MAX_INSTRUCTION_SIZE bytes whatever the opcode turns out to be,
+	// so every decode of a buffer goes through here
+	//----------------------------------------------
+	const int MAX_INSTRUCTION_SIZE = 6;
+
+	int DecodeInstructionInBuffer(Buffer& buffer, int bp, InstructionGeneric& instruction) {
+		// Near the end of the buffer decode from a zero padded copy so we never read past it
+		if (bp + MAX_INSTRUCTION_SIZE <= buffer.size) {
+			return DecodeInstruction(&buffer.data[bp], bp, instruction);
+		}
+
+		byte padded[MAX_INSTRUCTION_SIZE] = {};
+		for (int i = 0; bp + i < buffer.size; i++) {
+			padded[i] = buffer.data[bp + i];
+		}
+		int bytes = DecodeInstruction(padded, bp, instruction);
+		return (bp + bytes <= buffer.size) ? bytes : 0;
+	}
+
+	// For a decode that just failed at "bp", an opcode decodes fine on its own if the instruction was only cut off
+	void PrintDecodeError(Buffer& buffer, int bp) {
+		byte padded[MAX_INSTRUCTION_SIZE] = {};
+		for (int i = 0; i < MAX_INSTRUCTION_SIZE && bp + i < buffer.size; i++) {
+			padded[i] = buffer.data[bp + i];
+		}
+
+		InstructionGeneric instruction;
+		if (DecodeInstruction(padded, bp, instruction) != 0) {
+			printf("ERROR WHILE DECODING: Instruction at byte %i runs past the end of the buffer\n", bp);
+		}
+		else {
+			printf("ERROR WHILE DECODING: Unhandled opcode 0x%x\n", buffer.data[bp]);
+		}
+	}
+
+	//----------------------------------------------
+	// Jump resolution and stringify
+	// Shared by every decode that produces one list covering the whole buffer. The list is split into ranges of
+	// instructions, each of which fills the byte index for its own bytes, then resolves and stringifies its own
+	// instructions, so a pool can finish every range at once
+	//----------------------------------------------
+	struct FinishRange {
+		Buffer* buffer;
+		List<InstructionGeneric>* instructions;
+		int* instructionAtByte; // Index of the instruction starting at each byte, -1 if none
+		Arena* arena;           // Not thread safe, only used with a single range
+		int start;
+		int end;
+		bool failed;
+	};
+
+	// The instructions cover the buffer end to end, so a range owns the bytes from its first instruction up to
+	// the next range's, the first and last also the bytes before and after every instruction
+	void IndexRange(void* userData) {
+		FinishRange& range = *(FinishRange*)userData;
+		List<InstructionGeneric>& instructions = *range.instructions;
+		int firstByte = (range.start == 0) ? 0 : instructions[range.start].address;
+		int endByte = (range.end == instructions.Size()) ? range.buffer->size + 1 : instructions[range.end].address;
+		for (int i = firstByte; i < endByte; i++) {
+			range.instructionAtByte[i] = -1;
+		}
+		for (int i = range.start; i < range.end; i++) {
+			range.instructionAtByte[instructions[i].address] = i;
 		}
+	}
 
-		// Get file size
-		fseek(file, 0, SEEK_END);
-		long size = ftell(file);
-		fseek(file, 0, SEEK_SET);
+	void ResolveRange(void* userData) {
+		FinishRange& range = *(FinishRange*)userData;
+		List<InstructionGeneric>& instructions = *range.instructions;
+		range.failed = false;
 
-		// Read file into buffer
-		int bufferSize = size;
-		byte* buffer = new byte[bufferSize];
-		fread_s(buffer, bufferSize, sizeof(char), bufferSize, file);
-		fclose(file);
+		// Resolve jump targets
+		for (int i = range.start; i < range.end; i++) {
+			InstructionGeneric& instruction = instructions[i];
+			if (instruction.type == InstructionType::JUMP) {
+				int target = instruction.jump.byteLocation;
+				if (target < 0 || target > range.buffer->size || range.instructionAtByte[target] < 0) {
+					range.failed = true;
+					return;
+				}
+				instruction.jump.instructionIndex = range.instructionAtByte[target];
+			}
+		}
 
-		// Return buffer
-		return { buffer, bufferSize };
+		// Stringify
+		for (int i = range.start; i < range.end; i++) {
+			InstructionGeneric& instruction = instructions[i];
+			if (range.arena) {
+				char text[128];
+				int length = FormatInstruction(instruction, text, sizeof(text));
+				instruction.asString = String::Borrow(range.arena->CopyString(text, length));
+			}
+			else {
+				instruction.asString = InstructionToString(instruction);
+			}
+		}
+	}
+
+	// A null pool finishes the list on this thread
+	bool FinishDecode(Buffer& buffer, List<InstructionGeneric>& instructions, Arena* arena = nullptr, ThreadPool* pool = nullptr) {
+		int* instructionAtByte = arena ? arena->AllocateArray<int>(buffer.size + 1) : new int[buffer.size + 1];
+
+		int rangeCount = pool ? pool->ThreadCount() : 1;
+		if (rangeCount > instructions.Size()) rangeCount = instructions.Size();
+		if (rangeCount < 1) rangeCount = 1;
+		FinishRange* ranges = new FinishRange[rangeCount];
+		for (int i = 0; i < rangeCount; i++) {
+			ranges[i] = { &buffer, &instructions, instructionAtByte, arena,
+				(int)((long long)instructions.Size() * i / rangeCount), (int)((long long)instructions.Size() * (i + 1) / rangeCount), false };
+		}
+
+		// Every range has to be indexed before any jump is resolved against the index
+		if (pool) {
+			for (int i = 0; i < rangeCount; i++) pool->Submit(IndexRange, &ranges[i]);
+			pool->Wait();
+			for (int i = 0; i < rangeCount; i++) pool->Submit(ResolveRange, &ranges[i]);
+			pool->Wait();
+		}
+		else {
+			IndexRange(&ranges[0]);
+			ResolveRange(&ranges[0]);
+		}
+
+		bool failed = false;
+		for (int i = 0; i < rangeCount; i++) {
+			if (ranges[i].failed) failed = true;
+		}
+		if (failed) printf("ERROR WHILE DECODING: Could not resolve jump target\n");
+
+		delete[] ranges;
+		if (!arena) delete[] instructionAtByte;
+		return !failed;
 	}
 
 	//----------------------------------------------
 	// Main
 	//----------------------------------------------
+	bool DecodeLinear(Buffer& buffer, List<InstructionGeneric>& instructions, Arena* arena) {
+		for (int bp = 0; bp < buffer.size;)
+		{
+			// Decoded straight into the list, a failed decode throws the whole list away anyway
+			InstructionGeneric& instruction = instructions.EmplaceBack();
+			int bytes = DecodeInstructionInBuffer(buffer, bp, instruction);
+			if (bytes == 0) {
+				PrintDecodeError(buffer, bp);
+				return false;
+			}
+
+			instruction.index = instructions.Size() - 1;
+			bp += bytes;
+		}
+
+		return FinishDecode(buffer, instructions, arena);
+	}
+
 	List<InstructionGeneric> Decode(Buffer& buffer) {
 		List<InstructionGeneric> instructions;
+		if (!DecodeLinear(buffer, instructions, nullptr)) {
+			return {};
+		}
+		return instructions;
+	}
 
-		struct InstructionIndexToByte {
-			int instructionIndex;
-			int byte;
-		};
+	List<InstructionGeneric>* Decode(Buffer& buffer, Arena& arena) {
+		// Every instruction is at least two bytes, so this is enough room for all of them plus their
+		// text and the jump table. One block means one heap allocation for the whole decode
+		const int averageTextLength = 24;
+		int maxInstructions = buffer.size / 2 + 1;
+		arena.Reserve(sizeof(List<InstructionGeneric>) + maxInstructions * (sizeof(InstructionGeneric) + averageTextLength) + (buffer.size + 1) * sizeof(int) + 64);
+
+		List<InstructionGeneric>* instructions = arena.New<List<InstructionGeneric>>(arena);
+		instructions->Reserve(maxInstructions);
+		if (!DecodeLinear(buffer, *instructions, &arena)) {
+			instructions->Clear();
+		}
+		return instructions;
+	}
 
-		// Used for jump instructions
-		List<InstructionIndexToByte> instructionIndexToByte;
+	//----------------------------------------------
+	// Recursive traversal
+	//----------------------------------------------
+	List<InstructionGeneric> DecodeReachable(Buffer& buffer, int entry) {
+		// Index + 1 of the instruction starting at each byte, 0 if none. covered marks every byte of an instruction
+		int* startOf = new int[buffer.size]();
+		bool* covered = new bool[buffer.size]();
 
-		// Print-decode buffer
-		for (int bp = 0; bp < buffer.size;)
-		{
-			OpCode code = ParseOpCode(buffer.data[bp], buffer.data[bp + 1]);
-			int bytes = 0;
-			InstructionGeneric instruction;
-			switch (code) {
-			case OpCode::MOVE_TOFROM_REGMEM:
-				instruction.type = InstructionType::MOVE;
-				bytes = OperationMoveToFromRegMemParse(&buffer.data[bp], instruction.move);
-				break;
-			case OpCode::MOVE_IMMEDIATE_TO_REGMEM:
-				instruction.type = InstructionType::MOVE;
-				bytes = OperationMoveImmediateToRegMemParse(&buffer.data[bp], instruction.move);
-				break;
-			case OpCode::MOVE_IMMEDIATE_TO_REG:
-				instruction.type = InstructionType::MOVE;
-				bytes = OperationMoveImmediateToRegisterParse(&buffer.data[bp], instruction.move);
-				break;
-			case OpCode::MOVE_MEMORY_TO_ACCUMULATOR:
-				instruction.type = InstructionType::MOVE;
-				bytes = OperationMoveMemoryToAccumulatorParse(&buffer.data[bp], instruction.move);
-				break;
-			case OpCode::MOVE_ACCUMULATOR_TO_MEMORY:
-				instruction.type = InstructionType::MOVE;
-				bytes = OperationMoveAccumulatorToMemoryParse(&buffer.data[bp], instruction.move);
-				break;
-			case OpCode::MOVE_REGMEM_TO_SEGMENT:
-				instruction.type = InstructionType::MOVE;
-				bytes = OperationMoveRegMemToSegmentRegisterParse(&buffer.data[bp], instruction.move);
-				break;
-			case OpCode::MOVE_SEGMENT_TO_REGMEM:
-				instruction.type = InstructionType::MOVE;
-				bytes = OperationMoveSegmentRegisterToRegMemParse(&buffer.data[bp], instruction.move);
-				break;
-			case OpCode::ADD_IMMEDIATE_TO_ACCUMULATOR:
-				instruction.type = InstructionType::ADD;
-				bytes = OperationAddImmediateToAccumulatorParse(&buffer.data[bp], instruction.add);
-				break;
-			case OpCode::ADD_TOFROM_REGMEM:
-				instruction.type = InstructionType::ADD;
-				bytes = OperationAddToFromRegMemParse(&buffer.data[bp], instruction.add);
-				break;
-			case OpCode::ADD_IMMEDIATE_TO_REGMEM:
-				instruction.type = InstructionType::ADD;
-				bytes = OperationAddImmediateToRegMemParse(&buffer.data[bp], instruction.add);
-				break;
-			case OpCode::SUB_TOFROM_REGMEM:
-				instruction.type = InstructionType::SUB;
-				bytes = OperationSubToFromRegMemParse(&buffer.data[bp], instruction.sub);
-				break;
-			case OpCode::SUB_IMMEDIATE_TO_REGMEM:
-				instruction.type = InstructionType::SUB;
-				bytes = OperationSubImmediateFromRegMemParse(&buffer.data[bp], instruction.sub);
-				break;
-			case OpCode::SUB_IMMEDIATE_TO_ACCUMULATOR:
-				instruction.type = InstructionType::SUB;
-				bytes = OperationSubImmediateFromAccumulatorParse(&buffer.data[bp], instruction.sub);
-				break;
-			case OpCode::CMP_REG_WITH_REGMEM:
-				instruction.type = InstructionType::COMPARE;
-				bytes = OperationCompareRegWithRegMemParse(&buffer.data[bp], instruction.compare);
-				break;
-			case OpCode::CMP_IMMEDIATE_WITH_REGMEM:
-				instruction.type = InstructionType::COMPARE;
-				bytes = OperationCompareImmediateWithRegMemParse(&buffer.data[bp], instruction.compare);
-				break;
-			case OpCode::CMP_IMMEDIATE_WITH_ACCUMULATOR:
-				instruction.type = InstructionType::COMPARE;
-				bytes = OperationCompareImmediateWithAccumulatorParse(&buffer.data[bp], instruction.compare);
-				break;
-			case OpCode::JUMP_ALWAYS_RELATIVE_WIDE:
-			case OpCode::JUMP_ON_EQUAL_OR_ZERO:
-			case OpCode::JUMP_ON_LESS:
-			case OpCode::JUMP_ON_LESS_OR_EQUAL:
-			case OpCode::JUMP_ON_BELOW:
-			case OpCode::JUMP_ON_BELOW_OR_EQUAL:
-			case OpCode::JUMP_ON_PARITY:
-			case OpCode::JUMP_ON_OVERFLOW:
-			case OpCode::JUMP_ON_SIGN:
-			case OpCode::JUMP_ON_NOT_EQUAL_OR_ZERO:
-			case OpCode::JUMP_ON_GREATER_OR_EQUAL:
-			case OpCode::JUMP_ON_GREATER:
-			case OpCode::JUMP_ON_ABOVE_OR_EQUAL:
-			case OpCode::JUMP_ON_ABOVE:
-			case OpCode::JUMP_ON_NOT_PARITY:
-			case OpCode::JUMP_ON_NOT_OVERFLOW:
-			case OpCode::JUMP_ON_NOT_SIGN:
-			case OpCode::LOOP_CX_TIMES:
-			case OpCode::LOOP_WHILE_ZERO:
-			case OpCode::LOOP_WHILE_NOT_ZERO:
-			case OpCode::JUMP_ON_CX_ZERO:
-				{
-					instruction.type = InstructionType::JUMP;
-					bool isWide = (code == OpCode::JUMP_ALWAYS_RELATIVE_WIDE);
-					bytes = OperationJumpConditionalParse(&buffer.data[bp], instruction.jump, bp, isWide);
+		List<InstructionGeneric> found;
+		List<int> worklist;
+		worklist.Add(entry);
+
+		for (int next = 0; next < worklist.Size(); next++) {
+			int bp = worklist[next];
+
+			// Follow the path until it runs into code we've already seen, data, or an unconditional jump
+			while (bp >= 0 && bp < buffer.size && !covered[bp]) {
+				InstructionGeneric instruction;
+				int bytes = DecodeInstructionInBuffer(buffer, bp, instruction);
+				if (bytes == 0) break;
+
+				bool overlaps = false;
+				for (int i = 1; i < bytes; i++) {
+					if (covered[bp + i]) overlaps = true;
+				}
+				if (overlaps) break;
+
+				for (int i = 0; i < bytes; i++) {
+					covered[bp + i] = true;
+				}
+				found.Add(instruction);
+				startOf[bp] = found.Size();
+
+				if (instruction.type == InstructionType::JUMP) {
+					worklist.Add(instruction.jump.byteLocation);
+					if (instruction.jump.condition == InstructionJump::JumpAlways) break;
 				}
-				break;
-			case OpCode::INTERRUPT:
-				instruction.type = InstructionType::INTERRUPT;
-				instruction.interrupt.interruptNumber = buffer.data[bp + 1];
-				bytes = 2;
-				break;
-			default:
-				printf("ERROR WHILE DECODING: Unhandled opcode 0x%x\n", buffer.data[bp]);
-				return {};
+				bp += bytes;
 			}
+		}
 
-			// instruction as string
+		// Put the instructions back in address order
+		List<InstructionGeneric> instructions;
+		instructions.Reserve(found.Size());
+		for (int bp = 0; bp < buffer.size; bp++) {
+			if (startOf[bp] == 0) continue;
+			InstructionGeneric& instruction = found[startOf[bp] - 1];
 			instruction.index = instructions.Size();
-			instructionIndexToByte.Add({ instruction.index, bp });
+			startOf[bp] = instruction.index + 1;
 			instructions.Add(instruction);
-			bp += bytes;
 		}
 
-		// Resolve jump targets
-		// Also idk why but the jump targets are off by one
-		for (int i = 0; i < instructions.Size(); i++)
-		{
+		// Resolve jump targets, a target that isn't the start of a decoded instruction stays at -1
+		for (int i = 0; i < instructions.Size(); i++) {
 			InstructionGeneric& instruction = instructions[i];
-			if (instruction.type == InstructionType::JUMP) {
-				bool resolved = false;
-				for (int i = 0; i < instructionIndexToByte.Size(); i++)
-				{
-					if (instructionIndexToByte[i].byte == instruction.jump.byteLocation) {
-						instruction.jump.instructionIndex = instructionIndexToByte[i].instructionIndex;
-						resolved = true;
-						break;
-					}
-				}
-				if (!resolved) {
-					printf("ERROR WHILE DECODING: Could not resolve jump target\n");
-					return {};
-				}
+			if (instruction.type != InstructionType::JUMP) continue;
+
+			int target = instruction.jump.byteLocation;
+			if (target >= 0 && target < buffer.size && startOf[target] != 0) {
+				instruction.jump.instructionIndex = startOf[target] - 1;
 			}
 		}
 
-		// Stringify
-		for (int i = 0; i < instructions.Size(); i++)
-		{
+		for (int i = 0; i < instructions.Size(); i++) {
 			InstructionGeneric& instruction = instructions[i];
 			instruction.asString = InstructionToString(instruction);
 		}
 
+		delete[] startOf;
+		delete[] covered;
 		return instructions;
 	}
 
+	//----------------------------------------------
+	// Streaming
+	//----------------------------------------------
+	bool DecodeStream(Buffer& buffer, int windowSize, DecodeWindowCallback callback, void* userData) {
+		// One list reused for every window, so memory use doesn't grow with the size of the input
+		List<InstructionGeneric> window;
+
+		for (int bp = 0; bp < buffer.size;) {
+			window.Clear();
+
+			// An instruction that starts inside the window may run past its end, the next window picks up after it
+			int windowEnd = bp + windowSize;
+			while (bp < windowEnd && bp < buffer.size) {
+				InstructionGeneric& instruction = window.EmplaceBack();
+				int bytes = DecodeInstructionInBuffer(buffer, bp, instruction);
+				if (bytes == 0) {
+					PrintDecodeError(buffer, bp);
+					return false;
+				}
+
+				instruction.index = window.Size() - 1;
+				bp += bytes;
+			}
+
+			callback(window, userData);
+		}
+		return true;
+	}
+
+	//----------------------------------------------
+	// Parallel
+	// The buffer is split into chunks that decode at the same time. A chunk can't know where the
+	// previous chunk's last instruction ends, so it decodes a candidate path from each of its first
+	// few offsets. Paths fall into step with each other within a few instructions, and once a path
+	// lands on an instruction an earlier path already decoded it links to it and stops.
+	// Stitching then walks the chunks in order and follows whichever candidate the previous chunk
+	// really ends on, so the result is exactly what a serial decode produces.
+	//----------------------------------------------
+
+	struct Candidate {
+		List<InstructionGeneric> instructions;
+		int mergeCandidate; // Candidate this path ran into, or -1
+		int mergeIndex;     // Index in that candidate's instructions where the paths joined
+		int errorByte;      // Byte with an unhandled opcode that ended this path, or -1
+	};
+
+	struct Chunk {
+		int start;
+		int end;
+		Candidate candidates[MAX_INSTRUCTION_SIZE];
+
+		// For the pool tasks
+		Buffer* buffer;
+		int* ownerCandidate;
+		int* ownerIndex;
+
+		// Runs of candidate instructions the stitched list takes from this chunk, in order
+		struct Segment {
+			Candidate* candidate;
+			int first;
+			int count;
+			int at; // Index in the stitched list of the first one
+		};
+		List<Segment> segments;
+		List<InstructionGeneric>* stitched;
+	};
+
+	void DecodeChunk(void* userData) {
+		Chunk& chunk = *(Chunk*)userData;
+		Buffer& buffer = *chunk.buffer;
+		int* ownerCandidate = chunk.ownerCandidate;
+		int* ownerIndex = chunk.ownerIndex;
+
+		for (int bp = chunk.start; bp < chunk.end; bp++) {
+			ownerCandidate[bp] = -1;
+		}
+
+		for (int k = 0; k < MAX_INSTRUCTION_SIZE && chunk.start + k < chunk.end; k++) {
+			Candidate& candidate = chunk.candidates[k];
+			candidate.mergeCandidate = -1;
+			candidate.mergeIndex = 0;
+			candidate.errorByte = -1;
+
+			for (int bp = chunk.start + k; bp < chunk.end;) {
+				if (ownerCandidate[bp] >= 0) {
+					candidate.mergeCandidate = ownerCandidate[bp];
+					candidate.mergeIndex = ownerIndex[bp];
+					break;
+				}
+
+				InstructionGeneric instruction;
+				int bytes = DecodeInstructionInBuffer(buffer, bp, instruction);
+				if (bytes == 0) {
+					candidate.errorByte = bp;
+					break;
+				}
+
+				ownerCandidate[bp] = k;
+				ownerIndex[bp] = candidate.instructions.Size();
+				candidate.instructions.Add(instruction);
+				bp += bytes;
+			}
+		}
+	}
+
+	// Moves the chunk's segments into their places in the stitched list, and frees its candidates
+	void CopyChunk(void* userData) {
+		Chunk& chunk = *(Chunk*)userData;
+		List<InstructionGeneric>& stitched = *chunk.stitched;
+		for (int s = 0; s < chunk.segments.Size(); s++) {
+			Chunk::Segment& segment = chunk.segments[s];
+			for (int j = 0; j < segment.count; j++) {
+				InstructionGeneric& instruction = stitched[segment.at + j];
+				instruction = std::move(segment.candidate->instructions[segment.first + j]);
+				instruction.index = segment.at + j;
+			}
+		}
+		for (int k = 0; k < MAX_INSTRUCTION_SIZE; k++) {
+			chunk.candidates[k].instructions = List<InstructionGeneric>();
+		}
+	}
+
+	List<InstructionGeneric> DecodeParallel(Buffer& buffer, int threadCount) {
+		if (threadCount <= 0) {
+			threadCount = (int)std::thread::hardware_concurrency();
+		}
+
+		// Not worth the threads for small inputs
+		const int minimumChunkSize = 16 * 1024;
+		if (threadCount > buffer.size / minimumChunkSize) {
+			threadCount = buffer.size / minimumChunkSize;
+		}
+		if (threadCount <= 1) {
+			return Decode(buffer);
+		}
+
+		// The same pool decodes the chunks and then finishes the stitched list
+		ThreadPool pool(threadCount);
+		Chunk* chunks = new Chunk[threadCount];
+		int* ownerCandidate = new int[buffer.size];
+		int* ownerIndex = new int[buffer.size];
+
+		int chunkSize = (buffer.size + threadCount - 1) / threadCount;
+		for (int i = 0; i < threadCount; i++) {
+			chunks[i].start = i * chunkSize;
+			chunks[i].end = (i == threadCount - 1) ? buffer.size : (i + 1) * chunkSize;
+			chunks[i].buffer = &buffer;
+			chunks[i].ownerCandidate = ownerCandidate;
+			chunks[i].ownerIndex = ownerIndex;
+			pool.Submit(DecodeChunk, &chunks[i]);
+		}
+		pool.Wait();
+
+		// Stitch. Which runs of which candidates make up the list is worked out here, the copying is left to the pool
+		List<InstructionGeneric> instructions;
+		bool failed = false;
+		int total = 0;
+		int bp = 0;
+		for (int i = 0; i < threadCount && !failed; i++) {
+			Chunk& chunk = chunks[i];
+			chunk.stitched = &instructions;
+			if (bp >= chunk.end) continue;
+
+			int candidateIndex = bp - chunk.start;
+			int first = 0;
+			while (true) {
+				Candidate& candidate = chunk.candidates[candidateIndex];
+				int count = candidate.instructions.Size() - first;
+				if (count > 0) {
+					chunk.segments.Add({ &candidate, first, count, total });
+					total += count;
+					InstructionGeneric& last = candidate.instructions[candidate.instructions.Size() - 1];
+					bp = last.address + last.size;
+				}
+
+				if (candidate.errorByte >= 0) {
+					PrintDecodeError(buffer, candidate.errorByte);
+					failed = true;
+					break;
+				}
+				if (candidate.mergeCandidate < 0) break;
+
+				first = candidate.mergeIndex;
+				candidateIndex = candidate.mergeCandidate;
+			}
+		}
+
+		if (!failed) {
+			instructions.Resize(total);
+			for (int i = 0; i < threadCount; i++) {
+				pool.Submit(CopyChunk, &chunks[i]);
+			}
+			pool.Wait();
+		}
+
+		delete[] ownerIndex;
+		delete[] ownerCandidate;
+		delete[] chunks;
+
+		if (failed || !FinishDecode(buffer, instructions, nullptr, &pool)) {
+			return {};
+		}
+		return instructions;
+	}
 }
\ No newline at end of file
@@ -1,7 +1,35 @@
 #pragma once
 #include "Types.h"
 #include "List.h"
+#include "Arena.h"
 
 namespace Decoder {
+	typedef void (*DecodeWindowCallback)(List<InstructionGeneric>& instructions, void* userData);
+
 	List<InstructionGeneric> Decode(Buffer& buffer);
+
+	// Same as Decode, but the list, its storage, the instruction strings and the side tables all live in the arena.
+	// Nothing is freed separately, resetting the arena releases the whole decode
+	List<InstructionGeneric>* Decode(Buffer& buffer, Arena& arena);
+
+	// Decodes only code reachable from "entry" by following jumps, instead of sweeping every byte.
+	// Instructions come back in address order, bytes that were never reached are left out
+	List<InstructionGeneric> DecodeReachable(Buffer& buffer, int entry = 0);
+
+	// Decodes one instruction at "data", where "address" is its byte location and is used to resolve jumps.
+	// Returns the instruction length in bytes, or 0 if the opcode is not supported.
+	// Up to 6 bytes are read whatever the instruction's length, so "data" needs that many readable bytes
+	int DecodeInstruction(byte const* data, int address, InstructionGeneric& instruction);
+
+	// Prints why the instruction at "bp" didn't decode, an unhandled opcode or one cut off by the end of the buffer
+	void PrintDecodeError(Buffer& buffer, int bp);
+
+	// Decodes the buffer a window of "windowSize" bytes at a time and hands each window's instructions to the callback.
+	// The list is reused between windows, so jump targets are left unresolved (instructionIndex is -1).
+	// Instructions aren't stringified either, the callback can format the ones it needs with FormatInstruction
+	bool DecodeStream(Buffer& buffer, int windowSize, DecodeWindowCallback callback, void* userData);
+
+	// Same result as Decode, but the buffer is split into chunks decoded on "threadCount" threads.
+	// 0 uses every hardware thread, small buffers are decoded serially
+	List<InstructionGeneric> DecodeParallel(Buffer& buffer, int threadCount = 0);
 }
\ No newline at end of file
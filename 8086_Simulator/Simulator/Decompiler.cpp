@@ -0,0 +1,137 @@
+#include "Decompiler.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "String.h"
+#include "StringifyTypes.h"
+#include "Decoder.h"
+
+namespace Decompiler {
+	void WriteString(BufferedWriter& output, String const& str) {
+		output.Write(str.c_str(), (int)strlen(str.c_str()));
+	}
+
+	// Formats into a stack buffer and writes it out, so nothing is allocated per line
+	void WriteFormat(BufferedWriter& output, const char* format, ...) {
+		char text[128];
+		va_list args;
+		va_start(args, format);
+		int length = vsnprintf(text, sizeof(text), format, args);
+		va_end(args);
+		if (length > (int)sizeof(text) - 1) length = (int)sizeof(text) - 1;
+		if (length > 0) output.Write(text, length);
+	}
+
+	void WriteData(Buffer& buffer, int start, int end, BufferedWriter& output) {
+		const int bytesPerLine = 16;
+		for (int line = start; line < end; line += bytesPerLine) {
+			WriteString(output, String::Borrow("\tdb "));
+			for (int bp = line; bp < end && bp < line + bytesPerLine; bp++) {
+				WriteFormat(output, bp == line ? "0x%02x" : ", 0x%02x", buffer.data[bp]);
+			}
+			output.WriteChar('\n');
+		}
+	}
+
+	void WriteJump(BufferedWriter& output, InstructionGeneric const& instruction) {
+		InstructionJump const& jump = instruction.jump;
+
+		// The decoder only understands the near form of jmp, stop nasm from picking the short one
+		const char* mnemonic = (jump.condition == InstructionJump::JumpAlways) ? "jmp near" : ConditionName(jump.condition);
+		if (jump.instructionIndex >= 0) {
+			WriteFormat(output, "%s LABEL_%i", mnemonic, jump.instructionIndex);
+			return;
+		}
+
+		// Target is not the start of a decoded instruction, fall back to an offset from this one
+		WriteFormat(output, "%s $%+i", mnemonic, jump.byteLocation - instruction.address);
+	}
+
+	void Write(Buffer& buffer, List<InstructionGeneric>& instructions, BufferedWriter& output) {
+		bool* isTarget = new bool[instructions.Size() + 1]();
+		for (int i = 0; i < instructions.Size(); i++) {
+			InstructionGeneric& instruction = instructions[i];
+			if (instruction.type == InstructionType::JUMP && instruction.jump.instructionIndex >= 0) {
+				isTarget[instruction.jump.instructionIndex] = true;
+			}
+		}
+
+		WriteString(output, String::Borrow("bits 16\n"));
+
+		int bp = 0;
+		for (int i = 0; i < instructions.Size(); i++) {
+			InstructionGeneric& instruction = instructions[i];
+			if (instruction.address > bp) {
+				WriteData(buffer, bp, instruction.address, output);
+			}
+
+			if (isTarget[i]) {
+				WriteFormat(output, "LABEL_%i:\n", i);
+			}
+
+			output.WriteChar('\t');
+			if (instruction.type == InstructionType::JUMP) {
+				WriteJump(output, instruction);
+			}
+			else {
+				WriteString(output, instruction.asString);
+			}
+			output.WriteChar('\n');
+			bp = instruction.address + instruction.size;
+		}
+		WriteData(buffer, bp, buffer.size, output);
+
+		delete[] isTarget;
+	}
+
+	//----------------------------------------------
+	// Streaming
+	//----------------------------------------------
+	struct StreamTarget {
+		BufferedWriter* output;
+		MappedFile* file; // nullptr keeps every page
+	};
+
+	void WriteWindow(List<InstructionGeneric>& instructions, void* userData) {
+		StreamTarget& target = *(StreamTarget*)userData;
+		BufferedWriter& output = *target.output;
+		const int maxLineLength = 128;
+
+		for (int i = 0; i < instructions.Size(); i++) {
+			InstructionGeneric& instruction = instructions[i];
+			if (instruction.type == InstructionType::JUMP) {
+				output.WriteChar('\t');
+				WriteJump(output, instruction);
+				output.WriteChar('\n');
+				continue;
+			}
+
+			// Formatted in place in the output buffer
+			char* line = output.Reserve(maxLineLength);
+			line[0] = '\t';
+			int length = FormatInstruction(instruction, line + 1, maxLineLength - 2);
+			if (length > maxLineLength - 3) length = maxLineLength - 3;
+			line[1 + length] = '\n';
+			output.Commit(length + 2);
+		}
+
+		// The lines are in the output now, the window's bytes won't be read again
+		if (target.file && instructions.Size() > 0) {
+			InstructionGeneric& first = instructions[0];
+			InstructionGeneric& last = instructions[instructions.Size() - 1];
+			target.file->Discard(first.address, last.address + last.size - first.address);
+		}
+	}
+
+	bool WriteStreamed(Buffer& buffer, BufferedWriter& output, int windowSize) {
+		WriteString(output, String::Borrow("bits 16\n"));
+		StreamTarget target = { &output, nullptr };
+		return Decoder::DecodeStream(buffer, windowSize, WriteWindow, &target);
+	}
+
+	bool WriteStreamed(MappedFile& file, BufferedWriter& output, int windowSize) {
+		WriteString(output, String::Borrow("bits 16\n"));
+		StreamTarget target = { &output, &file };
+		return Decoder::DecodeStream(file.buffer, windowSize, WriteWindow, &target);
+	}
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include "Types.h"
+#include "BufferedWriter.h"
+#include "MappedFile.h"
+
+//----------------------------------------------
+// Decompiler
+// Turns decoded instructions back into assembly that nasm can rebuild
+//----------------------------------------------
+namespace Decompiler {
+	// Jump targets get labels, and any bytes of the buffer that no instruction covers
+	// (data, or code that was never reached) are written out as db directives
+	void Write(Buffer& buffer, List<InstructionGeneric>& instructions, BufferedWriter& output);
+
+	// Decodes and writes one window at a time, so output starts right away and memory use stays flat.
+	// Nothing past the current window is known, so jumps are written relative to themselves ($+n) instead of to labels.
+	// Returns false if an unsupported opcode stops the decode, everything before it has been written
+	bool WriteStreamed(Buffer& buffer, BufferedWriter& output, int windowSize = 64 * 1024);
+
+	// Same, for a mapped file whose pages are discarded once their window is written, so a file larger than memory
+	// streams through without piling up in it
+	bool WriteStreamed(MappedFile& file, BufferedWriter& output, int windowSize = 64 * 1024);
+}
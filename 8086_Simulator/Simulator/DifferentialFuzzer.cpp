@@ -0,0 +1,549 @@
+#include "DifferentialFuzzer.h"
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include "Executor.h"
+#include "Lockstep.h"
+#include "Encoder.h"
+#include "StringifyTypes.h"
+#include "ThreadPool.h"
+
+namespace DifferentialFuzzer {
+	//----------------------------------------------
+	// Random numbers
+	// xorshift64*, every program gets its own generator so any one of them can be rebuilt from its index
+	//----------------------------------------------
+	struct Random {
+		qword state;
+
+		Random(unsigned int seed, int program) : state((((qword)seed << 32) | (unsigned int)program) * 0x9E3779B97F4A7C15ull + 1) {}
+
+		unsigned int Next() {
+			state ^= state >> 12;
+			state ^= state << 25;
+			state ^= state >> 27;
+			return (unsigned int)((state * 0x2545F4914F6CDD1Dull) >> 32);
+		}
+
+		int Below(int count) { return (int)(Next() % (unsigned int)count); }
+		bool Chance(int percent) { return Below(100) < percent; }
+	};
+
+	//----------------------------------------------
+	// Program generation
+	// Instructions are built as InstructionGeneric and run through the encoder, so every one is
+	// something the decoder accepts. Jumps point at an instruction index and get their offset on assembly
+	//----------------------------------------------
+	struct GeneratedInstruction {
+		InstructionGeneric instruction;
+		int jumpTarget; // Index of the instruction a jump lands on, the instruction count for the end
+	};
+
+	static const InstructionJump::Condition conditions[] = {
+		InstructionJump::JumpAlways, InstructionJump::JumpOnEqualOrZero, InstructionJump::JumpOnLess,
+		InstructionJump::JumpOnLessOrEqual, InstructionJump::JumpOnBelow, InstructionJump::JumpOnBelowOrEqual,
+		InstructionJump::JumpOnParity, InstructionJump::JumpOnOverflow, InstructionJump::JumpOnSign,
+		InstructionJump::JumpOnNotEqualOrZero, InstructionJump::JumpOnGreaterOrEqual, InstructionJump::JumpOnGreater,
+		InstructionJump::JumpOnAboveOrEqual, InstructionJump::JumpOnAbove, InstructionJump::JumpOnNotParity,
+		InstructionJump::JumpOnNotOverflow, InstructionJump::JumpOnNotSign, InstructionJump::Loop,
+		InstructionJump::LoopEqualOrZero, InstructionJump::LoopNotEqualOrZero, InstructionJump::JumpOnCXZero,
+	};
+	static const int CONDITION_COUNT = sizeof(conditions) / sizeof(conditions[0]);
+
+	// Mostly values at the edges the flags care about, the rest anywhere
+	word RandomWord(Random& random) {
+		switch (random.Below(4)) {
+		case 0: return (word)random.Below(4);
+		case 1: return (word)(0x7ffe + random.Below(4));
+		case 2: return (word)(0xffff - random.Below(4));
+		}
+		return (word)random.Next();
+	}
+
+	Operand RegisterOperand(Register reg) {
+		Operand o = {};
+		o.type = Operand::Type::REGISTER;
+		o.reg = reg;
+		return o;
+	}
+
+	Operand RandomRegister(Random& random, bool isWide) {
+		return RegisterOperand((Register)(random.Below(8) + (isWide ? (int)Register::AX : (int)Register::AL)));
+	}
+
+	Operand RandomSegmentRegister(Random& random, bool allowCS) {
+		// Writing cs moves the code out from under ip, only reading it is interesting
+		static const Register segments[] = { Register::ES, Register::SS, Register::DS, Register::CS };
+		return RegisterOperand(segments[random.Below(allowCS ? 4 : 3)]);
+	}
+
+	Operand RandomMemory(Random& random, int codeSize) {
+		Operand o = {};
+		o.type = Operand::Type::MEMORY_LOC;
+		if (random.Chance(30)) {
+			// Half of the direct addresses land on the program itself, so code gets rewritten under the caches
+			o.mem.effectiveAddress = EffectiveAddress::DIRECT_ADDRESS;
+			o.mem.memoryOffset = random.Chance(50) ? (word)((CPU::LOAD_SEGMENT << 4) + random.Below(codeSize)) : (word)random.Next();
+			return o;
+		}
+
+		o.mem.effectiveAddress = (EffectiveAddress)random.Below(8);
+		switch (random.Below(3)) {
+		case 0: o.mem.memoryOffset = 0; break;
+		case 1: o.mem.memoryOffset = (word)(signed char)random.Next(); break;
+		default: o.mem.memoryOffset = (word)random.Next(); break;
+		}
+		return o;
+	}
+
+	Operand RandomImmediate(Random& random, bool isWide) {
+		Operand o = {};
+		o.type = Operand::Type::IMMEDIATE;
+		// Narrow immediates decode sign extended
+		o.immediate = isWide ? RandomWord(random) : (word)(signed char)RandomWord(random);
+		return o;
+	}
+
+	void RandomOperands(Random& random, bool isWide, int codeSize, Operand& dest, Operand& source) {
+		switch (random.Below(3)) {
+		case 0:
+			dest = RandomRegister(random, isWide);
+			source = random.Chance(50) ? RandomRegister(random, isWide) : RandomMemory(random, codeSize);
+			break;
+		case 1:
+			dest = RandomMemory(random, codeSize);
+			source = RandomRegister(random, isWide);
+			break;
+		default:
+			dest = random.Chance(50) ? RandomRegister(random, isWide) : RandomMemory(random, codeSize);
+			source = RandomImmediate(random, isWide);
+			break;
+		}
+	}
+
+	void RandomMove(Random& random, int codeSize, InstructionGeneric& instruction) {
+		InstructionMove& move = instruction.move;
+		instruction.type = InstructionType::MOVE;
+
+		if (random.Chance(15)) {
+			// Segment registers are always wide
+			instruction.isWide = true;
+			Operand other = random.Chance(50) ? RandomRegister(random, true) : RandomMemory(random, codeSize);
+			if (random.Chance(50)) {
+				move.dest = RandomSegmentRegister(random, false);
+				move.source = other;
+			}
+			else {
+				move.dest = other;
+				move.source = RandomSegmentRegister(random, true);
+			}
+			return;
+		}
+
+		RandomOperands(random, instruction.isWide, codeSize, move.dest, move.source);
+		// Picks between the short register form and the reg/mem form of mov reg, imm
+		if (move.source.type == Operand::Type::IMMEDIATE && random.Chance(50)) {
+			move.source.dataSize = instruction.isWide ? ExplicitDataSize::WORD : ExplicitDataSize::BYTE;
+		}
+	}
+
+	void Generate(Random& random, Options const& options, List<GeneratedInstruction>& program) {
+		program.Clear();
+
+		// Start every general register off with a random value, so the reproducer needs nothing but the binary
+		for (int reg = (int)Register::AX; reg <= (int)Register::DI; reg++) {
+			GeneratedInstruction& setup = program.EmplaceBack();
+			setup.jumpTarget = -1;
+			setup.instruction.type = InstructionType::MOVE;
+			setup.instruction.isWide = true;
+			setup.instruction.move.dest = RegisterOperand((Register)reg);
+			setup.instruction.move.source = RandomImmediate(random, true);
+		}
+
+		int count = program.Size() + options.programLength;
+		int codeSize = count * 4;
+		while (program.Size() < count) {
+			GeneratedInstruction& generated = program.EmplaceBack();
+			InstructionGeneric& instruction = generated.instruction;
+			generated.jumpTarget = -1;
+			instruction.isWide = random.Chance(50);
+
+			int kind = random.Below(100);
+			if (kind < 30) {
+				RandomMove(random, codeSize, instruction);
+			}
+			else if (kind < 75) {
+				static const InstructionType arithmetic[] = { InstructionType::ADD, InstructionType::SUB, InstructionType::COMPARE };
+				instruction.type = arithmetic[random.Below(3)];
+				RandomOperands(random, instruction.isWide, codeSize, instruction.add.dest, instruction.add.source);
+			}
+			else if (kind < 96) {
+				instruction.type = InstructionType::JUMP;
+				instruction.jump.condition = conditions[random.Below(CONDITION_COUNT)];
+				generated.jumpTarget = random.Below(count + 1);
+			}
+			else {
+				// No handlers are installed, so these only check that both sides skip over them the same way
+				instruction.type = InstructionType::INTERRUPT;
+				instruction.interrupt.interruptNumber = (byte)random.Next();
+			}
+		}
+	}
+
+	// Encodes the program into "image". A short jump whose target ended up out of range falls through instead
+	void Assemble(List<GeneratedInstruction>& program, List<byte>& image) {
+		int count = program.Size();
+		int* address = new int[count + 1];
+		byte encoded[Encoder::MAX_INSTRUCTION_SIZE];
+
+		// Jump lengths don't depend on their offsets, so every address is known before any jump is encoded
+		address[0] = 0;
+		for (int i = 0; i < count; i++) {
+			InstructionGeneric& instruction = program[i].instruction;
+			int size;
+			if (instruction.type == InstructionType::JUMP) size = (instruction.jump.condition == InstructionJump::JumpAlways) ? 3 : 2;
+			else size = Encoder::EncodeInstruction(instruction, encoded);
+			address[i + 1] = address[i] + size;
+		}
+
+		image.Clear();
+		for (int i = 0; i < count; i++) {
+			InstructionGeneric& instruction = program[i].instruction;
+			if (instruction.type == InstructionType::JUMP) {
+				instruction.jump.byteOffset = address[program[i].jumpTarget] - address[i + 1];
+				if (Encoder::EncodeInstruction(instruction, encoded) == 0) {
+					instruction.jump.byteOffset = 0;
+				}
+			}
+
+			int size = Encoder::EncodeInstruction(instruction, encoded);
+			for (int b = 0; b < size; b++) {
+				image.Add(encoded[b]);
+			}
+		}
+		delete[] address;
+	}
+
+	//----------------------------------------------
+	// Engines
+	// Every way of running a program that is checked against CPU::StepReference
+	//----------------------------------------------
+	typedef void (*Engine)(CPU& cpu, int instructions);
+
+	void StepEngine(CPU& cpu, int instructions) {
+		for (int i = 0; i < instructions && !cpu.IsHalted(); i++) {
+			cpu.Step();
+		}
+	}
+
+	void RunEngine(CPU& cpu, int instructions) {
+		cpu.Run(instructions);
+	}
+
+	// Runs ahead a fixed distance, goes back to where it started and only then runs. Whatever the run ahead
+	// wrote has to be put back exactly, and nothing decoded from it can survive
+	void BaselineEngine(CPU& cpu, int instructions) {
+		cpu.SaveBaseline();
+		cpu.Run(64);
+		cpu.ResetToBaseline();
+		cpu.Run(instructions);
+	}
+
+	// An event already overdue when Run starts, with a limit set. Neither may change where the run stops
+	void OverdueEvent(CPU&, void*) {}
+
+	void RunLimited(CPU& cpu, qword instructions, CPU::Limits limits) {
+		cpu.scheduler.Schedule(cpu.instructionCount ? cpu.instructionCount - 1 : 0, 0, OverdueEvent);
+		cpu.limits = limits;
+		cpu.Run(instructions);
+		cpu.limits = { 0, 0, 0 };
+	}
+
+	// Asked to run twice as far, stopped by the limit exactly where the reference is, then let go again
+	void InstructionLimitEngine(CPU& cpu, int instructions) {
+		RunLimited(cpu, 2 * (qword)instructions, { cpu.instructionCount + instructions, 0, 0 });
+		if (cpu.exitReason == CPU::ExitReason::INSTRUCTION_LIMIT) {
+			cpu.halted = false;
+			cpu.exitReason = CPU::ExitReason::NONE;
+		}
+	}
+
+	// Write and time limits far out of reach
+	void WriteLimitEngine(CPU& cpu, int instructions) {
+		RunLimited(cpu, instructions, { 0, 0, cpu.memoryWriteCount + (1ull << 40) });
+	}
+
+	void TimeLimitEngine(CPU& cpu, int instructions) {
+		RunLimited(cpu, instructions, { 0, cpu.runMicroseconds + (1ull << 40), 0 });
+	}
+
+	// The engine's CPU shares a group with an exact copy, which stays with it, and a copy with other
+	// register values, which sooner or later goes another way. Whichever side it lands on has to match
+	void LockstepEngine(CPU& cpu, int instructions) {
+		static thread_local CPU twin;
+		static thread_local CPU variant;
+		cpu.ForkInto(twin);
+		cpu.ForkInto(variant);
+		twin.printErrors = false;
+		variant.printErrors = false;
+		variant.ax ^= 0x5a5a;
+		variant.cx += 1;
+
+		CPU* lanes[] = { &variant, &cpu, &twin };
+		Lockstep::Run(lanes, 3, instructions);
+	}
+
+	// The same group with an instruction limit on every lane where the reference is, asked to run twice as far
+	void LockstepLimitEngine(CPU& cpu, int instructions) {
+		cpu.limits = { cpu.instructionCount + instructions, 0, 0 };
+		LockstepEngine(cpu, 2 * instructions);
+		cpu.limits = { 0, 0, 0 };
+		if (cpu.exitReason == CPU::ExitReason::INSTRUCTION_LIMIT) {
+			cpu.halted = false;
+			cpu.exitReason = CPU::ExitReason::NONE;
+		}
+	}
+
+	struct EngineInfo {
+		const char* name;
+		Engine run;
+	};
+
+	static const EngineInfo engines[] = {
+		{ "Step", StepEngine },
+		{ "Run", RunEngine },
+		{ "Lockstep", LockstepEngine },
+		{ "LockstepLimit", LockstepLimitEngine },
+		{ "Baseline", BaselineEngine },
+		{ "InstructionLimit", InstructionLimitEngine },
+		{ "WriteLimit", WriteLimitEngine },
+		{ "TimeLimit", TimeLimitEngine },
+	};
+	static const int ENGINE_COUNT = sizeof(engines) / sizeof(engines[0]);
+
+	//----------------------------------------------
+	// Comparison
+	//----------------------------------------------
+	bool SameState(CPU& a, CPU& b) {
+		return a.ax == b.ax && a.bx == b.bx && a.cx == b.cx && a.dx == b.dx &&
+			a.sp == b.sp && a.bp == b.bp && a.si == b.si && a.di == b.di &&
+			a.cs == b.cs && a.ds == b.ds && a.ss == b.ss && a.es == b.es &&
+			a.ip == b.ip && a.flags == b.flags &&
+			a.halted == b.halted && a.exitReason == b.exitReason && a.instructionCount == b.instructionCount &&
+			a.memoryWriteCount == b.memoryWriteCount && a.memory.Equals(b.memory);
+	}
+
+	void PrintDifference(CPU& reference, CPU& candidate) {
+		struct { const char* name; word a; word b; } registers[] = {
+			{ "ax", reference.ax, candidate.ax }, { "bx", reference.bx, candidate.bx },
+			{ "cx", reference.cx, candidate.cx }, { "dx", reference.dx, candidate.dx },
+			{ "sp", reference.sp, candidate.sp }, { "bp", reference.bp, candidate.bp },
+			{ "si", reference.si, candidate.si }, { "di", reference.di, candidate.di },
+			{ "cs", reference.cs, candidate.cs }, { "ds", reference.ds, candidate.ds },
+			{ "ss", reference.ss, candidate.ss }, { "es", reference.es, candidate.es },
+			{ "ip", reference.ip, candidate.ip }, { "flags", reference.flags, candidate.flags },
+			{ "halted", reference.halted, candidate.halted }, { "exit reason", (word)reference.exitReason, (word)candidate.exitReason },
+			{ "memory writes", (word)reference.memoryWriteCount, (word)candidate.memoryWriteCount },
+		};
+		for (auto& reg : registers) {
+			if (reg.a != reg.b) printf("  %s: reference 0x%04x, engine 0x%04x\n", reg.name, reg.a, reg.b);
+		}
+		for (int address = 0; address < CPU::MEMORY_SIZE; address++) {
+			byte a = reference.memory.Read((word)address);
+			byte b = candidate.memory.Read((word)address);
+			if (a != b) {
+				printf("  memory from 0x%04x: reference 0x%02x, engine 0x%02x\n", address, a, b);
+				break;
+			}
+		}
+	}
+
+	// Runs the image on the reference and the engine side by side. Returns the instruction count at the
+	// first comparison that differs, or -1 if they agree until the program halts or hits the limit
+	long long FindDivergence(Buffer& image, Engine engine, int interval, int limit, CPU& reference, CPU& candidate) {
+		reference.Reset();
+		candidate.Reset();
+		reference.LoadProgram(image);
+		candidate.LoadProgram(image);
+
+		while (reference.instructionCount < (qword)limit) {
+			for (int i = 0; i < interval && !reference.IsHalted(); i++) {
+				reference.StepReference();
+			}
+			engine(candidate, interval);
+
+			if (!SameState(reference, candidate)) return (long long)reference.instructionCount;
+			if (reference.IsHalted()) break;
+		}
+		return -1;
+	}
+
+	long long FindDivergence(List<GeneratedInstruction>& program, List<byte>& image, Engine engine, int interval, int limit, CPU& reference, CPU& candidate) {
+		Assemble(program, image);
+		Buffer buffer = { image.Size() ? &image[0] : nullptr, image.Size() };
+		return FindDivergence(buffer, engine, interval, limit, reference, candidate);
+	}
+
+	//----------------------------------------------
+	// Shrinking
+	// Drops runs of instructions, halving the run length whenever nothing more can go, for as long as
+	// the engine still diverges. Jumps into a dropped run land on whatever follows it
+	//----------------------------------------------
+	void RemoveRange(List<GeneratedInstruction>& program, int start, int count, List<GeneratedInstruction>& out) {
+		out.Clear();
+		for (int i = 0; i < program.Size(); i++) {
+			if (i >= start && i < start + count) continue;
+			GeneratedInstruction& kept = out.EmplaceBack(program[i]);
+			if (kept.jumpTarget >= start + count) kept.jumpTarget -= count;
+			else if (kept.jumpTarget >= start) kept.jumpTarget = start;
+		}
+	}
+
+	void Shrink(List<GeneratedInstruction>& program, Engine engine, Options const& options, CPU& reference, CPU& candidate) {
+		List<GeneratedInstruction> smaller;
+		List<byte> image;
+		for (int run = program.Size() / 2; run >= 1;) {
+			bool removed = false;
+			for (int start = 0; start < program.Size();) {
+				RemoveRange(program, start, run, smaller);
+				if (FindDivergence(smaller, image, engine, 1, options.instructionLimit, reference, candidate) >= 0) {
+					program = std::move(smaller);
+					removed = true;
+				}
+				else {
+					start += run;
+				}
+			}
+			if (!removed) run /= 2;
+		}
+	}
+
+	//----------------------------------------------
+	// Reporting
+	//----------------------------------------------
+	void PrintProgram(List<GeneratedInstruction>& program) {
+		for (int i = 0; i < program.Size(); i++) {
+			// Jumps show the index of their target, like the simulator's listing
+			InstructionGeneric instruction = program[i].instruction;
+			if (instruction.type == InstructionType::JUMP) instruction.jump.instructionIndex = program[i].jumpTarget;
+			char text[128];
+			FormatInstruction(instruction, text, sizeof(text));
+			printf("%4i: %s\n", i, text);
+		}
+	}
+
+	void Report(Options const& options, int programIndex, int engineIndex) {
+		CPU reference;
+		CPU candidate;
+		reference.printErrors = false;
+		candidate.printErrors = false;
+		EngineInfo const& engine = engines[engineIndex];
+
+		Random random(options.seed, programIndex);
+		List<GeneratedInstruction> program;
+		Generate(random, options, program);
+		int originalSize = program.Size();
+		Shrink(program, engine.run, options, reference, candidate);
+
+		List<byte> image;
+		long long at = FindDivergence(program, image, engine.run, 1, options.instructionLimit, reference, candidate);
+
+		printf("%s differs from the reference on program %i of seed %u\n", engine.name, programIndex, options.seed);
+		printf("Shrunk from %i to %i instructions:\n", originalSize, program.Size());
+		PrintProgram(program);
+		printf("First difference after %lld instructions:\n", at);
+		PrintDifference(reference, candidate);
+
+		if (options.reproducerFilename && image.Size() > 0) {
+			FILE* file = fopen(options.reproducerFilename, "wb");
+			if (file == nullptr) {
+				printf("Error: Could not open %s for writing\n", options.reproducerFilename);
+				return;
+			}
+			fwrite(&image[0], 1, image.Size(), file);
+			fclose(file);
+			printf("Reproducer written to %s\n", options.reproducerFilename);
+		}
+	}
+
+	//----------------------------------------------
+	// Workers
+	// Each pool thread claims program indices until they run out or something diverges
+	//----------------------------------------------
+	struct Shared {
+		Options const* options;
+		std::atomic<int> nextProgram;
+		std::atomic<long long> programs;
+		std::atomic<long long> instructions;
+		std::atomic<int> failures;
+
+		// Lowest failing program, so the report doesn't depend on thread timing
+		std::mutex lock;
+		int failedProgram;
+		int failedEngine;
+	};
+
+	void FuzzWorker(void* userData) {
+		Shared& shared = *(Shared*)userData;
+		Options const& options = *shared.options;
+
+		CPU reference;
+		CPU candidate;
+		reference.printErrors = false;
+		candidate.printErrors = false;
+		List<GeneratedInstruction> program;
+		List<byte> image;
+
+		while (shared.failures.load() == 0) {
+			int index = shared.nextProgram.fetch_add(1);
+			if (index >= options.programCount) break;
+
+			Random random(options.seed, index);
+			Generate(random, options, program);
+
+			for (int e = 0; e < ENGINE_COUNT; e++) {
+				long long at = FindDivergence(program, image, engines[e].run, options.compareInterval, options.instructionLimit, reference, candidate);
+				shared.instructions += (long long)reference.instructionCount;
+				if (at < 0) continue;
+
+				shared.failures++;
+				std::lock_guard<std::mutex> guard(shared.lock);
+				if (shared.failedProgram < 0 || index < shared.failedProgram) {
+					shared.failedProgram = index;
+					shared.failedEngine = e;
+				}
+				break;
+			}
+			shared.programs++;
+		}
+	}
+
+	bool Run(Options const& options, Result& result) {
+		Shared shared;
+		shared.options = &options;
+		shared.nextProgram = 0;
+		shared.programs = 0;
+		shared.instructions = 0;
+		shared.failures = 0;
+		shared.failedProgram = -1;
+		shared.failedEngine = -1;
+
+		{
+			ThreadPool pool(options.threadCount);
+			for (int i = 0; i < pool.ThreadCount(); i++) {
+				pool.Submit(FuzzWorker, &shared);
+			}
+			pool.Wait();
+		}
+
+		result.programs = shared.programs;
+		result.instructions = shared.instructions;
+		result.failures = shared.failures;
+
+		if (shared.failedProgram >= 0) {
+			Report(options, shared.failedProgram, shared.failedEngine);
+		}
+		return result.failures == 0;
+	}
+}
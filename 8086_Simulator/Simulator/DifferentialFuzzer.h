@@ -0,0 +1,31 @@
+#pragma once
+#include "Types.h"
+
+//----------------------------------------------
+// DifferentialFuzzer
+// Runs random programs built from the supported instructions on CPU::StepReference and on each
+// fast execution path, and compares registers, flags and memory every few instructions.
+// Programs are spread over every core, a divergence is shrunk to the shortest program that still shows it
+//----------------------------------------------
+namespace DifferentialFuzzer {
+	struct Options {
+		int programCount = 10000;
+		int programLength = 64;        // Random instructions per program, after the register setup
+		int compareInterval = 16;      // Instructions run between comparisons
+		int instructionLimit = 4096;   // Per program, jumps are random and can loop for a long time
+		int threadCount = 0;           // 0 uses every hardware thread
+		unsigned int seed = 1;
+
+		// The shrunk program is written here so it can be run with --headless, nullptr skips it
+		const char* reproducerFilename = nullptr;
+	};
+
+	struct Result {
+		long long programs;
+		long long instructions;
+		int failures;
+	};
+
+	// Returns true if every engine matched the reference on every program
+	bool Run(Options const& options, Result& result);
+}
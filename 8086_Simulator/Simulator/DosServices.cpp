@@ -0,0 +1,45 @@
+#include "DosServices.h"
+#include <stdio.h>
+
+namespace Dos {
+	void PrintString(CPU& cpu, BufferedWriter& output) {
+		// Find the terminator first so the whole string goes out in one write
+		int start = cpu.dx;
+		int end = start;
+		while (end < CPU::MEMORY_SIZE && cpu.memory.Read((word)end) != '$') {
+			end++;
+		}
+
+		// Page by page, the string can cross into memory that isn't next to it on the host
+		while (start < end) {
+			int count = GuestMemory::PAGE_SIZE - (start & (GuestMemory::PAGE_SIZE - 1));
+			if (count > end - start) count = end - start;
+			int page = start >> GuestMemory::PAGE_SHIFT;
+			output.Write((const char*)&cpu.memory.PageData(page)[start & (GuestMemory::PAGE_SIZE - 1)], count);
+			start += count;
+		}
+	}
+
+	void Int21(CPU& cpu, byte, void* userData) {
+		BufferedWriter& output = *(BufferedWriter*)userData;
+		switch (cpu.ah) {
+		case 0x02:
+			output.WriteChar((char)cpu.dl);
+			break;
+		case 0x09:
+			PrintString(cpu, output);
+			break;
+		case 0x4C:
+			output.Flush();
+			cpu.Terminate(cpu.al);
+			break;
+		default:
+			printf("Unhandled int 21h function 0x%02x\n", cpu.ah);
+			break;
+		}
+	}
+
+	void Install(CPU& cpu, BufferedWriter& output) {
+		cpu.SetInterruptHandler(0x21, Int21, &output);
+	}
+}
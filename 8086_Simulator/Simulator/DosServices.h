@@ -0,0 +1,14 @@
+#pragma once
+#include "Executor.h"
+#include "BufferedWriter.h"
+
+//----------------------------------------------
+// DOS services
+// A small subset of int 21h so guests can print results and exit:
+//   AH=02h  print the character in DL
+//   AH=09h  print the '$' terminated string at DS:DX
+//   AH=4Ch  terminate with the exit code in AL
+//----------------------------------------------
+namespace Dos {
+	void Install(CPU& cpu, BufferedWriter& output);
+}
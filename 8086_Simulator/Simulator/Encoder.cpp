@@ -0,0 +1,262 @@
+#include "Encoder.h"
+
+namespace Encoder {
+	//----------------------------------------------
+	// Field helpers
+	//----------------------------------------------
+	bool FitsInByte(word value) {
+		short wide = (short)value;
+		return wide >= -128 && wide <= 127;
+	}
+
+	void WriteWord(byte* out, word value) {
+		out[0] = (byte)(value & 0xff);
+		out[1] = (byte)(value >> 8);
+	}
+
+	int WriteImmediate(byte* out, word value, bool isWide) {
+		if (isWide) {
+			WriteWord(out, value);
+			return 2;
+		}
+		out[0] = (byte)value;
+		return 1;
+	}
+
+	// The 3-bit register field, only for general registers of the instruction's width
+	bool RegisterCode(Register reg, bool isWide, byte& code) {
+		int index = (int)reg;
+		if (index < (int)Register::AL || index > (int)Register::DI) return false;
+		if ((index >= (int)Register::AX) != isWide) return false;
+		code = (byte)(index & 0b111);
+		return true;
+	}
+
+	bool IsSegmentRegister(Operand const& o) {
+		return o.type == Operand::Type::REGISTER && o.reg >= Register::CS && o.reg <= Register::ES;
+	}
+
+	// Reverse of the decoder's SRToSegmentRegister
+	byte SegmentCode(Register reg) {
+		switch (reg) {
+		case Register::ES: return 0b00;
+		case Register::CS: return 0b01;
+		case Register::SS: return 0b10;
+		case Register::DS: return 0b11;
+		default: return 0;
+		}
+	}
+
+	bool IsAccumulator(Operand const& o, bool isWide) {
+		return o.type == Operand::Type::REGISTER && o.reg == (isWide ? Register::AX : Register::AL);
+	}
+
+	bool IsDirectAddress(Operand const& o) {
+		return o.type == Operand::Type::MEMORY_LOC && o.mem.effectiveAddress == EffectiveAddress::DIRECT_ADDRESS;
+	}
+
+	//----------------------------------------------
+	// mod/reg/rm
+	// Writes the mod/reg/rm byte for "regMem" followed by its displacement, returns the bytes written or 0
+	//----------------------------------------------
+	int EncodeRegMem(Operand const& regMem, bool isWide, byte reg, byte* out) {
+		if (regMem.type == Operand::Type::REGISTER) {
+			byte rm;
+			if (!RegisterCode(regMem.reg, isWide, rm)) return 0;
+			out[0] = (byte)(0b11000000 | (reg << 3) | rm);
+			return 1;
+		}
+		if (regMem.type != Operand::Type::MEMORY_LOC) return 0;
+
+		EffectiveAddress address = regMem.mem.effectiveAddress;
+		word offset = regMem.mem.memoryOffset;
+		if (address == EffectiveAddress::DIRECT_ADDRESS) {
+			out[0] = (byte)((reg << 3) | 0b110);
+			WriteWord(&out[1], offset);
+			return 3;
+		}
+		if (address < EffectiveAddress::BX_SI || address > EffectiveAddress::BX) return 0;
+
+		byte rm = (byte)address;
+		// mod 00 with rm 110 is the direct address, so [bp] always carries a displacement
+		if (offset == 0 && address != EffectiveAddress::BP) {
+			out[0] = (byte)((reg << 3) | rm);
+			return 1;
+		}
+		if (FitsInByte(offset)) {
+			out[0] = (byte)(0b01000000 | (reg << 3) | rm);
+			out[1] = (byte)offset;
+			return 2;
+		}
+		out[0] = (byte)(0b10000000 | (reg << 3) | rm);
+		WriteWord(&out[1], offset);
+		return 3;
+	}
+
+	//----------------------------------------------
+	// Register/memory to/from register
+	// MOV 100010dw, ADD 000000dw, SUB 001010dw, CMP 001110dw
+	//----------------------------------------------
+	int EncodeToFromRegMem(byte opcode, Operand const& dest, Operand const& source, bool isWide, byte* out) {
+		// Like nasm, register to register uses d = 0
+		bool destIsReg = source.type != Operand::Type::REGISTER;
+		Operand const& reg = destIsReg ? dest : source;
+		Operand const& regMem = destIsReg ? source : dest;
+		if (reg.type != Operand::Type::REGISTER) return 0;
+
+		byte regCode;
+		if (!RegisterCode(reg.reg, isWide, regCode)) return 0;
+
+		out[0] = (byte)(opcode | (destIsReg ? 0b10 : 0) | (isWide ? 1 : 0));
+		int length = EncodeRegMem(regMem, isWide, regCode, &out[1]);
+		return length ? 1 + length : 0;
+	}
+
+	//----------------------------------------------
+	// Immediate to register/memory
+	// 100000sw with the operation in the reg field, or the short accumulator form
+	//----------------------------------------------
+	int EncodeImmediateArithmetic(byte reg, byte accumulatorOpcode, Operand const& dest, Operand const& source, bool isWide, byte* out) {
+		if (source.type != Operand::Type::IMMEDIATE) return 0;
+		word immediate = source.immediate;
+
+		// A sign extended byte is the shortest wide form, for the accumulator too
+		bool signExtend = isWide && FitsInByte(immediate);
+		if (!signExtend && IsAccumulator(dest, isWide)) {
+			out[0] = (byte)(accumulatorOpcode | (isWide ? 1 : 0));
+			return 1 + WriteImmediate(&out[1], immediate, isWide);
+		}
+
+		out[0] = (byte)(0b10000000 | (signExtend ? 0b10 : 0) | (isWide ? 1 : 0));
+		int length = EncodeRegMem(dest, isWide, reg, &out[1]);
+		if (length == 0) return 0;
+		return 1 + length + WriteImmediate(&out[1 + length], immediate, isWide && !signExtend);
+	}
+
+	//----------------------------------------------
+	// MOVE
+	//----------------------------------------------
+	int EncodeMove(InstructionMove const& move, bool isWide, byte* out) {
+		Operand const& dest = move.dest;
+		Operand const& source = move.source;
+
+		// Segment registers, always wide
+		if (IsSegmentRegister(dest)) {
+			out[0] = 0b10001110;
+			int length = EncodeRegMem(source, true, SegmentCode(dest.reg), &out[1]);
+			return length ? 1 + length : 0;
+		}
+		if (IsSegmentRegister(source)) {
+			out[0] = 0b10001100;
+			int length = EncodeRegMem(dest, true, SegmentCode(source.reg), &out[1]);
+			return length ? 1 + length : 0;
+		}
+
+		if (source.type == Operand::Type::IMMEDIATE) {
+			// The register form doesn't mark the immediate's size, the reg/mem one does
+			if (dest.type == Operand::Type::REGISTER && source.dataSize == ExplicitDataSize::NONE) {
+				byte reg;
+				if (!RegisterCode(dest.reg, isWide, reg)) return 0;
+				out[0] = (byte)(0b10110000 | (isWide ? 0b1000 : 0) | reg);
+				return 1 + WriteImmediate(&out[1], source.immediate, isWide);
+			}
+			out[0] = (byte)(0b11000110 | (isWide ? 1 : 0));
+			int length = EncodeRegMem(dest, isWide, 0, &out[1]);
+			if (length == 0) return 0;
+			return 1 + length + WriteImmediate(&out[1 + length], source.immediate, isWide);
+		}
+
+		// Accumulator to/from a direct address has its own one byte shorter form
+		if (IsAccumulator(dest, isWide) && IsDirectAddress(source)) {
+			out[0] = (byte)(0b10100000 | (isWide ? 1 : 0));
+			WriteWord(&out[1], source.mem.memoryOffset);
+			return 3;
+		}
+		if (IsDirectAddress(dest) && IsAccumulator(source, isWide)) {
+			out[0] = (byte)(0b10100010 | (isWide ? 1 : 0));
+			WriteWord(&out[1], dest.mem.memoryOffset);
+			return 3;
+		}
+
+		return EncodeToFromRegMem(0b10001000, dest, source, isWide, out);
+	}
+
+	//----------------------------------------------
+	// ADD, SUB, CMP
+	//----------------------------------------------
+	int EncodeArithmetic(byte opcode, byte reg, byte accumulatorOpcode, Operand const& dest, Operand const& source, bool isWide, byte* out) {
+		if (source.type == Operand::Type::IMMEDIATE) {
+			return EncodeImmediateArithmetic(reg, accumulatorOpcode, dest, source, isWide, out);
+		}
+		return EncodeToFromRegMem(opcode, dest, source, isWide, out);
+	}
+
+	//----------------------------------------------
+	// JUMP
+	// The condition is the opcode, only the unconditional jump has a 16-bit offset
+	//----------------------------------------------
+	int EncodeJump(InstructionJump const& jump, byte* out) {
+		out[0] = (byte)jump.condition;
+		if (jump.condition == InstructionJump::JumpAlways) {
+			if (jump.byteOffset < -32768 || jump.byteOffset > 32767) return 0;
+			WriteWord(&out[1], (word)jump.byteOffset);
+			return 3;
+		}
+		if (jump.byteOffset < -128 || jump.byteOffset > 127) return 0;
+		out[1] = (byte)jump.byteOffset;
+		return 2;
+	}
+
+	//----------------------------------------------
+	// Single instruction
+	//----------------------------------------------
+	int EncodeInstruction(InstructionGeneric const& instruction, byte* out) {
+		bool isWide = instruction.isWide;
+		switch (instruction.type) {
+		case InstructionType::MOVE:
+			return EncodeMove(instruction.move, isWide, out);
+		case InstructionType::ADD:
+			return EncodeArithmetic(0b00000000, 0b000, 0b00000100, instruction.add.dest, instruction.add.source, isWide, out);
+		case InstructionType::SUB:
+			return EncodeArithmetic(0b00101000, 0b101, 0b00101100, instruction.sub.dest, instruction.sub.source, isWide, out);
+		case InstructionType::COMPARE:
+			return EncodeArithmetic(0b00111000, 0b111, 0b00111100, instruction.compare.dest, instruction.compare.source, isWide, out);
+		case InstructionType::JUMP:
+			return EncodeJump(instruction.jump, out);
+		case InstructionType::INTERRUPT:
+			out[0] = 0b11001101;
+			out[1] = instruction.interrupt.interruptNumber;
+			return 2;
+		default:
+			return 0;
+		}
+	}
+
+	//----------------------------------------------
+	// Comparison
+	//----------------------------------------------
+	bool SameOperand(Operand const& a, Operand const& b) {
+		if (a.type != b.type || a.dataSize != b.dataSize) return false;
+		switch (a.type) {
+		case Operand::Type::REGISTER: return a.reg == b.reg;
+		case Operand::Type::MEMORY_LOC: return a.mem.effectiveAddress == b.mem.effectiveAddress && a.mem.memoryOffset == b.mem.memoryOffset;
+		case Operand::Type::IMMEDIATE: return a.immediate == b.immediate;
+		case Operand::Type::NONE: return true;
+		default: return false;
+		}
+	}
+
+	bool SameInstruction(InstructionGeneric const& a, InstructionGeneric const& b) {
+		if (a.type != b.type || a.address != b.address || a.isWide != b.isWide) return false;
+		switch (a.type) {
+		case InstructionType::MOVE: return SameOperand(a.move.dest, b.move.dest) && SameOperand(a.move.source, b.move.source);
+		case InstructionType::ADD: return SameOperand(a.add.dest, b.add.dest) && SameOperand(a.add.source, b.add.source);
+		case InstructionType::SUB: return SameOperand(a.sub.dest, b.sub.dest) && SameOperand(a.sub.source, b.sub.source);
+		case InstructionType::COMPARE: return SameOperand(a.compare.dest, b.compare.dest) && SameOperand(a.compare.source, b.compare.source);
+		case InstructionType::JUMP: return a.jump.condition == b.jump.condition && a.jump.byteOffset == b.jump.byteOffset;
+		case InstructionType::INTERRUPT: return a.interrupt.interruptNumber == b.interrupt.interruptNumber;
+		case InstructionType::NONE: return true;
+		default: return false;
+		}
+	}
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include "Types.h"
+
+//----------------------------------------------
+// Encoder
+// The decoder in reverse, turns an InstructionGeneric back into machine code
+//----------------------------------------------
+namespace Encoder {
+	// Longest encoding the decoder accepts: opcode, mod/reg/rm, 16-bit displacement and 16-bit immediate
+	const int MAX_INSTRUCTION_SIZE = 6;
+
+	// Writes the instruction to "out" (at least MAX_INSTRUCTION_SIZE bytes) and returns its length,
+	// or 0 if it has no encoding the decoder accepts (mismatched register widths, a jump out of range...).
+	// Width comes from isWide. Where several encodings decode to the same instruction the shortest is picked,
+	// so decoding the result gives back the instruction, only "size" can differ
+	int EncodeInstruction(InstructionGeneric const& instruction, byte* out);
+
+	// True if both decode from equivalent encodings, everything but the size and the string has to match
+	bool SameInstruction(InstructionGeneric const& a, InstructionGeneric const& b);
+}
@@ -1,26 +1,149 @@
 #include "Executor.h"
 #include <stdio.h>
+#include <string.h>
+#include <chrono>
 #include "StringifyTypes.h"
+#include "Decoder.h"
 
 CPU::CPU()
 	: ax(0), cx(0), dx(0), bx(0), sp(0), bp(0), si(0), di(0), cs(0), ds(0), ss(0), es(0), ip(0), flags(0),
-	loadedInstructions(), memory(nullptr), halted(false)
+	halted(false), programEnd(0), exitReason(ExitReason::NONE), exitCode(0), printErrors(true),
+	limits{ 0, 0, 0 }, memoryWriteCount(0), runMicroseconds(0), instructionCount(0), program(nullptr), baseline(nullptr)
 {
-	this->memory = new byte[0xffff];
+	for (int i = 0; i < 256; ++i) {
+		interruptTable[i] = { nullptr, nullptr };
+	}
+}
 
-	// Initialize memory to 0
-	for (int i = 0; i < 0xffff; ++i) {
-		memory[i] = 0;
+const char* CPU::ExitReasonName(ExitReason reason) {
+	switch (reason) {
+	case ExitReason::NONE: return "none";
+	case ExitReason::END_OF_PROGRAM: return "end_of_program";
+	case ExitReason::TERMINATED: return "terminated";
+	case ExitReason::INVALID_INSTRUCTION: return "invalid_instruction";
+	case ExitReason::INSTRUCTION_LIMIT: return "instruction_limit";
+	case ExitReason::TIME_LIMIT: return "time_limit";
+	case ExitReason::WRITE_LIMIT: return "write_limit";
 	}
+	return "unknown";
 }
 
 void CPU::Reset() {
 	ax = 0, cx = 0, dx = 0, bx = 0, sp = 0, bp = 0, si = 0, di = 0, cs = 0, ds = 0, ss = 0, es = 0, ip = 0, flags = 0;
 	halted = false;
-	loadedInstructions = List<InstructionGeneric>();
-	for (int i = 0; i < 0xffff; ++i) {
-		memory[i] = 0;
+	exitReason = ExitReason::NONE;
+	exitCode = 0;
+	instructionCount = 0;
+	memoryWriteCount = 0;
+	runMicroseconds = 0;
+	programEnd = 0;
+	scheduler.Restart();
+	instructionCache.Clear();
+	memory.Clear();
+	if (program) {
+		program->Release();
+		program = nullptr;
+	}
+}
+
+void CPU::LoadProgram(Buffer const& image) {
+	Program* loaded = Program::Create(image);
+	LoadProgram(loaded);
+	loaded->Release();
+}
+
+void CPU::LoadProgram(Program* program) {
+	program->Retain();
+	if (this->program) this->program->Release();
+	this->program = program;
+
+	int loadAddress = LOAD_SEGMENT << 4;
+	int size = program->image.size;
+	if (loadAddress + size > MEMORY_SIZE) {
+		printf("Program is %i bytes, only the first %i fit in memory\n", size, MEMORY_SIZE - loadAddress);
+		size = MEMORY_SIZE - loadAddress;
+	}
+
+	memory.Write((word)loadAddress, program->image.data, size);
+	instructionCache.Clear();
+	for (int i = 0; i < InstructionCache::PAGE_COUNT; ++i) {
+		programPageDirty[i] = false;
 	}
+
+	cs = LOAD_SEGMENT;
+	ip = 0;
+	programEnd = size;
+	halted = (size == 0);
+}
+
+CPU* CPU::Fork() {
+	CPU* child = new CPU();
+	ForkInto(*child);
+	return child;
+}
+
+void CPU::ForkInto(CPU& child) {
+	if (&child == this) return;
+	if (program) program->Retain();
+	if (child.program) child.program->Release();
+	child.program = program;
+	memcpy(child.programPageDirty, programPageDirty, sizeof(programPageDirty));
+
+	child.memory.Share(memory);
+	// The child decodes its own, the cache is only a cache
+	child.instructionCache.Clear();
+	child.scheduler.CopyFrom(scheduler);
+	memcpy(child.interruptTable, interruptTable, sizeof(interruptTable));
+	child.limits = limits;
+
+	CopyRegisters(child);
+}
+
+void CPU::CopyRegisters(CPU& to) const {
+	to.ax = ax, to.cx = cx, to.dx = dx, to.bx = bx;
+	to.sp = sp, to.bp = bp, to.si = si, to.di = di;
+	to.cs = cs, to.ds = ds, to.ss = ss, to.es = es;
+	to.ip = ip, to.flags = flags;
+	to.halted = halted, to.programEnd = programEnd, to.exitReason = exitReason, to.exitCode = exitCode;
+	to.printErrors = printErrors;
+	to.instructionCount = instructionCount;
+	to.memoryWriteCount = memoryWriteCount;
+	to.runMicroseconds = runMicroseconds;
+}
+
+void CPU::SaveBaseline() {
+	if (baseline == nullptr) baseline = new CPU();
+	ForkInto(*baseline);
+	memory.MarkClean();
+}
+
+void CPU::ResetToBaseline() {
+	if (baseline == nullptr) {
+		Reset();
+		return;
+	}
+
+	// Same rule as OnWrite, an instruction at the end of the previous page can read into a written one
+	static_assert(GuestMemory::PAGE_SIZE == InstructionCache::PAGE_SIZE, "dirty memory pages are instruction cache pages");
+	if (memory.AllDirty()) {
+		instructionCache.Clear();
+	}
+	else {
+		for (int i = 0; i < memory.DirtyCount(); i++) {
+			int page = memory.DirtyPage(i);
+			instructionCache.InvalidatePage(page);
+			if (page > 0) instructionCache.InvalidatePage(page - 1);
+		}
+	}
+	memory.RestoreDirty(baseline->memory);
+
+	if (baseline->program) baseline->program->Retain();
+	if (program) program->Release();
+	program = baseline->program;
+	memcpy(programPageDirty, baseline->programPageDirty, sizeof(programPageDirty));
+	scheduler.CopyFrom(baseline->scheduler);
+	memcpy(interruptTable, baseline->interruptTable, sizeof(interruptTable));
+	baseline->CopyRegisters(*this);
 }
 
 void CPU::SetRegister(Register reg, word value) {
@@ -79,15 +202,62 @@ word CPU::GetRegister(Register reg) {
 }
 
 void CPU::SetMemory(EffectiveAddress addr, word offset, byte value) {
-	int effectiveAddress = GetEffectiveAddress(addr);
-	byte oldValue = memory[effectiveAddress + offset];
-	memory[effectiveAddress + offset] = value;
+	word address = GetEffectiveAddress(addr) + offset;
+	memory.Write(address, value);
+	OnWrite(address);
 }
 
 void CPU::SetMemoryWide(EffectiveAddress addr, word offset, word value) {
-	int effectiveAddress = GetEffectiveAddress(addr);
-	memory[effectiveAddress + offset] = (byte)(value >> 8);
-	memory[effectiveAddress + offset + 1] = (byte)value;
+	// Little endian, low byte first
+	word address = GetEffectiveAddress(addr) + offset;
+	word high = address + 1;
+	memory.WriteWide(address, value);
+	OnWrite(address);
+	OnWrite(high);
+}
+
+void CPU::WriteMemory(word address, byte const* data, int size) {
+	memory.Write(address, data, size);
+
+	// The first byte and the start of every later page, that covers every page the write touched
+	if (size > 0) OnWrite(address);
+	for (int offset = GuestMemory::PAGE_SIZE - (address & (GuestMemory::PAGE_SIZE - 1)); offset < size; offset += GuestMemory::PAGE_SIZE) {
+		OnWrite((word)(address + offset));
+	}
+}
+
+byte* CPU::WritablePage(int page) {
+	OnWrite((word)(page << GuestMemory::PAGE_SHIFT));
+	return memory.WritablePage(page);
+}
+
+void CPU::OnWrite(word address) {
+	instructionCache.OnWrite(address);
+	if (program == nullptr) return;
+
+	// Same rule as the cache, a write can also change an instruction that starts at the end of the previous page
+	int offset = address - (LOAD_SEGMENT << 4);
+	if (offset < 0 || offset >= program->image.size) return;
+
+	int page = offset >> InstructionCache::PAGE_SHIFT;
+	programPageDirty[page] = true;
+	if ((offset & (InstructionCache::PAGE_SIZE - 1)) < InstructionCache::MAX_INSTRUCTION_SIZE && page > 0) {
+		programPageDirty[page - 1] = true;
+	}
+}
+
+InstructionGeneric const* CPU::ProgramInstruction(word address) {
+	if (program == nullptr) return nullptr;
+
+	int offset = address - (LOAD_SEGMENT << 4);
+	if (offset < 0 || offset >= program->image.size || programPageDirty[offset >> InstructionCache::PAGE_SHIFT]) {
+		return nullptr;
+	}
+	// A program cut off at the top of memory wraps around to address 0 there, which the Program never saw
+	if (programEnd < program->image.size && offset > programEnd - InstructionCache::MAX_INSTRUCTION_SIZE) {
+		return nullptr;
+	}
+	return program->InstructionAt(offset);
 }
 
 int CPU::GetEffectiveAddress(EffectiveAddress addr) {
@@ -105,31 +275,37 @@ int CPU::GetEffectiveAddress(EffectiveAddress addr) {
 }
 
 byte CPU::GetMemory(EffectiveAddress addr, word offset) {
-	// calculate effective address
-	int effectiveAddress = GetEffectiveAddress(addr);
-	return memory[effectiveAddress + offset];
+	// calculate effective address, wrapping within the 64k segment
+	word address = GetEffectiveAddress(addr) + offset;
+	return memory.Read(address);
 }
 
 word CPU::GetMemoryWide(EffectiveAddress addr, word offset) {
-	int effectiveAddress = GetEffectiveAddress(addr);
-	return memory[effectiveAddress + offset] << 8 | memory[effectiveAddress + offset + 1];
+	word address = GetEffectiveAddress(addr) + offset;
+	return memory.ReadWide(address);
 }
 
-word CPU::GetData(Operand const& op) {
+word CPU::GetData(Operand const& op, bool isWide) {
 	switch (op.type) {
 	case Operand::Type::IMMEDIATE:
 		return op.immediate;
 	case Operand::Type::MEMORY_LOC:
+		if (isWide) return GetMemoryWide(op.mem.effectiveAddress, (word)op.mem.memoryOffset);
 		return GetMemory(op.mem.effectiveAddress, (word)op.mem.memoryOffset);
 	case Operand::Type::REGISTER:
 		return GetRegister(op.reg);
+	default:
+		printf("Cannot get data for an empty operand\n");
+		return 0;
 	}
 }
 
-void CPU::SetData(Operand const& op, word value) {
+void CPU::SetData(Operand const& op, word value, bool isWide) {
 	switch (op.type) {
 	case Operand::Type::MEMORY_LOC:
-		SetMemory(op.mem.effectiveAddress, (word)op.mem.memoryOffset, (byte)value);
+		memoryWriteCount++;
+		if (isWide) SetMemoryWide(op.mem.effectiveAddress, (word)op.mem.memoryOffset, value);
+		else SetMemory(op.mem.effectiveAddress, (word)op.mem.memoryOffset, (byte)value);
 		break;
 	case Operand::Type::REGISTER:
 		SetRegister(op.reg, (word)value);
@@ -140,7 +316,8 @@ void CPU::SetData(Operand const& op, word value) {
 }
 
 CPU::~CPU() {
-	delete[] memory;
+	delete baseline;
+	if (program) program->Release();
 }
 
 void CPU::PrintFlags() {
@@ -207,6 +384,30 @@ bool CheckOverflowNegative(signed short a, signed short b) {
 	return (sum > maxWord || sum < minWord);
 }
 
+word CPU::AddFlags(word source, word dest) {
+	word result = dest + source;
+	word flags = 0;
+	flags |= (result == 0) ? Flags::ZERO : 0;
+	flags |= (result & 0x8000) ? Flags::SIGN : 0;
+	flags |= CheckParity(result) ? Flags::PARITY : 0;
+	flags |= CheckCarry(source, dest) ? Flags::CARRY : 0;
+	flags |= CheckOverflow(source, dest) ? Flags::OVERFLOW : 0;
+	flags |= CheckAuxillery(source, dest) ? Flags::AUX_CARRY : 0;
+	return flags;
+}
+
+word CPU::SubtractFlags(word source, word dest) {
+	word result = dest - source;
+	word flags = 0;
+	flags |= (result == 0) ? Flags::ZERO : 0;
+	flags |= (result & 0x8000) ? Flags::SIGN : 0;
+	flags |= CheckParity(result) ? Flags::PARITY : 0;
+	flags |= CheckCarryNegative(source, dest) ? Flags::CARRY : 0;
+	flags |= CheckOverflowNegative(source, dest) ? Flags::OVERFLOW : 0;
+	flags |= CheckAuxilleryNegative(source, dest) ? Flags::AUX_CARRY : 0;
+	return flags;
+}
+
 bool CPU::ShouldJump(InstructionJump::Condition condition) {
 	switch (condition) {
 	case InstructionJump::Condition::JumpAlways: return true;
@@ -243,78 +444,168 @@ bool CPU::ShouldJump(InstructionJump::Condition condition) {
 	return false;
 }
 
+void CPU::SetInterruptHandler(byte interruptNumber, InterruptHandler handler, void* userData) {
+	interruptTable[interruptNumber] = { handler, userData };
+}
+
+void CPU::Interrupt(byte interruptNumber) {
+	InterruptVector& vector = interruptTable[interruptNumber];
+	if (vector.handler) {
+		vector.handler(*this, interruptNumber, vector.userData);
+	}
+}
+
+void CPU::Terminate(byte code) {
+	halted = true;
+	exitReason = ExitReason::TERMINATED;
+	exitCode = code;
+}
+
+static qword NowMicroseconds() {
+	using namespace std::chrono;
+	return (qword)duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void CPU::Run(qword instructions) {
+	qword end = instructionCount + instructions;
+	bool limited = limits.instructions != 0 || limits.microseconds != 0 || limits.memoryWrites != 0;
+	qword started = (limits.microseconds != 0) ? NowMicroseconds() : 0;
+	qword spentBefore = runMicroseconds;
+	if (limited) CheckLimits();
+
+	while (!halted && instructionCount < end) {
+		// Nothing can fire before the next deadline, so step straight up to it without checking
+		qword stop = scheduler.NextDeadline();
+		if (stop > end) stop = end;
+		if (limited) stop = LimitBatch(stop);
+
+		while (!halted && instructionCount < stop) {
+			Step();
+		}
+
+		scheduler.RunExpired(*this, instructionCount);
+		if (limited) {
+			if (limits.microseconds != 0) runMicroseconds = spentBefore + (NowMicroseconds() - started);
+			CheckLimits();
+		}
+	}
+}
+
+qword CPU::LimitBatch(qword stop) {
+	// An event that's already due leaves nothing to run, and the counts below would wrap
+	if (stop <= instructionCount) return stop;
+	if (limits.instructions != 0 && stop > limits.instructions) stop = limits.instructions;
+	// An instruction writes memory at most once, so the remaining writes can't run out before this
+	if (limits.memoryWrites != 0 && stop - instructionCount > limits.memoryWrites - memoryWriteCount) {
+		stop = instructionCount + (limits.memoryWrites - memoryWriteCount);
+	}
+	if (limits.microseconds != 0 && stop - instructionCount > TIME_CHECK_INTERVAL) {
+		stop = instructionCount + TIME_CHECK_INTERVAL;
+	}
+	return stop;
+}
+
+void CPU::CheckLimits() {
+	if (halted) return;
+	if (limits.instructions != 0 && instructionCount >= limits.instructions) exitReason = ExitReason::INSTRUCTION_LIMIT;
+	else if (limits.memoryWrites != 0 && memoryWriteCount >= limits.memoryWrites) exitReason = ExitReason::WRITE_LIMIT;
+	else if (limits.microseconds != 0 && runMicroseconds >= limits.microseconds) exitReason = ExitReason::TIME_LIMIT;
+	else return;
+	halted = true;
+}
+
 void CPU::Step() {
 	if (halted) return;
+	instructionCount++;
+
+	word address = (cs << 4) + ip;
+	InstructionGeneric const* cached = ProgramInstruction(address);
+	if (cached == nullptr) cached = instructionCache.Lookup(address);
+	if (cached == nullptr) {
+		InstructionGeneric decoded;
+		byte scratch[InstructionCache::MAX_INSTRUCTION_SIZE];
+		byte const* code = memory.Contiguous(address, InstructionCache::MAX_INSTRUCTION_SIZE, scratch);
+		if (Decoder::DecodeInstruction(code, ip, decoded) == 0) {
+			if (printErrors) printf("Unhandled opcode 0x%x at %04x:%04x\n", code[0], cs, ip);
+			halted = true;
+			exitReason = ExitReason::INVALID_INSTRUCTION;
+			return;
+		}
+		cached = instructionCache.Insert(address, decoded);
+	}
+
+	Execute(*cached);
+}
+
+void CPU::StepReference() {
+	if (halted) return;
+	instructionCount++;
 
-	InstructionGeneric& instruction = loadedInstructions[ip];
+	word address = (cs << 4) + ip;
+	InstructionGeneric decoded;
+	byte scratch[InstructionCache::MAX_INSTRUCTION_SIZE];
+	byte const* code = memory.Contiguous(address, InstructionCache::MAX_INSTRUCTION_SIZE, scratch);
+	if (Decoder::DecodeInstruction(code, ip, decoded) == 0) {
+		if (printErrors) printf("Unhandled opcode 0x%x at %04x:%04x\n", code[0], cs, ip);
+		halted = true;
+		exitReason = ExitReason::INVALID_INSTRUCTION;
+		return;
+	}
+
+	Execute(decoded);
+}
+
+void CPU::Execute(InstructionGeneric const& instruction) {
+	// A write to memory can invalidate a cached instruction, so everything
+	// needed after the write is read out up front
+	bool isWide = instruction.isWide;
+	word nextIp = ip + instruction.size;
 
-	// TODO: Implement
 	switch (instruction.type) {
 	case InstructionType::MOVE: {
-		int dat = GetData(instruction.move.source);
-		SetData(instruction.move.dest, dat);
+		int dat = GetData(instruction.move.source, isWide);
+		SetData(instruction.move.dest, dat, isWide);
 		break;
 	}
 	case InstructionType::ADD: {
-		word sourceData = GetData(instruction.add.source);
-		word destData = GetData(instruction.add.dest);
+		word sourceData = GetData(instruction.add.source, isWide);
+		word destData = GetData(instruction.add.dest, isWide);
 		word finalData = destData + sourceData;
-		SetData(instruction.add.dest, finalData);
-		word flags = 0;
-		flags |= (finalData == 0) ? Flags::ZERO : 0;
-		flags |= (finalData & 0x8000) ? Flags::SIGN : 0;
-		flags |= CheckParity(finalData) ? Flags::PARITY : 0;
-		flags |= CheckCarry(sourceData, destData) ? Flags::CARRY : 0;
-		flags |= CheckOverflow(sourceData, destData) ? Flags::OVERFLOW : 0;
-		flags |= CheckAuxillery(sourceData, destData) ? Flags::AUX_CARRY : 0;
-		SetFlags(flags);
+		SetData(instruction.add.dest, finalData, isWide);
+		SetFlags(AddFlags(sourceData, destData));
 		break;
 	}
 	case InstructionType::SUB: {
-		word sourceData = GetData(instruction.add.source);
-		word destData = GetData(instruction.add.dest);
+		word sourceData = GetData(instruction.add.source, isWide);
+		word destData = GetData(instruction.add.dest, isWide);
 		word finalData = destData - sourceData;
-		SetData(instruction.add.dest, finalData);
-		word flags = 0;
-		flags |= (finalData == 0) ? Flags::ZERO : 0;
-		flags |= (finalData & 0x8000) ? Flags::SIGN : 0;
-		flags |= CheckParity(finalData) ? Flags::PARITY : 0;
-		flags |= CheckCarryNegative(sourceData, destData) ? Flags::CARRY : 0;
-		flags |= CheckOverflowNegative(sourceData, destData) ? Flags::OVERFLOW : 0;
-		flags |= CheckAuxilleryNegative(sourceData, destData) ? Flags::AUX_CARRY : 0;
-		SetFlags(flags);
+		SetData(instruction.add.dest, finalData, isWide);
+		SetFlags(SubtractFlags(sourceData, destData));
 		break;
 	}
 	case InstructionType::COMPARE: {
-		word sourceData = GetData(instruction.add.source);
-		word destData = GetData(instruction.add.dest);
-		word finalData = destData - sourceData;
-		word flags = 0;
-		flags |= (finalData == 0) ? Flags::ZERO : 0;
-		flags |= (finalData & 0x8000) ? Flags::SIGN : 0;
-		flags |= CheckParity(finalData) ? Flags::PARITY : 0;
-		flags |= CheckCarryNegative(sourceData, destData) ? Flags::CARRY : 0;
-		flags |= CheckOverflowNegative(sourceData, destData) ? Flags::OVERFLOW : 0;
-		flags |= CheckAuxilleryNegative(sourceData, destData) ? Flags::AUX_CARRY : 0;
-		SetFlags(flags);
+		word sourceData = GetData(instruction.add.source, isWide);
+		word destData = GetData(instruction.add.dest, isWide);
+		SetFlags(SubtractFlags(sourceData, destData));
 		break;
 	}
 	case InstructionType::JUMP: {
-		// If the condition is met, we set the instruction pointer to the address
+		// Jump offsets are relative to the next instruction
 		if (ShouldJump(instruction.jump.condition)) {
-			ip = instruction.jump.instructionIndex;
-			return;
+			nextIp += instruction.jump.byteOffset;
 		}
 		break;
 	}
 	case InstructionType::INTERRUPT: {
+		Interrupt(instruction.interrupt.interruptNumber);
 		break;
 	}
 	}
-	ip++;
+	ip = nextIp;
 
-	if (ip >= loadedInstructions.Size()) {
+	if (!halted && ip >= programEnd) {
 		halted = true;
+		exitReason = ExitReason::END_OF_PROGRAM;
 	}
 }
 
@@ -1,6 +1,15 @@
 #pragma once
 #include "Types.h"
 #include "List.h"
+#include "Scheduler.h"
+#include "InstructionCache.h"
+#include "Program.h"
+#include "GuestMemory.h"
+
+class CPU;
+
+// Host side of an interrupt, called when the guest executes "int n"
+typedef void (*InterruptHandler)(CPU& cpu, byte interruptNumber, void* userData);
 
 class CPU {
 public:
@@ -17,22 +26,81 @@ public:
 		TRAP = 256,
 	};
 
+	enum class ExitReason {
+		NONE,
+		END_OF_PROGRAM,
+		TERMINATED,
+		INVALID_INSTRUCTION,
+		INSTRUCTION_LIMIT,
+		TIME_LIMIT,
+		WRITE_LIMIT,
+	};
+
+	// Stops a guest that runs too long. Counted from the last Reset (LoadProgram keeps the counts), 0 is no limit. Run checks them
+	// between batches of instructions, ending each batch where the next limit could be reached, so an
+	// unlimited run pays nothing and a limited one reads the clock every TIME_CHECK_INTERVAL instructions
+	struct Limits {
+		qword instructions;
+		qword microseconds; // Time spent in Run
+		qword memoryWrites; // Writes by guest instructions, each one byte or word
+	};
+
+	// Also how far past its limit a timed run can go
+	static const qword TIME_CHECK_INTERVAL = 1 << 16;
+
+	static const int MEMORY_SIZE = 0x10000;
+
+	// Programs are loaded at LOAD_SEGMENT:0000, clear of the framebuffer at 0x00f0
+	static const word LOAD_SEGMENT = 0x0500;
+
 	CPU();
 	~CPU();
 
 	void Reset();
 
+	// "end_of_program", "instruction_limit" and so on
+	static const char* ExitReasonName(ExitReason reason);
+
 	void Step();
-	inline void LoadInstructions(List<InstructionGeneric>& instructions) { loadedInstructions = instructions; }
+	void Run(qword instructions);
+
+	// Same as Step, but decodes from memory every time without the Program or the instruction cache.
+	// Slow and simple, the reference the fast paths are checked against
+	void StepReference();
+	void LoadProgram(Buffer const& image);
+
+	// Runs a program that is already decoded. The CPU keeps a reference, so many CPUs can share one
+	void LoadProgram(Program* program);
+
+	// A new CPU in exactly this state that carries on independently, the caller deletes it. Memory is shared
+	// copy-on-write and the Program by reference, so a fork costs the page table plus a page per page either side writes
+	CPU* Fork();
+
+	// Same as Fork, into a CPU that already exists. Whatever "child" held is dropped
+	void ForkInto(CPU& child);
+
+	// Keeps the current state as the baseline for ResetToBaseline, memory shared copy-on-write like a fork
+	void SaveBaseline();
+
+	// Back to the state at SaveBaseline, or Reset if there isn't one. Only pages written since are put back,
+	// and the Program and whatever was decoded from the other pages are kept, so it costs what the run touched
+	void ResetToBaseline();
 	inline bool IsHalted() { return halted; }
 
 	// Data access
-	word GetData(Operand const& op);
-	void SetData(Operand const& op, word value);
+	word GetData(Operand const& op, bool isWide);
+	void SetData(Operand const& op, word value, bool isWide);
 
 	void SetRegister(Register reg, word value);
 	word GetRegister(Register reg);
 
+	// Host writes, decoded instructions over the written bytes are dropped like after a guest write
+	void WriteMemory(word address, byte const* data, int size);
+
+	// One page of memory to write in place, whatever was decoded from it is dropped up front.
+	// Valid until the memory is cleared, shared or restored
+	byte* WritablePage(int page);
+
 	void SetMemory(EffectiveAddress addr, word offset, byte value);
 	void SetMemoryWide(EffectiveAddress addr, word offset, word value);
 	byte GetMemory(EffectiveAddress addr, word offset);
@@ -45,9 +113,16 @@ public:
 	void SetFlags(word flags);
 	bool GetFlag(Flags f);
 
+	// Flags after "dest + source" and "dest - source", sub and cmp share the second
+	static word AddFlags(word source, word dest);
+	static word SubtractFlags(word source, word dest);
+
 	bool ShouldJump(InstructionJump::Condition condition);
 
-	List<InstructionGeneric> loadedInstructions;
+	// Interrupts
+	void SetInterruptHandler(byte interruptNumber, InterruptHandler handler, void* userData = nullptr);
+	void Interrupt(byte interruptNumber);
+	void Terminate(byte code);
 
 	// Stored in a union to let short and wide registers overlap
 	union {
@@ -62,7 +137,51 @@ public:
 	// Flags
 	word flags;
 
-	// Memory 
-	byte* memory;
+	// Memory, shared with forks until either side writes
+	GuestMemory memory;
 	bool halted;
+	int programEnd;
+	ExitReason exitReason;
+	int exitCode;
+
+	// Report invalid instructions on stdout, the exit reason is set either way
+	bool printErrors;
+
+	// Kept through Reset, the counts start over
+	Limits limits;
+	qword memoryWriteCount;
+	qword runMicroseconds;
+
+	// Host callbacks, indexed by interrupt number
+	struct InterruptVector {
+		InterruptHandler handler;
+		void* userData;
+	};
+	InterruptVector interruptTable[256];
+
+	// Timed events, deadlines are measured in executed instructions
+	qword instructionCount;
+	Scheduler scheduler;
+
+	// Instructions decoded from memory, invalidated when the guest writes to code
+	InstructionCache instructionCache;
+
+	// The loaded program's instructions are used directly until the guest writes to their page,
+	// after that the page is decoded from memory like any other code
+	Program* program;
+	bool programPageDirty[InstructionCache::PAGE_COUNT];
+
+	// State kept by SaveBaseline, nullptr until then
+	CPU* baseline;
+
+private:
+	CPU(const CPU&) = delete;
+	void operator=(const CPU&) = delete;
+
+	void CopyRegisters(CPU& to) const;
+	qword LimitBatch(qword stop);
+	void CheckLimits();
+	void OnWrite(word address);
+	void Execute(InstructionGeneric const& instruction);
+	InstructionGeneric const* ProgramInstruction(word address);
 };
\ No newline at end of file
@@ -0,0 +1,219 @@
+#include "GuestMemory.h"
+#include <string.h>
+#include <new>
+
+// A count of 2 so it never looks owned, Retain and Release leave it alone
+byte GuestMemory::zeroData[PAGE_SIZE];
+GuestMemory::Page GuestMemory::zeroPage = { { 2 }, zeroData, nullptr };
+
+GuestMemory::GuestMemory()
+	: dirtyCount(0), allDirty(true)
+{
+	for (int i = 0; i < PAGE_COUNT; i++) {
+		SetPage(i, &zeroPage);
+		owned[i] = nullptr;
+		pageDirty[i] = false;
+	}
+}
+
+GuestMemory::~GuestMemory() {
+	for (int i = 0; i < PAGE_COUNT; i++) {
+		Release(pages[i]);
+	}
+}
+
+GuestMemory::Page* GuestMemory::NewPage() {
+	byte* block = new byte[sizeof(Page) + PAGE_SIZE];
+	Page* page = new (block) Page;
+	page->refCount.store(1, std::memory_order_relaxed);
+	page->data = block + sizeof(Page);
+	page->mapping = nullptr;
+	return page;
+}
+
+// Only the holder of the last reference can write in place, and nobody can take a new one meanwhile
+bool GuestMemory::IsWritable(Page* page) {
+	return page->mapping == nullptr && page->refCount.load(std::memory_order_acquire) == 1;
+}
+
+void GuestMemory::Retain(Page* page) {
+	if (page == &zeroPage) return;
+	page->refCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void GuestMemory::Release(Page* page) {
+	if (page == &zeroPage) return;
+	// acq_rel so a copy taken from this page is finished before another holder can see a count of 1 and write
+	if (page->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		if (page->mapping) ReleaseMapping(page->mapping);
+		page->~Page();
+		delete[] (byte*)page;
+	}
+}
+
+void GuestMemory::RetainMapping(Mapping* mapping) {
+	mapping->refCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void GuestMemory::ReleaseMapping(Mapping* mapping) {
+	if (mapping->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		mapping->release(mapping);
+	}
+}
+
+byte* GuestMemory::Unshare(int page) {
+	MarkDirty(page);
+
+	// Everyone else may have let go since this memory last looked
+	Page* shared = pages[page];
+	if (IsWritable(shared)) {
+		owned[page] = shared->data;
+		return shared->data;
+	}
+
+	Page* copy = NewPage();
+	memcpy(copy->data, shared->data, PAGE_SIZE);
+	SetPage(page, copy);
+	owned[page] = copy->data;
+	Release(shared);
+	return copy->data;
+}
+
+void GuestMemory::Read(word address, byte* out, int size) const {
+	while (size > 0) {
+		int offset = address & (PAGE_SIZE - 1);
+		int count = PAGE_SIZE - offset;
+		if (count > size) count = size;
+		memcpy(out, &readable[address >> PAGE_SHIFT][offset], count);
+		out += count;
+		size -= count;
+		address = (word)(address + count);
+	}
+}
+
+void GuestMemory::Write(word address, byte const* data, int size) {
+	while (size > 0) {
+		int offset = address & (PAGE_SIZE - 1);
+		int count = PAGE_SIZE - offset;
+		if (count > size) count = size;
+
+		byte* page = owned[address >> PAGE_SHIFT];
+		if (page == nullptr) page = Unshare(address >> PAGE_SHIFT);
+		memcpy(&page[offset], data, count);
+
+		data += count;
+		size -= count;
+		address = (word)(address + count);
+	}
+}
+
+void GuestMemory::Clear() {
+	for (int i = 0; i < PAGE_COUNT; i++) {
+		if (owned[i]) {
+			memset(owned[i], 0, PAGE_SIZE);
+			continue;
+		}
+		Release(pages[i]);
+		SetPage(i, &zeroPage);
+	}
+	allDirty = true;
+}
+
+void GuestMemory::Share(GuestMemory& other) {
+	if (&other == this) return;
+	for (int i = 0; i < PAGE_COUNT; i++) {
+		// Retain first, the two may already hold the same page
+		Retain(other.pages[i]);
+		Release(pages[i]);
+		SetPage(i, other.pages[i]);
+		owned[i] = nullptr;
+		other.owned[i] = nullptr;
+	}
+	allDirty = true;
+}
+
+void GuestMemory::MarkClean() {
+	// Owned pages are written in place, so they have to go through Unshare once more to be seen
+	for (int i = 0; i < PAGE_COUNT; i++) {
+		owned[i] = nullptr;
+	}
+	ForgetDirty();
+}
+
+void GuestMemory::ForgetDirty() {
+	for (int i = 0; i < dirtyCount; i++) {
+		pageDirty[dirtyPages[i]] = false;
+	}
+	dirtyCount = 0;
+	allDirty = false;
+}
+
+void GuestMemory::RestoreDirty(GuestMemory const& clean) {
+	if (allDirty) {
+		for (int i = 0; i < PAGE_COUNT; i++) {
+			RestorePage(clean, i);
+		}
+	}
+	else {
+		for (int i = 0; i < dirtyCount; i++) {
+			RestorePage(clean, dirtyPages[i]);
+		}
+	}
+	// Only dirty pages could have been owned, so nothing is now
+	ForgetDirty();
+}
+
+void GuestMemory::RestorePage(GuestMemory const& clean, int page) {
+	// A page nothing else holds is copied over rather than swapped for the clean one, so the next run
+	// doesn't free it and allocate it again. It stops being owned, the next write to it still marks it dirty
+	Page* current = pages[page];
+	if (current != clean.pages[page] && IsWritable(current)) {
+		memcpy(current->data, clean.pages[page]->data, PAGE_SIZE);
+	}
+	else {
+		Retain(clean.pages[page]);
+		Release(current);
+		SetPage(page, clean.pages[page]);
+	}
+	owned[page] = nullptr;
+}
+
+void GuestMemory::MapPage(int page, byte const* data, Mapping* mapping) {
+	Page* mapped = new (new byte[sizeof(Page)]) Page;
+	mapped->refCount.store(1, std::memory_order_relaxed);
+	// Never written through, IsWritable is false for every mapped page
+	mapped->data = (byte*)data;
+	mapped->mapping = mapping;
+	RetainMapping(mapping);
+
+	Release(pages[page]);
+	SetPage(page, mapped);
+	owned[page] = nullptr;
+	MarkDirty(page);
+}
+
+bool GuestMemory::IsZeroPage(int page) const {
+	if (pages[page] == &zeroPage) return true;
+	byte const* data = readable[page];
+	for (int i = 0; i < PAGE_SIZE; i++) {
+		if (data[i] != 0) return false;
+	}
+	return true;
+}
+
+bool GuestMemory::Equals(GuestMemory const& other) const {
+	for (int i = 0; i < PAGE_COUNT; i++) {
+		if (pages[i] != other.pages[i] && memcmp(readable[i], other.readable[i], PAGE_SIZE) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int GuestMemory::OwnedPages() const {
+	int owned = 0;
+	for (int i = 0; i < PAGE_COUNT; i++) {
+		if (pages[i]->mapping == nullptr && pages[i]->refCount.load(std::memory_order_relaxed) == 1) owned++;
+	}
+	return owned;
+}
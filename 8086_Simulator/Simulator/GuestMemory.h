@@ -0,0 +1,159 @@
+#pragma once
+#include "Types.h"
+#include <atomic>
+
+//----------------------------------------------
+// GuestMemory
+// The 64K address space as a table of refcounted pages. Pages are shared copy-on-write: Share points
+// another memory at the same pages, and whichever side writes to a shared page first gets its own copy.
+// Untouched memory points at one zero page, so clearing is a pass over the table rather than 64K of stores.
+// Pages can also point into memory held elsewhere, like a mapped save state, and are copied the same way when written.
+// The counts are atomic, memories that share pages can run on different threads
+//----------------------------------------------
+class GuestMemory {
+public:
+	static const int SIZE = 0x10000;
+	static const int PAGE_SHIFT = 8;
+	static const int PAGE_SIZE = 1 << PAGE_SHIFT;
+	static const int PAGE_COUNT = SIZE >> PAGE_SHIFT;
+
+	// Keeps the bytes of mapped pages alive. Every page pointing into it holds a reference, and "release" is
+	// called with it once the last one is gone
+	struct Mapping {
+		std::atomic<int> refCount;
+		void (*release)(Mapping* mapping);
+	};
+
+	GuestMemory();
+	~GuestMemory();
+
+	inline byte Read(word address) const {
+		return readable[address >> PAGE_SHIFT][address & (PAGE_SIZE - 1)];
+	}
+
+	// Little endian, the high byte wraps around to address 0
+	inline word ReadWide(word address) const {
+		int offset = address & (PAGE_SIZE - 1);
+		byte const* data = readable[address >> PAGE_SHIFT];
+		if (offset != PAGE_SIZE - 1) return data[offset + 1] << 8 | data[offset];
+		return Read((word)(address + 1)) << 8 | data[offset];
+	}
+
+	inline void Write(word address, byte value) {
+		byte* data = owned[address >> PAGE_SHIFT];
+		if (data == nullptr) data = Unshare(address >> PAGE_SHIFT);
+		data[address & (PAGE_SIZE - 1)] = value;
+	}
+
+	inline void WriteWide(word address, word value) {
+		int offset = address & (PAGE_SIZE - 1);
+		byte* data = owned[address >> PAGE_SHIFT];
+		if (offset == PAGE_SIZE - 1 || data == nullptr) {
+			Write(address, (byte)value);
+			Write((word)(address + 1), (byte)(value >> 8));
+			return;
+		}
+		data[offset] = (byte)value;
+		data[offset + 1] = (byte)(value >> 8);
+	}
+
+	// Data of a page this memory holds alone, copied first if it's shared. Written in place from then on
+	inline byte* WritablePage(int page) {
+		return owned[page] ? owned[page] : Unshare(page);
+	}
+
+	// "size" bytes from "address", wrapping at the top of memory
+	void Read(word address, byte* out, int size) const;
+	void Write(word address, byte const* data, int size);
+
+	// Pointer to at least "size" bytes from "address". Straight into the page when they fit in it,
+	// otherwise gathered into "scratch". Only valid until the next write
+	inline byte const* Contiguous(word address, int size, byte* scratch) const {
+		if ((address & (PAGE_SIZE - 1)) + size <= PAGE_SIZE) return &readable[address >> PAGE_SHIFT][address & (PAGE_SIZE - 1)];
+		Read(address, scratch, size);
+		return scratch;
+	}
+
+	// Contents of one page, read-only since it may be shared
+	inline byte const* PageData(int page) const { return readable[page]; }
+
+	// True if every byte of the page is 0
+	bool IsZeroPage(int page) const;
+
+	// Every byte back to 0. Pages nothing else holds are zeroed and kept for the next run
+	void Clear();
+
+	// Drops this memory's pages and shares every page of "other" copy-on-write, both sides copy before writing from now on
+	void Share(GuestMemory& other);
+
+	// Points "page" at PAGE_SIZE bytes inside "mapping" without copying them. They're only ever read,
+	// the first write copies the page like any shared page
+	void MapPage(int page, byte const* data, Mapping* mapping);
+
+	static void RetainMapping(Mapping* mapping);
+	static void ReleaseMapping(Mapping* mapping);
+
+	bool Equals(GuestMemory const& other) const;
+
+	// Pages this memory doesn't share with anything, what it really costs
+	int OwnedPages() const;
+
+	// Dirty tracking. MarkClean starts it, and from then on every page written counts as dirty, and
+	// everything does after a Clear or a Share. RestoreDirty then puts back only what changed
+	void MarkClean();
+
+	// Shares the dirty pages back from "clean", which holds the state at MarkClean and is never written itself
+	void RestoreDirty(GuestMemory const& clean);
+
+	inline bool AllDirty() const { return allDirty; }
+	inline int DirtyCount() const { return dirtyCount; }
+	inline int DirtyPage(int index) const { return dirtyPages[index]; }
+
+private:
+	// The bytes follow the Page in the same block, or live in "mapping"
+	struct Page {
+		std::atomic<int> refCount;
+		byte* data;
+		Mapping* mapping;
+	};
+
+	GuestMemory(const GuestMemory&) = delete;
+	void operator=(const GuestMemory&) = delete;
+
+	static Page* NewPage();
+	static bool IsWritable(Page* page);
+	inline void SetPage(int index, Page* page) {
+		pages[index] = page;
+		readable[index] = page->data;
+	}
+
+	inline void MarkDirty(int page) {
+		if (pageDirty[page]) return;
+		pageDirty[page] = true;
+		dirtyPages[dirtyCount++] = (word)page;
+	}
+
+	byte* Unshare(int page);
+	void ForgetDirty();
+	void RestorePage(GuestMemory const& clean, int page);
+	static void Retain(Page* page);
+	static void Release(Page* page);
+
+	// Held by every memory that hasn't written there, never freed, and its count never reads as 1
+	static Page zeroPage;
+	static byte zeroData[PAGE_SIZE];
+
+	Page* pages[PAGE_COUNT];
+
+	// Each page's bytes, kept next to the table so a read doesn't go through the Page
+	byte const* readable[PAGE_COUNT];
+
+	// Data of the pages only this memory holds, written in place. Null where a write has to copy the page first
+	byte* owned[PAGE_COUNT];
+
+	// A page can only be written in place once Unshare has made it owned, so that's where pages are marked dirty
+	word dirtyPages[PAGE_COUNT];
+	int dirtyCount;
+	bool pageDirty[PAGE_COUNT];
+	bool allDirty;
+};
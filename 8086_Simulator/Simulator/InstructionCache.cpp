@@ -0,0 +1,44 @@
+#include "InstructionCache.h"
+
+InstructionCache::InstructionCache() {
+	for (int i = 0; i < PAGE_COUNT; i++) {
+		pages[i] = nullptr;
+	}
+}
+
+InstructionCache::~InstructionCache() {
+	Clear();
+}
+
+InstructionGeneric* InstructionCache::Insert(word address, InstructionGeneric const& instruction) {
+	InstructionGeneric**& page = pages[address >> PAGE_SHIFT];
+	if (page == nullptr) {
+		page = new InstructionGeneric*[PAGE_SIZE]();
+	}
+
+	InstructionGeneric*& slot = page[address & (PAGE_SIZE - 1)];
+	if (slot == nullptr) {
+		slot = new InstructionGeneric(instruction);
+	}
+	else {
+		*slot = instruction;
+	}
+	return slot;
+}
+
+void InstructionCache::InvalidatePage(int page) {
+	InstructionGeneric** entries = pages[page];
+	if (entries == nullptr) return;
+
+	for (int i = 0; i < PAGE_SIZE; i++) {
+		delete entries[i];
+	}
+	delete[] entries;
+	pages[page] = nullptr;
+}
+
+void InstructionCache::Clear() {
+	for (int i = 0; i < PAGE_COUNT; i++) {
+		InvalidatePage(i);
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "Types.h"
+
+//----------------------------------------------
+// InstructionCache
+// Decoded instructions keyed by linear address. An instruction is decoded the
+// first time it executes and stays cached until the guest writes to its page.
+//----------------------------------------------
+class InstructionCache {
+public:
+	static const int PAGE_SHIFT = 8;
+	static const int PAGE_SIZE = 1 << PAGE_SHIFT;
+	static const int PAGE_COUNT = 0x10000 >> PAGE_SHIFT;
+
+	// Longest supported encoding, an instruction near the end of a page can spill this far into the next
+	static const int MAX_INSTRUCTION_SIZE = 6;
+
+	InstructionCache();
+	~InstructionCache();
+
+	inline InstructionGeneric* Lookup(word address) {
+		InstructionGeneric** page = pages[address >> PAGE_SHIFT];
+		return page ? page[address & (PAGE_SIZE - 1)] : nullptr;
+	}
+
+	InstructionGeneric* Insert(word address, InstructionGeneric const& instruction);
+
+	// Called on every guest write, drops whatever was decoded from the written byte
+	inline void OnWrite(word address) {
+		int page = address >> PAGE_SHIFT;
+		if (pages[page]) {
+			InvalidatePage(page);
+		}
+		if ((address & (PAGE_SIZE - 1)) < MAX_INSTRUCTION_SIZE && page > 0 && pages[page - 1]) {
+			InvalidatePage(page - 1);
+		}
+	}
+
+	void InvalidatePage(int page);
+	void Clear();
+
+private:
+	InstructionGeneric** pages[PAGE_COUNT];
+};
@@ -1,12 +1,20 @@
 #pragma once
+#include <string.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "Arena.h"
 
 template <typename T>
 class List {
 public:
-    List() : data(nullptr), size(0), capacity(0) {}
+    List() : data(nullptr), size(0), capacity(0), arena(nullptr) {}
+
+    // Storage comes from the arena and is released with it, elements are never destroyed
+    explicit List(Arena& arena) : data(nullptr), size(0), capacity(0), arena(&arena) {}
 
     ~List() {
-        if (data) {
+        if (data && !arena) {
             delete[] data;
         }
     }
@@ -19,6 +27,19 @@ public:
         size++;
     }
 
+    // Constructs the new element in place and returns it, so large elements can be filled in without a copy
+    template <typename... Args>
+    T& EmplaceBack(Args&&... args) {
+        if (size >= capacity) {
+            Expand();
+        }
+        T* slot = &data[size];
+        slot->~T();
+        new (slot) T(std::forward<Args>(args)...);
+        size++;
+        return *slot;
+    }
+
     T& operator[](int index) {
         return data[index];
     }
@@ -31,49 +52,138 @@ public:
         return size;
     }
 
-    // copy constructor
-    List(const List<T>& other) : data(nullptr), size(0), capacity(0) {
-        if (data) delete[] data;
+    // Keeps the storage around for reuse
+    void Clear() {
+        size = 0;
+    }
+
+    // Make room for "newCapacity" elements up front so Add doesn't have to grow
+    void Reserve(int newCapacity) {
+        if (newCapacity > capacity) {
+            Grow(newCapacity);
+        }
+    }
+
+    // Sets the number of elements, any past the old size are default constructed or left from before,
+    // so threads can fill in their own ranges of a list sized up front
+    void Resize(int newSize) {
+        Reserve(newSize);
+        size = newSize;
+    }
+
+    // copy constructor, the copy always lives on the heap
+    List(const List<T>& other) : data(nullptr), size(0), capacity(0), arena(nullptr) {
         data = new T[other.capacity];
         size = other.size;
         capacity = other.capacity;
-
-        for (int i = 0; i < size; ++i) {
-            data[i] = other.data[i];
-        }
+        CopyElements(data, other.data, size);
 	}
 
-    // = operator just do a shallow copy
-    List<T> operator=(const List<T>& other) {
+    // move constructor, takes the storage over and leaves "other" empty
+    List(List<T>&& other) : data(other.data), size(other.size), capacity(other.capacity), arena(other.arena) {
+        other.data = nullptr;
+        other.size = 0;
+        other.capacity = 0;
+    }
+
+    // = operator makes a deep copy on the heap
+    List<T>& operator=(const List<T>& other) {
         if (this == &other) {
 			return *this;
 		}
 
-		delete[] data;
+		if (!arena) delete[] data;
+		arena = nullptr;
 		data = new T[other.capacity];
 		size = other.size;
 		capacity = other.capacity;
-
-		for (int i = 0; i < size; ++i) {
-			data[i] = other.data[i];
-		}
+		CopyElements(data, other.data, size);
 
 		return *this;
 	}
 
+    List<T>& operator=(List<T>&& other) {
+        if (this == &other) {
+            return *this;
+        }
+
+        if (!arena) delete[] data;
+        data = other.data;
+        size = other.size;
+        capacity = other.capacity;
+        arena = other.arena;
+        other.data = nullptr;
+        other.size = 0;
+        other.capacity = 0;
+
+        return *this;
+    }
+
 private:
     T* data;
     int size;
     int capacity;
+    Arena* arena;
+
+    // Plain old data is copied in one go, anything with a copy constructor element by element
+    static void CopyElements(T* dest, const T* source, int count, std::true_type) {
+        if (count > 0) {
+            memcpy((void*)dest, (const void*)source, sizeof(T) * count);
+        }
+    }
+
+    static void CopyElements(T* dest, const T* source, int count, std::false_type) {
+        for (int i = 0; i < count; ++i) {
+            dest[i] = source[i];
+        }
+    }
+
+    static void CopyElements(T* dest, const T* source, int count) {
+        CopyElements(dest, source, count, typename std::is_trivially_copyable<T>::type());
+    }
+
+    static void MoveElements(T* dest, T* source, int count, std::true_type) {
+        CopyElements(dest, source, count, std::true_type());
+    }
+
+    static void MoveElements(T* dest, T* source, int count, std::false_type) {
+        for (int i = 0; i < count; ++i) {
+            dest[i] = std::move(source[i]);
+        }
+    }
+
+    static void MoveElements(T* dest, T* source, int count) {
+        MoveElements(dest, source, count, typename std::is_trivially_copyable<T>::type());
+    }
 
     void Expand() {
-        int newCapacity = (capacity == 0) ? 1 : capacity * 2;
-        T* newData = new T[newCapacity];
+        Grow((capacity == 0) ? 1 : capacity * 2);
+    }
 
-        for (int i = 0; i < size; ++i) {
-            newData[i] = data[i];
+    void Grow(int newCapacity) {
+        if (arena) {
+            // The list is often the last thing allocated, in which case it can just keep going
+            if (data && arena->Extend(data, sizeof(T) * capacity, sizeof(T) * newCapacity)) {
+                for (int i = capacity; i < newCapacity; ++i) {
+                    new (&data[i]) T();
+                }
+                capacity = newCapacity;
+                return;
+            }
+
+            T* newData = arena->AllocateArray<T>(newCapacity);
+            for (int i = 0; i < newCapacity; ++i) {
+                new (&newData[i]) T();
+            }
+            MoveElements(newData, data, size);
+            data = newData;
+            capacity = newCapacity;
+            return;
         }
 
+        T* newData = new T[newCapacity];
+        MoveElements(newData, data, size);
+
         delete[] data;
         data = newData;
         capacity = newCapacity;
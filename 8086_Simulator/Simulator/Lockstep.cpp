@@ -0,0 +1,505 @@
+#include "Lockstep.h"
+#include <string.h>
+#include "Program.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace Lockstep {
+	//----------------------------------------------
+	// Lane vectors
+	// One word per lane. Comparisons give 0xffff in the lanes where they hold and 0 in the others
+	//----------------------------------------------
+#if defined(__AVX2__)
+	typedef __m256i Lanes;
+
+	inline Lanes LoadLanes(word const* values) { return _mm256_load_si256((__m256i const*)values); }
+	inline void StoreLanes(word* values, Lanes v) { _mm256_store_si256((__m256i*)values, v); }
+	inline Lanes Splat(word value) { return _mm256_set1_epi16((short)value); }
+	inline Lanes Add(Lanes a, Lanes b) { return _mm256_add_epi16(a, b); }
+	inline Lanes Sub(Lanes a, Lanes b) { return _mm256_sub_epi16(a, b); }
+	inline Lanes And(Lanes a, Lanes b) { return _mm256_and_si256(a, b); }
+	inline Lanes Or(Lanes a, Lanes b) { return _mm256_or_si256(a, b); }
+	inline Lanes Xor(Lanes a, Lanes b) { return _mm256_xor_si256(a, b); }
+	inline Lanes Equal(Lanes a, Lanes b) { return _mm256_cmpeq_epi16(a, b); }
+	// Unsigned a >= b
+	inline Lanes AtLeast(Lanes a, Lanes b) { return _mm256_cmpeq_epi16(_mm256_max_epu16(a, b), a); }
+	template <int N> inline Lanes ShiftRight(Lanes a) { return _mm256_srli_epi16(a, N); }
+	template <int N> inline Lanes ShiftLeft(Lanes a) { return _mm256_slli_epi16(a, N); }
+#else
+	struct Lanes {
+		word w[LANES];
+	};
+
+#define LANEWISE(expression) Lanes r; for (int i = 0; i < LANES; i++) r.w[i] = (word)(expression); return r;
+	inline Lanes LoadLanes(word const* values) { Lanes r; memcpy(r.w, values, sizeof(r.w)); return r; }
+	inline void StoreLanes(word* values, Lanes v) { memcpy(values, v.w, sizeof(v.w)); }
+	inline Lanes Splat(word value) { LANEWISE(value) }
+	inline Lanes Add(Lanes a, Lanes b) { LANEWISE(a.w[i] + b.w[i]) }
+	inline Lanes Sub(Lanes a, Lanes b) { LANEWISE(a.w[i] - b.w[i]) }
+	inline Lanes And(Lanes a, Lanes b) { LANEWISE(a.w[i] & b.w[i]) }
+	inline Lanes Or(Lanes a, Lanes b) { LANEWISE(a.w[i] | b.w[i]) }
+	inline Lanes Xor(Lanes a, Lanes b) { LANEWISE(a.w[i] ^ b.w[i]) }
+	inline Lanes Equal(Lanes a, Lanes b) { LANEWISE(a.w[i] == b.w[i] ? 0xffff : 0) }
+	inline Lanes AtLeast(Lanes a, Lanes b) { LANEWISE(a.w[i] >= b.w[i] ? 0xffff : 0) }
+	template <int N> inline Lanes ShiftRight(Lanes a) { LANEWISE(a.w[i] >> N) }
+	template <int N> inline Lanes ShiftLeft(Lanes a) { LANEWISE(a.w[i] << N) }
+#undef LANEWISE
+#endif
+
+	inline Lanes Not(Lanes a) { return Xor(a, Splat(0xffff)); }
+	inline Lanes IsZero(Lanes a) { return Equal(a, Splat(0)); }
+	inline Lanes IsSet(Lanes a, word bits) { return Not(IsZero(And(a, Splat(bits)))); }
+
+	// Bit per lane where the comparison held
+	unsigned int LaneMask(Lanes v) {
+		alignas(32) word values[LANES];
+		StoreLanes(values, v);
+		unsigned int mask = 0;
+		for (int l = 0; l < LANES; l++) {
+			if (values[l]) mask |= 1u << l;
+		}
+		return mask;
+	}
+
+	int LowestLane(unsigned int mask) {
+		for (int l = 0; l < LANES; l++) {
+			if (mask & (1u << l)) return l;
+		}
+		return -1;
+	}
+
+	int LaneCount(unsigned int mask) {
+		int count = 0;
+		for (; mask; mask &= mask - 1) count++;
+		return count;
+	}
+
+	//----------------------------------------------
+	// Group
+	//----------------------------------------------
+	// Rows in Register order from AX: ax cx dx bx sp bp si di cs ds ss es
+	const int REGISTER_ROWS = 12;
+	const int CS_ROW = (int)Register::CS - (int)Register::AX;
+
+	struct Group {
+		alignas(32) word registers[REGISTER_ROWS][LANES];
+		alignas(32) word flags[LANES];
+		CPU* cpus[LANES];
+		qword startCount[LANES];
+
+		unsigned int active;   // Lanes still in the group
+		unsigned int leaving;  // Lanes that drop out once the current instruction is done
+		Program* program;
+		int programEnd;
+		word ip;
+		qword steps;
+	};
+
+	inline word* Row(Group& group, Register reg) {
+		return group.registers[(int)reg - (int)Register::AX];
+	}
+
+	void LoadLane(Group& group, int lane) {
+		CPU& cpu = *group.cpus[lane];
+		for (int row = 0; row < REGISTER_ROWS; row++) {
+			group.registers[row][lane] = cpu.GetRegister((Register)((int)Register::AX + row));
+		}
+		group.flags[lane] = cpu.flags;
+	}
+
+	void StoreLane(Group& group, int lane) {
+		CPU& cpu = *group.cpus[lane];
+		for (int row = 0; row < REGISTER_ROWS; row++) {
+			cpu.SetRegister((Register)((int)Register::AX + row), group.registers[row][lane]);
+		}
+		cpu.flags = group.flags[lane];
+		cpu.ip = group.ip;
+		cpu.instructionCount = group.startCount[lane] + group.steps;
+	}
+
+	// After an instruction, the lane carries on by itself from "ip"
+	void LeaveGroup(Group& group, int lane, word ip) {
+		StoreLane(group, lane);
+		CPU& cpu = *group.cpus[lane];
+		cpu.ip = ip;
+		if (!cpu.halted && ip >= cpu.programEnd) {
+			cpu.halted = true;
+			cpu.exitReason = CPU::ExitReason::END_OF_PROGRAM;
+		}
+		group.active &= ~(1u << lane);
+	}
+
+	bool ProgramDirty(CPU& cpu) {
+		for (int i = 0; i < InstructionCache::PAGE_COUNT; i++) {
+			if (cpu.programPageDirty[i]) return true;
+		}
+		return false;
+	}
+
+	bool WritesCode(Group& group, word address) {
+		int offset = address - (CPU::LOAD_SEGMENT << 4);
+		return offset >= 0 && offset < group.program->image.size;
+	}
+
+	// The group fetches from the lowest lane's cs, the lanes that moved somewhere else go their own way
+	void LeaveOnDifferentCs(Group& group) {
+		word* cs = group.registers[CS_ROW];
+		word leaderCs = cs[LowestLane(group.active)];
+		for (int l = 0; l < LANES; l++) {
+			if ((group.active & (1u << l)) && cs[l] != leaderCs) group.leaving |= 1u << l;
+		}
+	}
+
+	//----------------------------------------------
+	// Operands
+	// Memory is read and written lane by lane, each lane has its own
+	//----------------------------------------------
+	Lanes EffectiveAddressLanes(Group& group, EffectiveAddress addr) {
+		Lanes bx = LoadLanes(Row(group, Register::BX));
+		Lanes bp = LoadLanes(Row(group, Register::BP));
+		Lanes si = LoadLanes(Row(group, Register::SI));
+		Lanes di = LoadLanes(Row(group, Register::DI));
+		switch (addr) {
+		case EffectiveAddress::BX_SI: return Add(bx, si);
+		case EffectiveAddress::BX_DI: return Add(bx, di);
+		case EffectiveAddress::BP_SI: return Add(bp, si);
+		case EffectiveAddress::BP_DI: return Add(bp, di);
+		case EffectiveAddress::SI: return si;
+		case EffectiveAddress::DI: return di;
+		case EffectiveAddress::BP: return bp;
+		case EffectiveAddress::BX: return bx;
+		// A direct address is just the offset
+		default: return Splat(0);
+		}
+	}
+
+	Lanes ReadRegister(Group& group, Register reg) {
+		int r = (int)reg;
+		if (r < (int)Register::AH) return And(LoadLanes(group.registers[r]), Splat(0x00ff));
+		if (r < (int)Register::AX) return ShiftRight<8>(LoadLanes(group.registers[r - (int)Register::AH]));
+		if (reg == Register::IP) return Splat(group.ip);
+		if (r <= (int)Register::ES) return LoadLanes(Row(group, reg));
+		return Splat(0);
+	}
+
+	void WriteRegister(Group& group, Register reg, Lanes value) {
+		int r = (int)reg;
+		if (r < (int)Register::AH) {
+			word* row = group.registers[r];
+			StoreLanes(row, Or(And(LoadLanes(row), Splat(0xff00)), And(value, Splat(0x00ff))));
+		}
+		else if (r < (int)Register::AX) {
+			word* row = group.registers[r - (int)Register::AH];
+			StoreLanes(row, Or(And(LoadLanes(row), Splat(0x00ff)), ShiftLeft<8>(value)));
+		}
+		else if (r <= (int)Register::ES) {
+			StoreLanes(Row(group, reg), value);
+		}
+		// ip is set from the instruction's size afterwards anyway, same as CPU::Execute
+	}
+
+	Lanes ReadOperand(Group& group, Operand const& op, bool isWide) {
+		switch (op.type) {
+		case Operand::Type::IMMEDIATE:
+			return Splat(op.immediate);
+		case Operand::Type::REGISTER:
+			return ReadRegister(group, op.reg);
+		case Operand::Type::MEMORY_LOC: {
+			alignas(32) word addresses[LANES];
+			alignas(32) word values[LANES];
+			StoreLanes(addresses, Add(EffectiveAddressLanes(group, op.mem.effectiveAddress), Splat(op.mem.memoryOffset)));
+			for (int l = 0; l < LANES; l++) {
+				if (!(group.active & (1u << l))) {
+					values[l] = 0;
+					continue;
+				}
+				GuestMemory& memory = group.cpus[l]->memory;
+				values[l] = isWide ? memory.ReadWide(addresses[l]) : memory.Read(addresses[l]);
+			}
+			return LoadLanes(values);
+		}
+		default:
+			return Splat(0);
+		}
+	}
+
+	void WriteOperand(Group& group, Operand const& op, Lanes value, bool isWide) {
+		if (op.type == Operand::Type::REGISTER) {
+			WriteRegister(group, op.reg, value);
+			return;
+		}
+		if (op.type != Operand::Type::MEMORY_LOC) return;
+
+		alignas(32) word addresses[LANES];
+		alignas(32) word values[LANES];
+		StoreLanes(addresses, Add(EffectiveAddressLanes(group, op.mem.effectiveAddress), Splat(op.mem.memoryOffset)));
+		StoreLanes(values, value);
+		for (int l = 0; l < LANES; l++) {
+			if (!(group.active & (1u << l))) continue;
+
+			CPU& cpu = *group.cpus[l];
+			cpu.memoryWriteCount++;
+			word address = addresses[l];
+			word high = address + 1;
+			if (WritesCode(group, address) || (isWide && WritesCode(group, high))) {
+				// Through the CPU, so the dirty pages are right for when it runs alone
+				if (isWide) cpu.SetMemoryWide(EffectiveAddress::DIRECT_ADDRESS, address, values[l]);
+				else cpu.SetMemory(EffectiveAddress::DIRECT_ADDRESS, address, (byte)values[l]);
+				group.leaving |= 1u << l;
+				continue;
+			}
+
+			// Anywhere else the store is all there is, the instruction cache was emptied on joining
+			if (isWide) cpu.memory.WriteWide(address, values[l]);
+			else cpu.memory.Write(address, (byte)values[l]);
+		}
+	}
+
+	//----------------------------------------------
+	// Flags
+	// The same rules as CPU::Execute, always taken from the 16 bit result
+	//----------------------------------------------
+	Lanes ResultFlags(Lanes result) {
+		Lanes flags = And(IsZero(result), Splat(CPU::ZERO));
+		flags = Or(flags, And(IsSet(result, 0x8000), Splat(CPU::SIGN)));
+
+		// Even number of set bits in the low byte
+		Lanes parity = Xor(result, ShiftRight<4>(result));
+		parity = Xor(parity, ShiftRight<2>(parity));
+		parity = Xor(parity, ShiftRight<1>(parity));
+		return Or(flags, And(IsZero(And(parity, Splat(1))), Splat(CPU::PARITY)));
+	}
+
+	Lanes AddFlags(Lanes dest, Lanes source, Lanes result) {
+		Lanes flags = ResultFlags(result);
+		flags = Or(flags, And(Not(AtLeast(result, dest)), Splat(CPU::CARRY)));
+		flags = Or(flags, And(IsSet(And(Xor(source, result), Xor(dest, result)), 0x8000), Splat(CPU::OVERFLOW)));
+		return Or(flags, And(IsSet(Xor(Xor(source, dest), result), 0x10), Splat(CPU::AUX_CARRY)));
+	}
+
+	Lanes SubFlags(Lanes dest, Lanes source, Lanes result) {
+		Lanes flags = ResultFlags(result);
+		flags = Or(flags, And(Not(AtLeast(dest, source)), Splat(CPU::CARRY)));
+		flags = Or(flags, And(IsSet(And(Xor(dest, source), Xor(dest, result)), 0x8000), Splat(CPU::OVERFLOW)));
+		return Or(flags, And(IsSet(Xor(Xor(source, dest), result), 0x10), Splat(CPU::AUX_CARRY)));
+	}
+
+	// Same conditions as CPU::ShouldJump, the loops count cx down in every lane
+	Lanes JumpTaken(Group& group, InstructionJump::Condition condition) {
+		Lanes flags = LoadLanes(group.flags);
+		Lanes zero = IsSet(flags, CPU::ZERO);
+		Lanes sign = IsSet(flags, CPU::SIGN);
+		word* cxRow = Row(group, Register::CX);
+
+		switch (condition) {
+		case InstructionJump::Condition::JumpAlways: return Splat(0xffff);
+		case InstructionJump::Condition::JumpOnEqualOrZero: return zero;
+		case InstructionJump::Condition::JumpOnLess: return sign;
+		case InstructionJump::Condition::JumpOnLessOrEqual: return Or(sign, zero);
+		case InstructionJump::Condition::JumpOnBelow: return sign;
+		case InstructionJump::Condition::JumpOnBelowOrEqual: return Or(sign, zero);
+		case InstructionJump::Condition::JumpOnParity: return IsSet(flags, CPU::PARITY);
+		case InstructionJump::Condition::JumpOnOverflow: return IsSet(flags, CPU::OVERFLOW);
+		case InstructionJump::Condition::JumpOnSign: return sign;
+		case InstructionJump::Condition::JumpOnNotEqualOrZero: return Not(zero);
+		case InstructionJump::Condition::JumpOnGreaterOrEqual: return Or(zero, Not(sign));
+		case InstructionJump::Condition::JumpOnGreater: return And(Not(zero), Not(sign));
+		case InstructionJump::Condition::JumpOnAboveOrEqual: return Or(zero, Not(sign));
+		case InstructionJump::Condition::JumpOnAbove: return And(Not(zero), Not(sign));
+		case InstructionJump::Condition::JumpOnNotParity: return Not(IsSet(flags, CPU::PARITY));
+		case InstructionJump::Condition::JumpOnNotOverflow: return Not(IsSet(flags, CPU::OVERFLOW));
+		case InstructionJump::Condition::JumpOnNotSign: return Not(sign);
+		case InstructionJump::Condition::JumpOnCXZero: return IsZero(LoadLanes(cxRow));
+		case InstructionJump::Condition::Loop:
+		case InstructionJump::Condition::LoopEqualOrZero:
+		case InstructionJump::Condition::LoopNotEqualOrZero: {
+			Lanes cx = Sub(LoadLanes(cxRow), Splat(1));
+			StoreLanes(cxRow, cx);
+			Lanes counting = Not(IsZero(cx));
+			if (condition == InstructionJump::Condition::LoopEqualOrZero) return And(counting, zero);
+			if (condition == InstructionJump::Condition::LoopNotEqualOrZero) return And(counting, Not(zero));
+			return counting;
+		}
+		}
+		return Splat(0);
+	}
+
+	//----------------------------------------------
+	// Execution
+	//----------------------------------------------
+	// Host handlers work on a CPU, so every lane is written back, handled and read in again
+	void Interrupt(Group& group, byte interruptNumber, word nextIp) {
+		for (int l = 0; l < LANES; l++) {
+			if (!(group.active & (1u << l))) continue;
+
+			StoreLane(group, l);
+			CPU& cpu = *group.cpus[l];
+			cpu.Interrupt(interruptNumber);
+			LoadLane(group, l);
+
+			if (cpu.halted) {
+				cpu.ip = nextIp;
+				group.active &= ~(1u << l);
+			}
+			else if (ProgramDirty(cpu)) {
+				group.leaving |= 1u << l;
+			}
+		}
+		if (group.active) LeaveOnDifferentCs(group);
+	}
+
+	// Returns where the lanes still in the group go next
+	word Jump(Group& group, InstructionJump const& jump, word nextIp) {
+		unsigned int taken = LaneMask(JumpTaken(group, jump.condition)) & group.active;
+		unsigned int notTaken = group.active & ~taken;
+		word target = nextIp + jump.byteOffset;
+		if (taken == 0 || target == nextIp) return nextIp;
+		if (notTaken == 0) return target;
+
+		// The lanes split up. The larger side stays together, a tie keeps the side with the lowest lane
+		int takenCount = LaneCount(taken);
+		int notTakenCount = LaneCount(notTaken);
+		bool stayTaken = takenCount > notTakenCount || (takenCount == notTakenCount && (taken & (1u << LowestLane(group.active))));
+		unsigned int leaving = stayTaken ? notTaken : taken;
+		for (int l = 0; l < LANES; l++) {
+			if (leaving & (1u << l)) LeaveGroup(group, l, stayTaken ? nextIp : target);
+		}
+		return stayTaken ? target : nextIp;
+	}
+
+	void Execute(Group& group, InstructionGeneric const& instruction) {
+		bool isWide = instruction.isWide;
+		word nextIp = group.ip + instruction.size;
+
+		switch (instruction.type) {
+		case InstructionType::MOVE: {
+			Lanes value = ReadOperand(group, instruction.move.source, isWide);
+			WriteOperand(group, instruction.move.dest, value, isWide);
+			if (instruction.move.dest.type == Operand::Type::REGISTER && instruction.move.dest.reg == Register::CS) {
+				LeaveOnDifferentCs(group);
+			}
+			break;
+		}
+		case InstructionType::ADD: {
+			Lanes source = ReadOperand(group, instruction.add.source, isWide);
+			Lanes dest = ReadOperand(group, instruction.add.dest, isWide);
+			Lanes result = Add(dest, source);
+			WriteOperand(group, instruction.add.dest, result, isWide);
+			StoreLanes(group.flags, AddFlags(dest, source, result));
+			break;
+		}
+		case InstructionType::SUB:
+		case InstructionType::COMPARE: {
+			Lanes source = ReadOperand(group, instruction.add.source, isWide);
+			Lanes dest = ReadOperand(group, instruction.add.dest, isWide);
+			Lanes result = Sub(dest, source);
+			if (instruction.type == InstructionType::SUB) WriteOperand(group, instruction.add.dest, result, isWide);
+			StoreLanes(group.flags, SubFlags(dest, source, result));
+			break;
+		}
+		case InstructionType::JUMP:
+			nextIp = Jump(group, instruction.jump, nextIp);
+			break;
+		case InstructionType::INTERRUPT:
+			Interrupt(group, instruction.interrupt.interruptNumber, nextIp);
+			break;
+		default:
+			// Nothing to do but move on, same as CPU::Execute
+			break;
+		}
+		group.ip = nextIp;
+
+		if (group.leaving) {
+			for (int l = 0; l < LANES; l++) {
+				if (group.leaving & (1u << l)) LeaveGroup(group, l, nextIp);
+			}
+			group.leaving = 0;
+		}
+
+		if (group.active && group.ip >= group.programEnd) {
+			for (int l = 0; l < LANES; l++) {
+				if (group.active & (1u << l)) LeaveGroup(group, l, nextIp);
+			}
+		}
+	}
+
+	void RunGroup(Group& group, qword instructions) {
+		int loadAddress = CPU::LOAD_SEGMENT << 4;
+		while (group.active && group.steps < instructions) {
+			word cs = group.registers[CS_ROW][LowestLane(group.active)];
+			word address = (cs << 4) + group.ip;
+			InstructionGeneric const* instruction = group.program->InstructionAt(address - loadAddress);
+			if (instruction == nullptr) {
+				// Not something the Program decoded, every lane decodes it from its own memory
+				break;
+			}
+
+			group.steps++;
+			Execute(group, *instruction);
+		}
+
+		for (int l = 0; l < LANES; l++) {
+			if (group.active & (1u << l)) StoreLane(group, l);
+		}
+		group.active = 0;
+	}
+
+	bool CanJoin(CPU& cpu, CPU& leader) {
+		if (cpu.halted || cpu.program == nullptr || cpu.scheduler.Pending() > 0) return false;
+		// The group neither counts writes nor checks limits between steps
+		if (cpu.limits.instructions != 0 || cpu.limits.microseconds != 0 || cpu.limits.memoryWrites != 0) return false;
+		if (cpu.program != leader.program || cpu.programEnd != leader.programEnd) return false;
+		if (cpu.cs != leader.cs || cpu.ip != leader.ip) return false;
+		return !ProgramDirty(cpu);
+	}
+
+	void Run(CPU** cpus, int count, qword instructions) {
+		Group group;
+		qword end[LANES];
+		for (int first = 0; first < count; first += LANES) {
+			int laneCount = (count - first < LANES) ? count - first : LANES;
+
+			int leader = -1;
+			for (int l = 0; l < laneCount && leader < 0; l++) {
+				if (CanJoin(*cpus[first + l], *cpus[first + l])) leader = l;
+			}
+
+			group.active = 0;
+			group.leaving = 0;
+			group.steps = 0;
+			for (int l = 0; l < LANES; l++) {
+				group.cpus[l] = (l < laneCount) ? cpus[first + l] : nullptr;
+				if (l >= laneCount) continue;
+
+				CPU& cpu = *group.cpus[l];
+				end[l] = cpu.instructionCount + instructions;
+				group.startCount[l] = cpu.instructionCount;
+				if (leader >= 0 && CanJoin(cpu, *cpus[first + leader])) {
+					// The group only runs the Program's instructions, so nothing gets decoded into the cache
+					// while the lane is in it. Empty, it needs no invalidating on writes either
+					cpu.instructionCache.Clear();
+					group.active |= 1u << l;
+					LoadLane(group, l);
+				}
+			}
+
+			if (leader >= 0) {
+				CPU& leaderCpu = *group.cpus[leader];
+				group.program = leaderCpu.program;
+				group.programEnd = leaderCpu.programEnd;
+				group.ip = leaderCpu.ip;
+				RunGroup(group, instructions);
+			}
+
+			// Lanes that left the group or never joined it finish by themselves
+			for (int l = 0; l < laneCount; l++) {
+				CPU& cpu = *group.cpus[l];
+				if (!cpu.halted && cpu.instructionCount < end[l]) {
+					cpu.Run(end[l] - cpu.instructionCount);
+				}
+			}
+		}
+	}
+}
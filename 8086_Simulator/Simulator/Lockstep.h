@@ -0,0 +1,22 @@
+#pragma once
+#include "Types.h"
+#include "Executor.h"
+
+//----------------------------------------------
+// Lockstep
+// Runs up to LANES CPUs that share a Program and sit at the same cs:ip as one group. The registers and flags
+// of every lane are held side by side (all the ax values, then all the cx values...), so each decoded
+// instruction executes once for the whole group, in AVX2 registers when built with AVX2 (/arch:AVX2, -mavx2)
+// and in plain loops the compiler can vectorize otherwise. Memory stays in each CPU and is read and written lane by lane.
+//
+// A lane leaves the group and carries on as a normal CPU when it stops matching the others: a conditional
+// jump that goes the other way, a write to the program's code, a different cs. Lanes with scheduled events,
+// execution limits, already modified code or a different cs:ip never join. Whichever way a CPU runs, it ends in the same state
+// as calling Run on it directly
+//----------------------------------------------
+namespace Lockstep {
+	const int LANES = 16;
+
+	// Runs every CPU "instructions" further, LANES at a time
+	void Run(CPU** cpus, int count, qword instructions);
+}
@@ -6,57 +6,361 @@
 // All magic numbers used are from the Intel 8086 manual
 // which can be found here: https://edge.edx.org/c4x/BITSPilani/EEE231/asset/8086_family_Users_Manual_1_.pdf
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// Builds without raylib and Dear ImGui define SIMULATOR_NO_WINDOW, everything but the window still works
+#ifndef SIMULATOR_NO_WINDOW
 #include <raylib.h>
 #include "rlImgui/rlImGui.h"
+#endif
 
 #include "Types.h"
 #include "StringifyTypes.h"
 #include "Decoder.h"
 #include "Executor.h"
+#include "BufferedWriter.h"
+#include "DosServices.h"
+#include "Decompiler.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include "RoundTrip.h"
+#include "DifferentialFuzzer.h"
+#include "BatchRunner.h"
+#include "SaveState.h"
+#include "DecodeCache.h"
+#include "Workloads.h"
 
 //----------------------------------------------
-// Testing stuff
+// Headless
+// Runs the program to completion, or for "steps" instructions if that's not 0, without a window.
+// Guest output goes to stdout, and the machine is saved to "saveStateFilename" when it stops.
+// A guest stopped by one of the CPU's limits exits with 1
 //----------------------------------------------
-Buffer LoadBufferFromFile(String filename) {
-	FILE* file;
-	fopen_s(&file, filename.c_str(), "rb");
-	if (file == NULL) {
-		printf("Error: Could not open file %s\n", filename.c_str());
-		return {};
-	}
-
-	// Get file size
-	fseek(file, 0, SEEK_END);
-	long size = ftell(file);
-	fseek(file, 0, SEEK_SET);
-
-	// Read file into buffer
-	int bufferSize = size;
-	byte* buffer = new byte[bufferSize];
-	fread_s(buffer, bufferSize, sizeof(char), bufferSize, file);
+int RunHeadless(CPU& executor, qword steps, const char* saveStateFilename) {
+	qword end = executor.instructionCount + steps;
+	while (!executor.IsHalted() && (steps == 0 || executor.instructionCount < end)) {
+		qword count = 1 << 20;
+		if (steps != 0 && end - executor.instructionCount < count) count = end - executor.instructionCount;
+		executor.Run(count);
+	}
+	if (saveStateFilename && !SaveState::Write(executor, saveStateFilename)) return 1;
+	if (executor.exitReason >= CPU::ExitReason::INSTRUCTION_LIMIT) {
+		printf("Stopped: %s after %llu instructions\n", CPU::ExitReasonName(executor.exitReason), executor.instructionCount);
+		return 1;
+	}
+	return executor.exitCode;
+}
+
+//----------------------------------------------
+// Decompile
+// Writes the program back out as assembly, on stdout unless an output file is given
+//----------------------------------------------
+bool DecompileTo(MappedFile& program, FILE* file, bool recursive, bool stream, bool parallel) {
+	BufferedWriter output(file, 1024 * 1024);
+	if (stream) {
+		return Decompiler::WriteStreamed(program, output);
+	}
+
+	Buffer& buffer = program.buffer;
+
+	List<InstructionGeneric> instructions;
+	if (recursive) instructions = Decoder::DecodeReachable(buffer);
+	else if (parallel) instructions = Decoder::DecodeParallel(buffer);
+	else instructions = Decoder::Decode(buffer);
+
+	// The sweeps have printed why they failed, a recursive decode finds nothing only when the entry doesn't decode
+	if (instructions.Size() == 0 && buffer.size > 0) {
+		if (recursive) Decoder::PrintDecodeError(buffer, 0);
+		return false;
+	}
+
+	Decompiler::Write(buffer, instructions, output);
+	return true;
+}
+
+FILE* OpenOutput(const char* filename) {
+	FILE* file = fopen(filename, "wb");
+	if (file == nullptr) {
+		printf("Error: Could not open %s for writing\n", filename);
+		return nullptr;
+	}
+	// BufferedWriter already hands over megabyte chunks, a second layer of buffering only adds a copy
+	setvbuf(file, nullptr, _IONBF, 0);
+	return file;
+}
+
+int RunDecompile(const char* filename, const char* outputFilename, bool recursive, bool stream) {
+	MappedFile program;
+	if (!program.Open(filename)) return 1;
+
+	FILE* file = outputFilename ? OpenOutput(outputFilename) : stdout;
+	if (file == nullptr) return 1;
+
+	bool ok = DecompileTo(program, file, recursive, stream, true);
+
+	if (outputFilename) fclose(file);
+	return ok ? 0 : 1;
+}
+
+//----------------------------------------------
+// Batch
+// Decompiles every file named in a list, one line per file, each to "<file>.asm".
+// Files are spread over a thread pool and the results are reported in list order
+//----------------------------------------------
+struct BatchJob {
+	String input;
+	String output;
+	bool recursive;
+	bool stream;
+	bool ok;
+};
+
+void RunBatchJob(void* userData) {
+	BatchJob& job = *(BatchJob*)userData;
+	job.ok = false;
+
+	MappedFile program;
+	if (!program.Open(job.input.c_str())) return;
+
+	FILE* file = OpenOutput(job.output.c_str());
+	if (file == nullptr) return;
+
+	// Serial decode, the pool already keeps every thread busy with a file of its own
+	job.ok = DecompileTo(program, file, job.recursive, job.stream, false);
 	fclose(file);
+}
+
+int RunBatch(const char* listFilename, bool recursive, bool stream) {
+	FILE* list = fopen(listFilename, "rb");
+	if (list == nullptr) {
+		printf("Error: Could not open %s\n", listFilename);
+		return 1;
+	}
+
+	List<String> inputs;
+	char line[4096];
+	while (fgets(line, sizeof(line), list)) {
+		int length = (int)strlen(line);
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+			line[--length] = '\0';
+		}
+		if (length > 0) inputs.Add(line);
+	}
+	fclose(list);
+
+	BatchJob* jobs = new BatchJob[inputs.Size()];
+	{
+		ThreadPool pool;
+		for (int i = 0; i < inputs.Size(); i++) {
+			jobs[i].input = inputs[i];
+			jobs[i].output = String::Format("%s.asm", inputs[i].c_str());
+			jobs[i].recursive = recursive;
+			jobs[i].stream = stream;
+			pool.Submit(RunBatchJob, &jobs[i]);
+		}
+		pool.Wait();
+	}
+
+	int failed = 0;
+	for (int i = 0; i < inputs.Size(); i++) {
+		printf("%s %s\n", jobs[i].ok ? "ok    " : "FAILED", jobs[i].output.c_str());
+		if (!jobs[i].ok) failed++;
+	}
+	printf("%i of %i files decompiled\n", inputs.Size() - failed, inputs.Size());
+
+	delete[] jobs;
+	return failed ? 1 : 0;
+}
+
+//----------------------------------------------
+// Batch run
+// Runs every job in a manifest in this one process and writes a JSON line per job,
+// on stdout unless an output file is given
+//----------------------------------------------
+int RunManifest(const char* manifestFilename, const char* outputFilename) {
+	BatchRunner::Batch batch;
+	if (!BatchRunner::ReadManifest(manifestFilename, batch)) return 1;
+
+	FILE* file = outputFilename ? OpenOutput(outputFilename) : stdout;
+	if (file == nullptr) return 1;
+
+	BatchRunner::RunJobs(batch);
+	BatchRunner::WriteResults(batch, file);
 
-	// Return buffer
-	return { buffer, bufferSize };
+	if (outputFilename) fclose(file);
+	return 0;
+}
+
+//----------------------------------------------
+// Workloads
+// Times every workload in a manifest, checks its final state and compares it with a baseline
+//----------------------------------------------
+int RunWorkloads(Workloads::Options const& options) {
+	Workloads::Result result;
+	bool ok = Workloads::Run(options, result);
+	printf("%i workloads, %i with a different final state, %i slower than the baseline\n", result.workloads, result.stateMismatches, result.regressions);
+	return ok ? 0 : 1;
+}
+
+//----------------------------------------------
+// Round trip
+// Decodes, encodes and decodes again every supported encoding, checks the decoder without an assembler
+//----------------------------------------------
+int RunRoundTrip() {
+	RoundTrip::Result result;
+	bool ok = RoundTrip::Run(result);
+	printf("%lld encodings checked, %lld failed\n", result.checked, result.failed);
+	return ok ? 0 : 1;
+}
+
+//----------------------------------------------
+// Differential fuzzing
+// Runs random programs on the reference step and on every fast execution path and compares them
+//----------------------------------------------
+int RunDifferentialFuzz(int programCount, unsigned int seed, const char* reproducerFilename) {
+	DifferentialFuzzer::Options options;
+	options.programCount = programCount;
+	options.seed = seed;
+	options.reproducerFilename = reproducerFilename ? reproducerFilename : "difffuzz_reproducer.bin";
+
+	DifferentialFuzzer::Result result;
+	bool ok = DifferentialFuzzer::Run(options, result);
+	printf("%lld programs, %lld instructions, %i failed\n", result.programs, result.instructions, result.failures);
+	return ok ? 0 : 1;
 }
 
 int main(int argc, char* argv[]) {
 	// Parse command line arguments
-	if (argc < 2) {
-		printf("Usage: %s <filename>\n", argv[0]);
+	bool headless = false;
+	bool decompile = false;
+	bool recursive = false;
+	bool stream = false;
+	bool roundTrip = false;
+	int fuzzPrograms = 0;
+	unsigned int seed = 1;
+	const char* filename = nullptr;
+	const char* batchFilename = nullptr;
+	const char* manifestFilename = nullptr;
+	Workloads::Options workloads;
+	const char* outputFilename = nullptr;
+	const char* saveStateFilename = nullptr;
+	const char* loadStateFilename = nullptr;
+	const char* decodeCacheDirectory = ".decode_cache";
+	qword steps = 0;
+	CPU::Limits limits = { 0, 0, 0 };
+	for (int i = 1; i < argc; i++) {
+		String arg = argv[i];
+		if (arg.Equals("--headless")) headless = true;
+		else if (arg.Equals("--decompile")) decompile = true;
+		else if (arg.Equals("--recursive")) recursive = true;
+		else if (arg.Equals("--stream")) stream = true;
+		else if (arg.Equals("--roundtrip")) roundTrip = true;
+		else if (arg.Equals("--difffuzz") && i + 1 < argc) fuzzPrograms = atoi(argv[++i]);
+		else if (arg.Equals("--seed") && i + 1 < argc) seed = (unsigned int)strtoul(argv[++i], nullptr, 10);
+		else if (arg.Equals("--output") && i + 1 < argc) outputFilename = argv[++i];
+		else if (arg.Equals("--batch") && i + 1 < argc) batchFilename = argv[++i];
+		else if (arg.Equals("--run-batch") && i + 1 < argc) manifestFilename = argv[++i];
+		else if (arg.Equals("--workloads") && i + 1 < argc) workloads.manifestFilename = argv[++i];
+		else if (arg.Equals("--expected") && i + 1 < argc) workloads.expectedFilename = argv[++i];
+		else if (arg.Equals("--baseline") && i + 1 < argc) workloads.baselineFilename = argv[++i];
+		else if (arg.Equals("--tolerance") && i + 1 < argc) workloads.tolerance = atof(argv[++i]);
+		else if (arg.Equals("--steps") && i + 1 < argc) steps = strtoull(argv[++i], nullptr, 10);
+		else if (arg.Equals("--instruction-limit") && i + 1 < argc) limits.instructions = strtoull(argv[++i], nullptr, 10);
+		else if (arg.Equals("--time-limit") && i + 1 < argc) limits.microseconds = strtoull(argv[++i], nullptr, 10) * 1000;
+		else if (arg.Equals("--write-limit") && i + 1 < argc) limits.memoryWrites = strtoull(argv[++i], nullptr, 10);
+		else if (arg.Equals("--save-state") && i + 1 < argc) saveStateFilename = argv[++i];
+		else if (arg.Equals("--load-state") && i + 1 < argc) loadStateFilename = argv[++i];
+		else if (arg.Equals("--decode-cache") && i + 1 < argc) decodeCacheDirectory = argv[++i];
+		else if (arg.Equals("--no-decode-cache")) decodeCacheDirectory = nullptr;
+		else filename = argv[i];
+	}
+
+	if (roundTrip) {
+		return RunRoundTrip();
+	}
+
+	if (fuzzPrograms > 0) {
+		return RunDifferentialFuzz(fuzzPrograms, seed, outputFilename);
+	}
+
+	if (manifestFilename) {
+		return RunManifest(manifestFilename, outputFilename);
+	}
+
+	if (workloads.manifestFilename) {
+		workloads.outputFilename = outputFilename;
+		return RunWorkloads(workloads);
+	}
+
+	if (batchFilename) {
+		return RunBatch(batchFilename, recursive, stream);
+	}
+
+	// A save state holds everything a headless run needs, the program file is only for the listing
+	if (headless && filename == nullptr && loadStateFilename) {
+		CPU executor;
+		BufferedWriter output(stdout);
+		Dos::Install(executor, output);
+		executor.limits = limits;
+		if (!SaveState::Read(loadStateFilename, executor)) return 1;
+		return RunHeadless(executor, steps, saveStateFilename);
+	}
+
+	if (filename == nullptr) {
+		printf("Usage: %s [--headless | --decompile [--recursive | --stream] [--output <file>]] <filename>\n", argv[0]);
+		printf("       %s --headless [--steps <n>] [--load-state <file>] [--save-state <file>] [<filename>]\n", argv[0]);
+		printf("       [--decode-cache <directory> | --no-decode-cache] with a window or --headless\n");
+		printf("       [--instruction-limit <n>] [--time-limit <ms>] [--write-limit <n>] with a window or --headless\n");
+		printf("       %s --batch <list file> [--recursive | --stream]\n", argv[0]);
+		printf("       %s --run-batch <manifest> [--output <file>]\n", argv[0]);
+		printf("       %s --workloads <manifest> [--expected <results>] [--baseline <file>] [--tolerance <percent>] [--output <file>]\n", argv[0]);
+		printf("       %s --roundtrip\n", argv[0]);
+		printf("       %s --difffuzz <program count> [--seed <n>] [--output <reproducer file>]\n", argv[0]);
 		return 1;
 	}
 
-	printf("Executing program and printing trace\n");
-	printf("--------------------\n");
+	if (decompile) {
+		return RunDecompile(filename, outputFilename, recursive, stream);
+	}
 
 	CPU executor;
-	{
-		Buffer buffer = LoadBufferFromFile(argv[1]);
-		List<InstructionGeneric> instructions = Decoder::Decode(buffer);
-		executor.LoadInstructions(instructions);
+	BufferedWriter output(stdout);
+	Dos::Install(executor, output);
+	executor.limits = limits;
+
+	// The listing is only for display, the CPU runs the Program and decodes anything else from memory.
+	// All of it lives in one arena that is thrown away on reload. A binary seen before skips the decode,
+	// its listing text then points into the mapped cache file, or the listing is the Program's own list,
+	// which the executor keeps alive
+	MappedFile program;
+	if (!program.Open(filename)) return 1;
+	Arena listingArena;
+	MappedFile decodeCacheFile;
+	DecodeCache::Decoded decoded;
+	DecodeCache::Load(program.buffer, decodeCacheDirectory, listingArena, decodeCacheFile, decoded);
+	executor.LoadProgram(decoded.program);
+	decoded.program->Release();
+
+	if (loadStateFilename && !SaveState::Read(loadStateFilename, executor)) return 1;
+
+	if (headless) {
+		return RunHeadless(executor, steps, saveStateFilename);
 	}
 
+#ifdef SIMULATOR_NO_WINDOW
+	printf("This build has no window, run the program with --headless\n");
+	return 1;
+#else
+	List<InstructionGeneric>* listing = decoded.listing;
+
+	// The buttons save and load next to the program unless a state was named on the command line
+	String stateFilename = String::Format("%s.state", filename);
+	if (saveStateFilename) stateFilename = saveStateFilename;
+	else if (loadStateFilename) stateFilename = loadStateFilename;
+
+	printf("Executing program and printing trace\n");
+	printf("--------------------\n");
+
 	// init raylib
 	InitWindow(800, 600, "8086 Simulator");
 	rlImGuiSetup(true);
@@ -67,12 +371,16 @@ int main(int argc, char* argv[]) {
 	Image renderImg = GenImageColor(64, 64, RED);
 	Texture2D renderTexture = LoadTextureFromImage(renderImg);
 
+	// Guest memory is paged, so the framebuffer is gathered into one block for the upload
+	static byte framebuffer[64 * 64 * 4];
+
 	while (!WindowShouldClose()) {
 		BeginDrawing();
 		ClearBackground(BLACK);
 
 		// Draw cpu memory as an image
-		UpdateTexture(renderTexture, &executor.memory[0x00f0]);
+		executor.memory.Read(0x00f0, framebuffer, sizeof(framebuffer));
+		UpdateTexture(renderTexture, framebuffer);
 		DrawRectangle(420-1, 20-1, 4.7 * 64 + 3, 4.7 * 64 + 3, DARKGRAY);
 		DrawTextureEx(renderTexture, { 420, 20 }, 0.0f, 4.7f, WHITE);
 
@@ -86,20 +394,27 @@ int main(int argc, char* argv[]) {
 			if (ImGui::Button("Reload")) {
 				executor.Reset();
 				running = false;
-				Buffer buffer = LoadBufferFromFile(argv[1]);
-				List<InstructionGeneric> instructions = Decoder::Decode(buffer);
-				executor.LoadInstructions(instructions);
+				program.Open(filename);
+				listingArena.Reset();
+				DecodeCache::Load(program.buffer, decodeCacheDirectory, listingArena, decodeCacheFile, decoded);
+				listing = decoded.listing;
+				executor.LoadProgram(decoded.program);
+				decoded.program->Release();
 			}
+			ImGui::SameLine();
+			if (ImGui::Button("Save state")) SaveState::Write(executor, stateFilename.c_str());
+			ImGui::SameLine();
+			if (ImGui::Button("Load state") && SaveState::Read(stateFilename.c_str(), executor)) running = false;
 
 			ImGui::InputInt("Steps", &executionsPerFrame);
 
 			ImGui::Separator();
 
 			// Show instructions
-			for (int i = 0; i < executor.loadedInstructions.Size(); i++) {
-				InstructionGeneric& instruction = executor.loadedInstructions[i];
+			for (int i = 0; i < listing->Size(); i++) {
+				InstructionGeneric& instruction = (*listing)[i];
 				ImGui::Text("%2i:", i); ImGui::SameLine();
-				ImGui::Selectable(instruction.asString.c_str(), i == executor.ip);
+				ImGui::Selectable(instruction.asString.c_str(), instruction.address == executor.ip);
 			}
 
 			ImGui::End();
@@ -131,7 +446,8 @@ int main(int argc, char* argv[]) {
 
 			ImGui::Text("Flags: %s", FlagsToString(executor.flags).c_str());
 
-			if (executor.halted) ImGui::Text("Halted");
+			if (executor.halted) ImGui::Text("Halted: %s", CPU::ExitReasonName(executor.exitReason));
+			if (executor.exitReason == CPU::ExitReason::TERMINATED) ImGui::Text("Exit code: %i", executor.exitCode);
 
 			ImGui::End();
 		}
@@ -142,24 +458,24 @@ int main(int argc, char* argv[]) {
 			for (size_t i = 0; i < 100; i++)
 			{
 				int offset = i * 24;
+				byte row[24];
+				executor.memory.Read((word)offset, row, sizeof(row));
 				ImGui::Text("%4i: %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x", offset,
-					executor.memory[offset + 0], executor.memory[offset + 1], executor.memory[offset + 2], executor.memory[offset + 3],
-					executor.memory[offset + 4], executor.memory[offset + 5], executor.memory[offset + 6], executor.memory[offset + 7],
-					executor.memory[offset + 8], executor.memory[offset + 9], executor.memory[offset + 10], executor.memory[offset + 11],
-					executor.memory[offset + 12], executor.memory[offset + 13], executor.memory[offset + 14], executor.memory[offset + 15],
-					executor.memory[offset + 16], executor.memory[offset + 17], executor.memory[offset + 18], executor.memory[offset + 19],
-					executor.memory[offset + 20], executor.memory[offset + 21], executor.memory[offset + 22], executor.memory[offset + 23]
+					row[0], row[1], row[2], row[3],
+					row[4], row[5], row[6], row[7],
+					row[8], row[9], row[10], row[11],
+					row[12], row[13], row[14], row[15],
+					row[16], row[17], row[18], row[19],
+					row[20], row[21], row[22], row[23]
 				);
 			}
 			ImGui::End();
 		}
 
-		if (running) {
-			for (size_t i = 0; i < executionsPerFrame; i++)
-			{
-				executor.Step();
-			}
+		if (running && executionsPerFrame > 0) {
+			executor.Run(executionsPerFrame);
 		}
+		output.Flush();
 
 		rlImGuiEnd();
 		EndDrawing();
@@ -171,6 +487,7 @@ int main(int argc, char* argv[]) {
 	executor.PrintState();
 	
 	return 0;
+#endif
 }
 
 
@@ -0,0 +1,119 @@
+#include "MappedFile.h"
+#include <stdio.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile()
+	: buffer{ nullptr, 0 }, file(INVALID_HANDLE_VALUE), mapping(nullptr)
+{
+}
+
+bool MappedFile::Open(const char* filename, bool printErrors) {
+	Close();
+
+	file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		if (printErrors) printf("Error: Could not open file %s\n", filename);
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	GetFileSizeEx(file, &size);
+	if (size.QuadPart == 0) {
+		// Empty files can't be mapped, an empty buffer is fine though
+		return true;
+	}
+
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (view == nullptr) {
+		if (printErrors) printf("Error: Could not map file %s\n", filename);
+		Close();
+		return false;
+	}
+
+	buffer = { (byte*)view, (int)size.QuadPart };
+	return true;
+}
+
+void MappedFile::Close() {
+	if (buffer.data) UnmapViewOfFile(buffer.data);
+	if (mapping) CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+	buffer = { nullptr, 0 };
+	mapping = nullptr;
+	file = INVALID_HANDLE_VALUE;
+}
+
+void MappedFile::Discard(int offset, int length) {
+	// Clean file backed pages are trimmed from the working set by the OS on its own
+}
+
+#else
+
+MappedFile::MappedFile()
+	: buffer{ nullptr, 0 }, file(-1)
+{
+}
+
+bool MappedFile::Open(const char* filename, bool printErrors) {
+	Close();
+
+	file = open(filename, O_RDONLY);
+	if (file < 0) {
+		if (printErrors) printf("Error: Could not open file %s\n", filename);
+		return false;
+	}
+
+	struct stat info;
+	fstat(file, &info);
+	if (info.st_size == 0) {
+		// Empty files can't be mapped, an empty buffer is fine though
+		return true;
+	}
+
+	void* view = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	if (view == MAP_FAILED) {
+		if (printErrors) printf("Error: Could not map file %s\n", filename);
+		Close();
+		return false;
+	}
+	madvise(view, info.st_size, MADV_SEQUENTIAL);
+
+	buffer = { (byte*)view, (int)info.st_size };
+	return true;
+}
+
+void MappedFile::Close() {
+	if (buffer.data) munmap(buffer.data, buffer.size);
+	if (file >= 0) close(file);
+	buffer = { nullptr, 0 };
+	file = -1;
+}
+
+void MappedFile::Discard(int offset, int length) {
+	// madvise wants whole pages, so only drop the pages that lie completely inside the range
+	long pageSize = sysconf(_SC_PAGESIZE);
+	long start = (offset + pageSize - 1) / pageSize * pageSize;
+	long end = (long)(offset + length) / pageSize * pageSize;
+	if (end > start) {
+		madvise(buffer.data + start, end - start, MADV_DONTNEED);
+	}
+}
+
+#endif
+
+MappedFile::~MappedFile() {
+	Close();
+}
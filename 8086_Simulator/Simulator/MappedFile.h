@@ -0,0 +1,33 @@
+#pragma once
+#include "Types.h"
+
+//----------------------------------------------
+// MappedFile
+// A read-only view of a file mapped straight into memory. Nothing is copied,
+// the buffer points at the OS's pages and is valid until Close
+//----------------------------------------------
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+
+	// Quiet if "printErrors" is false, for files that are allowed to be missing
+	bool Open(const char* filename, bool printErrors = true);
+	void Close();
+
+	// Hint that a range won't be read again, so the OS can drop those pages while streaming through a large file
+	void Discard(int offset, int length);
+
+	Buffer buffer;
+
+private:
+	MappedFile(const MappedFile&) = delete;
+	void operator=(const MappedFile&) = delete;
+
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#else
+	int file;
+#endif
+};
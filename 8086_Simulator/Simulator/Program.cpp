@@ -0,0 +1,65 @@
+#include "Program.h"
+#include <string.h>
+#include <utility>
+#include "Decoder.h"
+
+Program::Program()
+	: image{ nullptr, 0 }, instructionAtByte(nullptr), text(nullptr), refCount(1)
+{
+}
+
+Program::~Program() {
+	delete[] image.data;
+	delete[] instructionAtByte;
+	delete[] text;
+}
+
+Program* Program::CopyImage(Buffer const& source) {
+	Program* program = new Program();
+	program->image = { new byte[source.size], source.size };
+	memcpy(program->image.data, source.data, source.size);
+	return program;
+}
+
+void Program::IndexInstructions() {
+	instructionAtByte = new int[image.size];
+	for (int i = 0; i < image.size; i++) {
+		instructionAtByte[i] = -1;
+	}
+	for (int i = 0; i < instructions.Size(); i++) {
+		instructionAtByte[instructions[i].address] = i;
+	}
+}
+
+Program* Program::Create(Buffer const& source) {
+	Program* program = CopyImage(source);
+
+	// Reachable code only, so data mixed into the image doesn't stop the decode. Anything
+	// executed outside of what was found here is decoded by each CPU on its own
+	program->instructions = Decoder::DecodeReachable(program->image);
+	program->IndexInstructions();
+	return program;
+}
+
+Program* Program::Create(Buffer const& source, List<InstructionGeneric>&& instructions) {
+	Program* program = CopyImage(source);
+	program->instructions = std::move(instructions);
+	program->IndexInstructions();
+	return program;
+}
+
+Program* Program::Create(Buffer const& source, List<InstructionGeneric>&& instructions, char* text) {
+	Program* program = Create(source, std::move(instructions));
+	program->text = text;
+	return program;
+}
+
+void Program::Retain() {
+	refCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Program::Release() {
+	if (refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		delete this;
+	}
+}
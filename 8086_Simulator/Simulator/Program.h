@@ -0,0 +1,48 @@
+#pragma once
+#include "Types.h"
+#include "List.h"
+#include <atomic>
+
+//----------------------------------------------
+// Program
+// A binary decoded once and shared read-only by every CPU that runs it.
+// Refcounted, Create hands out the first reference and the last Release deletes it.
+// The count is atomic, so CPUs on different threads can share one Program
+//----------------------------------------------
+class Program {
+public:
+	// Copies the image and decodes everything reachable from its first byte
+	static Program* Create(Buffer const& image);
+
+	// Copies the image and takes instructions decoded from it earlier, in address order like DecodeReachable returns them
+	static Program* Create(Buffer const& image, List<InstructionGeneric>&& instructions);
+
+	// Same, for instructions whose text is borrowed from "text", a new[] block the Program frees with itself
+	static Program* Create(Buffer const& image, List<InstructionGeneric>&& instructions, char* text);
+
+	void Retain();
+	void Release();
+
+	// Instruction starting at "offset" into the image, nullptr if no decoded instruction starts there
+	inline InstructionGeneric const* InstructionAt(int offset) const {
+		if (offset < 0 || offset >= image.size) return nullptr;
+		int index = instructionAtByte[offset];
+		return (index >= 0) ? &instructions[index] : nullptr;
+	}
+
+	Buffer image;
+	List<InstructionGeneric> instructions;
+
+private:
+	Program();
+	~Program();
+	Program(const Program&) = delete;
+	void operator=(const Program&) = delete;
+
+	static Program* CopyImage(Buffer const& source);
+	void IndexInstructions();
+
+	int* instructionAtByte;
+	char* text;
+	std::atomic<int> refCount;
+};
@@ -0,0 +1,83 @@
+#include "RoundTrip.h"
+#include <stdio.h>
+#include <string.h>
+#include "Decoder.h"
+#include "Encoder.h"
+#include "StringifyTypes.h"
+
+namespace RoundTrip {
+	static const byte edgeBytes[] = { 0x00, 0x01, 0x02, 0x7e, 0x7f, 0x80, 0x81, 0xfe, 0xff };
+	static const int EDGE_BYTE_COUNT = sizeof(edgeBytes) / sizeof(edgeBytes[0]);
+
+	bool Check(byte* bytes, byte* encoded) {
+		InstructionGeneric decoded;
+		int size = Decoder::DecodeInstruction(bytes, 0, decoded);
+		if (size == 0) return true;
+
+		memset(encoded, 0, Encoder::MAX_INSTRUCTION_SIZE);
+		int encodedSize = Encoder::EncodeInstruction(decoded, encoded);
+		if (encodedSize == 0 || encodedSize > size) return false;
+
+		InstructionGeneric again;
+		if (Decoder::DecodeInstruction(encoded, 0, again) != encodedSize) return false;
+		if (!Encoder::SameInstruction(decoded, again)) return false;
+
+		// The encoding has to be a fixed point, encoding the second decode gives the same bytes
+		byte reencoded[Encoder::MAX_INSTRUCTION_SIZE] = {};
+		if (Encoder::EncodeInstruction(again, reencoded) != encodedSize) return false;
+		return memcmp(encoded, reencoded, encodedSize) == 0;
+	}
+
+	void ReportFailure(byte* bytes, int size, byte* encoded) {
+		InstructionGeneric decoded;
+		Decoder::DecodeInstruction(bytes, 0, decoded);
+		char text[128];
+		FormatInstruction(decoded, text, sizeof(text));
+
+		printf("Round trip failed: ");
+		for (int i = 0; i < size; i++) printf("%02x ", bytes[i]);
+		printf("-> ");
+		for (int i = 0; i < Encoder::MAX_INSTRUCTION_SIZE; i++) printf("%02x ", encoded[i]);
+		printf("(%s)\n", text);
+	}
+
+	bool Run(Result& result, int maxReported) {
+		result.checked = 0;
+		result.failed = 0;
+
+		byte bytes[Encoder::MAX_INSTRUCTION_SIZE] = {};
+		byte encoded[Encoder::MAX_INSTRUCTION_SIZE];
+		for (int first = 0; first < 256; first++) {
+			for (int second = 0; second < 256; second++) {
+				memset(bytes, 0, sizeof(bytes));
+				bytes[0] = (byte)first;
+				bytes[1] = (byte)second;
+
+				// The first two bytes decide the length, whatever follows them
+				InstructionGeneric probe;
+				int size = Decoder::DecodeInstruction(bytes, 0, probe);
+				if (size == 0) continue;
+
+				// Every displacement and immediate byte takes each edge value in turn
+				int trailing = size - 2;
+				int combinations = 1;
+				for (int i = 0; i < trailing; i++) combinations *= EDGE_BYTE_COUNT;
+
+				for (int combination = 0; combination < combinations; combination++) {
+					int digits = combination;
+					for (int i = 0; i < trailing; i++) {
+						bytes[2 + i] = edgeBytes[digits % EDGE_BYTE_COUNT];
+						digits /= EDGE_BYTE_COUNT;
+					}
+
+					result.checked++;
+					if (Check(bytes, encoded)) continue;
+
+					if (result.failed < maxReported) ReportFailure(bytes, size, encoded);
+					result.failed++;
+				}
+			}
+		}
+		return result.failed == 0;
+	}
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include "Types.h"
+
+//----------------------------------------------
+// RoundTrip
+// Checks the decoder and encoder against each other without an assembler:
+// bytes are decoded, encoded again and the encoding decoded, both decodes have to match
+//----------------------------------------------
+namespace RoundTrip {
+	struct Result {
+		long long checked;
+		long long failed;
+	};
+
+	// Enumerates every opcode byte with every mod/reg/rm byte, and every displacement and immediate built
+	// from the bytes around the sign and wrap boundaries (00-02, 7e-81, fe-ff).
+	// Prints the first "maxReported" failures, returns true if there were none
+	bool Run(Result& result, int maxReported = 16);
+
+	// Checks one encoding, "bytes" is zero padded to at least 6 bytes. Returns false and fills in
+	// "encoded" if the decode doesn't survive the trip, true if it does or if the opcode isn't supported
+	bool Check(byte* bytes, byte* encoded);
+}
@@ -0,0 +1,160 @@
+#include "SaveState.h"
+#include <stdio.h>
+#include <string.h>
+#include "MappedFile.h"
+#include "String.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+namespace SaveState {
+	static_assert(sizeof(Header) == 96, "the header is the file format, it can't change size by accident");
+	static_assert(sizeof(Header) <= MEMORY_ALIGNMENT, "memory starts after the header");
+
+	//----------------------------------------------
+	// Writing
+	//----------------------------------------------
+	bool Write(CPU& cpu, const char* filename) {
+		Header header;
+		memset(&header, 0, sizeof(header));
+		header.magic = MAGIC;
+		header.version = VERSION;
+		header.headerSize = sizeof(Header);
+		header.ax = cpu.ax, header.cx = cpu.cx, header.dx = cpu.dx, header.bx = cpu.bx;
+		header.sp = cpu.sp, header.bp = cpu.bp, header.si = cpu.si, header.di = cpu.di;
+		header.cs = cpu.cs, header.ds = cpu.ds, header.ss = cpu.ss, header.es = cpu.es;
+		header.ip = cpu.ip, header.flags = cpu.flags;
+		header.halted = cpu.halted;
+		header.exitReason = (byte)cpu.exitReason;
+		header.pageSize = GuestMemory::PAGE_SIZE;
+		header.exitCode = cpu.exitCode;
+		header.programEnd = cpu.programEnd;
+		header.instructionCount = cpu.instructionCount;
+		header.memoryOffset = MEMORY_ALIGNMENT;
+		for (int page = 0; page < GuestMemory::PAGE_COUNT; page++) {
+			if (cpu.memory.IsZeroPage(page)) continue;
+			header.presentPages[page >> 3] |= 1 << (page & 7);
+			header.pageCount++;
+		}
+
+		// Written next to the old file and moved over it, the CPU may still have the old one mapped
+		String temporary = String::Format("%s.tmp", filename);
+		FILE* file = fopen(temporary.c_str(), "wb");
+		if (file == nullptr) {
+			printf("Error: Could not open %s for writing\n", temporary.c_str());
+			return false;
+		}
+
+		static const byte padding[MEMORY_ALIGNMENT] = {};
+		bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+		ok = ok && fwrite(padding, MEMORY_ALIGNMENT - sizeof(header), 1, file) == 1;
+		for (int page = 0; page < GuestMemory::PAGE_COUNT && ok; page++) {
+			if (!(header.presentPages[page >> 3] & (1 << (page & 7)))) continue;
+			ok = fwrite(cpu.memory.PageData(page), GuestMemory::PAGE_SIZE, 1, file) == 1;
+		}
+		ok = (fclose(file) == 0) && ok;
+		if (!ok) {
+			printf("Error: Could not write %s\n", temporary.c_str());
+			remove(temporary.c_str());
+			return false;
+		}
+
+#ifdef _WIN32
+		// rename doesn't replace an existing file on Windows. Neither does this while the old one is still
+		// mapped, the old file is then left as it was
+		if (!MoveFileExA(temporary.c_str(), filename, MOVEFILE_REPLACE_EXISTING)) {
+			DWORD error = GetLastError();
+			if (error == ERROR_SHARING_VIOLATION || error == ERROR_ACCESS_DENIED || error == ERROR_USER_MAPPED_FILE) {
+				printf("Error: Could not replace %s, it is still in use. The new state is in %s\n", filename, temporary.c_str());
+			} else {
+				printf("Error: Could not replace %s with %s (error %lu)\n", filename, temporary.c_str(), error);
+				remove(temporary.c_str());
+			}
+			return false;
+		}
+#else
+		if (rename(temporary.c_str(), filename) != 0) {
+			printf("Error: Could not replace %s with %s\n", filename, temporary.c_str());
+			return false;
+		}
+#endif
+		return true;
+	}
+
+	//----------------------------------------------
+	// Reading
+	//----------------------------------------------
+
+	// The mapped file stays open for as long as a page points into it
+	struct MappedState : GuestMemory::Mapping {
+		MappedFile file;
+	};
+
+	void ReleaseState(GuestMemory::Mapping* mapping) {
+		delete static_cast<MappedState*>(mapping);
+	}
+
+	bool ReadHeader(Buffer const& buffer, const char* filename, Header& header) {
+		if (buffer.size < (int)sizeof(Header)) {
+			printf("Error: %s is too short to be a save state\n", filename);
+			return false;
+		}
+		memcpy(&header, buffer.data, sizeof(Header));
+		if (header.magic != MAGIC) {
+			printf("Error: %s is not a save state\n", filename);
+			return false;
+		}
+		if (header.version != VERSION || header.headerSize != sizeof(Header) || header.pageSize != GuestMemory::PAGE_SIZE) {
+			printf("Error: %s is save state version %i, this build reads version %i\n", filename, header.version, VERSION);
+			return false;
+		}
+
+		int present = 0;
+		for (int page = 0; page < GuestMemory::PAGE_COUNT; page++) {
+			if (header.presentPages[page >> 3] & (1 << (page & 7))) present++;
+		}
+		long long memoryEnd = (long long)header.memoryOffset + (long long)header.pageCount * GuestMemory::PAGE_SIZE;
+		if (present != header.pageCount || header.memoryOffset < (int)sizeof(Header) || memoryEnd > buffer.size ||
+			header.exitReason > (byte)CPU::ExitReason::WRITE_LIMIT) {
+			printf("Error: %s is damaged\n", filename);
+			return false;
+		}
+		return true;
+	}
+
+	bool Read(const char* filename, CPU& cpu) {
+		MappedState* state = new MappedState;
+		state->refCount.store(1, std::memory_order_relaxed);
+		state->release = ReleaseState;
+
+		Header header;
+		if (!state->file.Open(filename) || !ReadHeader(state->file.buffer, filename, header)) {
+			delete state;
+			return false;
+		}
+
+		cpu.Reset();
+		byte const* stored = state->file.buffer.data + header.memoryOffset;
+		for (int page = 0; page < GuestMemory::PAGE_COUNT; page++) {
+			if (!(header.presentPages[page >> 3] & (1 << (page & 7)))) continue;
+			cpu.memory.MapPage(page, stored, state);
+			stored += GuestMemory::PAGE_SIZE;
+		}
+		// The pages hold their own references now, with none at all the file is closed here
+		GuestMemory::ReleaseMapping(state);
+
+		cpu.ax = header.ax, cpu.cx = header.cx, cpu.dx = header.dx, cpu.bx = header.bx;
+		cpu.sp = header.sp, cpu.bp = header.bp, cpu.si = header.si, cpu.di = header.di;
+		cpu.cs = header.cs, cpu.ds = header.ds, cpu.ss = header.ss, cpu.es = header.es;
+		cpu.ip = header.ip, cpu.flags = header.flags;
+		cpu.halted = header.halted != 0;
+		cpu.exitReason = (CPU::ExitReason)header.exitReason;
+		cpu.exitCode = header.exitCode;
+		cpu.programEnd = header.programEnd;
+		cpu.instructionCount = header.instructionCount;
+		return true;
+	}
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "Types.h"
+#include "Executor.h"
+
+//----------------------------------------------
+// SaveState
+// A running machine in a file: a fixed header with the registers, flags, halted state, exit reason and
+// instruction count, then every page of memory that isn't all zero, starting on a MEMORY_ALIGNMENT boundary.
+// Restoring maps the file and points the CPU's pages straight into it, nothing is read until the guest
+// touches it and a page is only copied when the guest writes to it.
+// The Program, scheduled events and interrupt handlers belong to the host and aren't saved,
+// a restored CPU decodes its code from memory like any code it wrote itself. The limits' write count and run time
+// start over, the instruction limit goes on from the saved count
+//----------------------------------------------
+namespace SaveState {
+	const unsigned int MAGIC = 0x53533638; // "86SS"
+	const unsigned short VERSION = 1;
+	const int MEMORY_ALIGNMENT = 4096;
+
+	// Little endian, the layout is the file format, so fields are only ever added at the end with a new version
+	struct Header {
+		unsigned int magic;
+		unsigned short version;
+		unsigned short headerSize;
+		word ax, cx, dx, bx, sp, bp, si, di;
+		word cs, ds, ss, es, ip, flags;
+		byte halted;
+		byte exitReason;
+		word pageSize;
+		int exitCode;
+		int programEnd;
+		qword instructionCount;
+
+		// Pages stored, in ascending order from memoryOffset. Bit n of presentPages is set if page n is stored
+		int pageCount;
+		int memoryOffset;
+		byte presentPages[GuestMemory::PAGE_COUNT / 8];
+	};
+
+	// Prints the problem and returns false if the file can't be written
+	bool Write(CPU& cpu, const char* filename);
+
+	// Replaces the CPU's state with the one in the file. Prints the problem and leaves the CPU alone if the
+	// file can't be read or isn't a save state this build understands
+	bool Read(const char* filename, CPU& cpu);
+}
@@ -0,0 +1,133 @@
+#include "Scheduler.h"
+#include "Executor.h"
+
+Scheduler::Scheduler()
+	: events(nullptr), count(0), capacity(0), nextId(1)
+{
+}
+
+Scheduler::~Scheduler() {
+	delete[] events;
+}
+
+int Scheduler::Schedule(qword deadline, qword period, EventCallback callback, void* userData) {
+	return Push({ deadline, period, callback, userData, -1, 0 });
+}
+
+int Scheduler::ScheduleInterrupt(qword deadline, qword period, byte interruptNumber) {
+	return Push({ deadline, period, nullptr, nullptr, interruptNumber, 0 });
+}
+
+void Scheduler::Cancel(int id) {
+	for (int i = 0; i < count; i++) {
+		if (events[i].id == id) {
+			RemoveAt(i);
+			return;
+		}
+	}
+}
+
+void Scheduler::RunExpired(CPU& cpu, qword now) {
+	while (count > 0 && events[0].deadline <= now) {
+		// Take the event off the heap before firing it, the callback is free to schedule or cancel
+		Event event = events[0];
+		RemoveAt(0);
+
+		if (event.period != 0) {
+			Event next = event;
+			next.deadline += event.period;
+			events[count] = next;
+			SiftUp(count++);
+		}
+
+		if (event.interruptNumber >= 0) {
+			cpu.Interrupt((byte)event.interruptNumber);
+		}
+		if (event.callback) {
+			event.callback(cpu, event.userData);
+		}
+	}
+}
+
+void Scheduler::Restart() {
+	int kept = 0;
+	for (int i = 0; i < count; i++) {
+		if (events[i].period != 0) {
+			events[kept] = events[i];
+			events[kept].deadline = events[i].period;
+			kept++;
+		}
+	}
+	count = kept;
+
+	for (int i = count / 2 - 1; i >= 0; i--) {
+		SiftDown(i);
+	}
+}
+
+void Scheduler::CopyFrom(Scheduler const& other) {
+	if (&other == this) return;
+	if (capacity < other.count) {
+		delete[] events;
+		events = new Event[other.capacity];
+		capacity = other.capacity;
+	}
+	for (int i = 0; i < other.count; i++) {
+		events[i] = other.events[i];
+	}
+	count = other.count;
+	nextId = other.nextId;
+}
+
+int Scheduler::Push(Event const& event) {
+	if (count >= capacity) {
+		int newCapacity = (capacity == 0) ? 8 : capacity * 2;
+		Event* newEvents = new Event[newCapacity];
+		for (int i = 0; i < count; i++) {
+			newEvents[i] = events[i];
+		}
+		delete[] events;
+		events = newEvents;
+		capacity = newCapacity;
+	}
+
+	int id = nextId++;
+	events[count] = event;
+	events[count].id = id;
+	SiftUp(count++);
+	return id;
+}
+
+void Scheduler::RemoveAt(int index) {
+	count--;
+	if (index == count) return;
+	events[index] = events[count];
+	SiftDown(index);
+	SiftUp(index);
+}
+
+void Scheduler::SiftUp(int index) {
+	while (index > 0) {
+		int parent = (index - 1) / 2;
+		if (events[parent].deadline <= events[index].deadline) break;
+		Event tmp = events[parent];
+		events[parent] = events[index];
+		events[index] = tmp;
+		index = parent;
+	}
+}
+
+void Scheduler::SiftDown(int index) {
+	while (true) {
+		int left = index * 2 + 1;
+		int right = left + 1;
+		int smallest = index;
+		if (left < count && events[left].deadline < events[smallest].deadline) smallest = left;
+		if (right < count && events[right].deadline < events[smallest].deadline) smallest = right;
+		if (smallest == index) break;
+		Event tmp = events[smallest];
+		events[smallest] = events[index];
+		events[index] = tmp;
+		index = smallest;
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include "Types.h"
+
+class CPU;
+
+typedef void (*EventCallback)(CPU& cpu, void* userData);
+
+//----------------------------------------------
+// Scheduler
+// Events keyed on the CPU's instruction counter, kept in a min-heap so the
+// CPU only has to look at the earliest deadline between batches of steps.
+// A period of 0 means the event fires once.
+//----------------------------------------------
+class Scheduler {
+public:
+	static const qword NEVER = ~0ull;
+
+	Scheduler();
+	~Scheduler();
+
+	int Schedule(qword deadline, qword period, EventCallback callback, void* userData = nullptr);
+	int ScheduleInterrupt(qword deadline, qword period, byte interruptNumber);
+	void Cancel(int id);
+
+	// Fires every event whose deadline is at or before "now"
+	void RunExpired(CPU& cpu, qword now);
+
+	// Drops one-shot events and re-arms periodic ones from instruction 0
+	void Restart();
+
+	// Replaces every event with a copy of the ones in "other", ids included
+	void CopyFrom(Scheduler const& other);
+
+	inline qword NextDeadline() const { return count > 0 ? events[0].deadline : NEVER; }
+	inline int Pending() const { return count; }
+
+private:
+	struct Event {
+		qword deadline;
+		qword period;
+		EventCallback callback;
+		void* userData;
+		int interruptNumber;
+		int id;
+	};
+
+	int Push(Event const& event);
+	void RemoveAt(int index);
+	void SiftUp(int index);
+	void SiftDown(int index);
+
+	Event* events;
+	int count;
+	int capacity;
+	int nextId;
+};
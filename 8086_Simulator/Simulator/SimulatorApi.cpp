@@ -0,0 +1,154 @@
+#include "SimulatorApi.h"
+#include "Executor.h"
+#include "SaveState.h"
+
+static_assert(SIM_PAGE_SIZE == GuestMemory::PAGE_SIZE && SIM_PAGE_COUNT == GuestMemory::PAGE_COUNT, "the API's pages are guest memory's pages");
+static_assert((int)SIM_EXIT_INVALID_INSTRUCTION == (int)CPU::ExitReason::INVALID_INSTRUCTION &&
+	(int)SIM_EXIT_WRITE_LIMIT == (int)CPU::ExitReason::WRITE_LIMIT, "exit reasons are passed straight through");
+static_assert(CPU::TIME_CHECK_INTERVAL == 65536, "the header documents how far a time limit can be overrun");
+
+struct SimMachine {
+	CPU cpu;
+
+	// The host's handlers, the CPU calls Dispatch for every interrupt that has one
+	struct Handler {
+		SimInterruptHandler handler;
+		void* userData;
+	};
+	Handler handlers[256];
+};
+
+static void Dispatch(CPU&, byte interruptNumber, void* userData) {
+	SimMachine* machine = (SimMachine*)userData;
+	SimMachine::Handler& handler = machine->handlers[interruptNumber];
+	handler.handler(machine, interruptNumber, handler.userData);
+}
+
+static word* RegisterField(CPU& cpu, SimRegister reg) {
+	switch (reg) {
+	case SIM_AX: return &cpu.ax;
+	case SIM_CX: return &cpu.cx;
+	case SIM_DX: return &cpu.dx;
+	case SIM_BX: return &cpu.bx;
+	case SIM_SP: return &cpu.sp;
+	case SIM_BP: return &cpu.bp;
+	case SIM_SI: return &cpu.si;
+	case SIM_DI: return &cpu.di;
+	case SIM_CS: return &cpu.cs;
+	case SIM_DS: return &cpu.ds;
+	case SIM_SS: return &cpu.ss;
+	case SIM_ES: return &cpu.es;
+	case SIM_IP: return &cpu.ip;
+	case SIM_FLAGS: return &cpu.flags;
+	}
+	return nullptr;
+}
+
+//----------------------------------------------
+// Lifetime
+//----------------------------------------------
+int sim_api_version(void) {
+	return SIM_API_VERSION;
+}
+
+SimMachine* sim_create(void) {
+	SimMachine* machine = new SimMachine();
+	machine->cpu.printErrors = false;
+	for (int i = 0; i < 256; i++) {
+		machine->handlers[i] = { nullptr, nullptr };
+	}
+	return machine;
+}
+
+void sim_destroy(SimMachine* machine) {
+	delete machine;
+}
+
+int sim_load(SimMachine* machine, const uint8_t* image, int size) {
+	// Checked here, the CPU would print and load what fits
+	if (image == nullptr || size < 0 || (CPU::LOAD_SEGMENT << 4) + size > CPU::MEMORY_SIZE) return -1;
+	machine->cpu.Reset();
+	machine->cpu.LoadProgram(Buffer{ (byte*)image, size });
+	return 0;
+}
+
+void sim_reset(SimMachine* machine) {
+	machine->cpu.Reset();
+}
+
+//----------------------------------------------
+// Running
+//----------------------------------------------
+uint64_t sim_run(SimMachine* machine, uint64_t instructions) {
+	qword start = machine->cpu.instructionCount;
+	machine->cpu.Run(instructions);
+	return machine->cpu.instructionCount - start;
+}
+
+void sim_set_limits(SimMachine* machine, uint64_t instructions, uint64_t microseconds, uint64_t memoryWrites) {
+	machine->cpu.limits = { instructions, microseconds, memoryWrites };
+}
+
+void sim_terminate(SimMachine* machine, uint8_t exitCode) {
+	machine->cpu.Terminate(exitCode);
+}
+
+int sim_halted(const SimMachine* machine) {
+	return machine->cpu.halted ? 1 : 0;
+}
+
+SimExitReason sim_exit_reason(const SimMachine* machine) {
+	return (SimExitReason)machine->cpu.exitReason;
+}
+
+int sim_exit_code(const SimMachine* machine) {
+	return machine->cpu.exitCode;
+}
+
+uint64_t sim_instruction_count(const SimMachine* machine) {
+	return machine->cpu.instructionCount;
+}
+
+//----------------------------------------------
+// State
+//----------------------------------------------
+uint16_t sim_get_register(const SimMachine* machine, SimRegister reg) {
+	word* field = RegisterField(const_cast<CPU&>(machine->cpu), reg);
+	return field ? *field : 0;
+}
+
+void sim_set_register(SimMachine* machine, SimRegister reg, uint16_t value) {
+	word* field = RegisterField(machine->cpu, reg);
+	if (field) *field = value;
+}
+
+void sim_read_memory(const SimMachine* machine, uint16_t address, uint8_t* out, int size) {
+	if (size > 0) machine->cpu.memory.Read(address, out, size);
+}
+
+void sim_write_memory(SimMachine* machine, uint16_t address, const uint8_t* data, int size) {
+	if (size > 0) machine->cpu.WriteMemory(address, data, size);
+}
+
+const uint8_t* sim_memory_page(const SimMachine* machine, int page) {
+	if (page < 0 || page >= SIM_PAGE_COUNT) return nullptr;
+	return machine->cpu.memory.PageData(page);
+}
+
+uint8_t* sim_memory_page_writable(SimMachine* machine, int page) {
+	if (page < 0 || page >= SIM_PAGE_COUNT) return nullptr;
+	return machine->cpu.WritablePage(page);
+}
+
+void sim_set_interrupt_handler(SimMachine* machine, uint8_t interruptNumber, SimInterruptHandler handler, void* userData) {
+	machine->handlers[interruptNumber] = { handler, userData };
+	machine->cpu.SetInterruptHandler(interruptNumber, handler ? Dispatch : nullptr, machine);
+}
+
+int sim_save_state(SimMachine* machine, const char* filename) {
+	return SaveState::Write(machine->cpu, filename) ? 0 : -1;
+}
+
+int sim_load_state(SimMachine* machine, const char* filename) {
+	return SaveState::Read(filename, machine->cpu) ? 0 : -1;
+}
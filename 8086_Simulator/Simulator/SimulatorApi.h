@@ -0,0 +1,110 @@
+#pragma once
+#include <stdint.h>
+
+//----------------------------------------------
+// SimulatorApi
+// C interface for hosts that embed the simulator instead of running the window or the command line.
+// A machine is an opaque handle and only plain C types cross the interface. Functions are only ever
+// added, so a host built against an older header keeps working, and SIM_API_VERSION counts the additions.
+// A machine is used from one thread at a time, different machines can run on different threads
+//----------------------------------------------
+#define SIM_API_VERSION 2
+
+// Empty for the static library. A shared build defines SIM_SHARED, and SIM_BUILDING while compiling the library itself
+#if defined(SIM_SHARED) && defined(_WIN32)
+#ifdef SIM_BUILDING
+#define SIM_API __declspec(dllexport)
+#else
+#define SIM_API __declspec(dllimport)
+#endif
+#elif defined(SIM_SHARED)
+#define SIM_API __attribute__((visibility("default")))
+#else
+#define SIM_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct SimMachine SimMachine;
+
+enum {
+	SIM_MEMORY_SIZE = 0x10000,
+	SIM_PAGE_SIZE = 256,
+	SIM_PAGE_COUNT = SIM_MEMORY_SIZE / SIM_PAGE_SIZE,
+};
+
+typedef enum SimRegister {
+	SIM_AX, SIM_CX, SIM_DX, SIM_BX,
+	SIM_SP, SIM_BP, SIM_SI, SIM_DI,
+	SIM_CS, SIM_DS, SIM_SS, SIM_ES,
+	SIM_IP, SIM_FLAGS,
+} SimRegister;
+
+typedef enum SimExitReason {
+	SIM_EXIT_NONE,
+	SIM_EXIT_END_OF_PROGRAM,
+	SIM_EXIT_TERMINATED,
+	SIM_EXIT_INVALID_INSTRUCTION,
+	SIM_EXIT_INSTRUCTION_LIMIT,
+	SIM_EXIT_TIME_LIMIT,
+	SIM_EXIT_WRITE_LIMIT,
+} SimExitReason;
+
+// Called when the guest executes "int n" for a number the host registered. It can read and write
+// registers and memory, and stop the machine with sim_terminate
+typedef void (*SimInterruptHandler)(SimMachine* machine, uint8_t interruptNumber, void* userData);
+
+// SIM_API_VERSION of the library actually linked, which can be newer than the header
+SIM_API int sim_api_version(void);
+
+// A machine with empty memory and no program. Invalid instructions only set the exit reason, nothing is printed
+SIM_API SimMachine* sim_create(void);
+SIM_API void sim_destroy(SimMachine* machine);
+
+// Resets the machine and loads "size" bytes at 0500:0000, where execution starts. The bytes are copied
+// and decoded up front. Returns 0, or -1 if the image doesn't fit in memory
+SIM_API int sim_load(SimMachine* machine, const uint8_t* image, int size);
+
+// Registers, memory and exit state back to zero. Interrupt handlers are kept
+SIM_API void sim_reset(SimMachine* machine);
+
+// Runs until "instructions" more have executed or the machine halts. Returns how many executed
+SIM_API uint64_t sim_run(SimMachine* machine, uint64_t instructions);
+
+// Since version 2. Halts the machine with the matching exit reason once it has executed "instructions", spent
+// "microseconds" in sim_run, or made "memoryWrites" writes to memory, each counted since the last sim_load or sim_reset.
+// 0 is no limit, the limits themselves are kept through sim_load and sim_reset. A time limit can be overrun by up to 65536 instructions, the others are exact
+SIM_API void sim_set_limits(SimMachine* machine, uint64_t instructions, uint64_t microseconds, uint64_t memoryWrites);
+
+SIM_API void sim_terminate(SimMachine* machine, uint8_t exitCode);
+SIM_API int sim_halted(const SimMachine* machine);
+SIM_API SimExitReason sim_exit_reason(const SimMachine* machine);
+SIM_API int sim_exit_code(const SimMachine* machine);
+SIM_API uint64_t sim_instruction_count(const SimMachine* machine);
+
+SIM_API uint16_t sim_get_register(const SimMachine* machine, SimRegister reg);
+SIM_API void sim_set_register(SimMachine* machine, SimRegister reg, uint16_t value);
+
+// Copies "size" bytes from or to "address", wrapping at the top of memory. Writes over code are picked up
+SIM_API void sim_read_memory(const SimMachine* machine, uint16_t address, uint8_t* out, int size);
+SIM_API void sim_write_memory(SimMachine* machine, uint16_t address, const uint8_t* data, int size);
+
+// Memory is SIM_PAGE_COUNT pages of SIM_PAGE_SIZE bytes that may be shared with other machines, so it's
+// reached a page at a time without copying. The read pointer is valid until the machine next runs or is written.
+// The writable pointer belongs to this machine alone and drops whatever was decoded from the page, it's valid
+// until the next sim_load, sim_reset or sim_load_state. Ask for it again after running before writing code through it
+SIM_API const uint8_t* sim_memory_page(const SimMachine* machine, int page);
+SIM_API uint8_t* sim_memory_page_writable(SimMachine* machine, int page);
+
+// A null handler stops handling "interruptNumber", the guest's "int" then does nothing
+SIM_API void sim_set_interrupt_handler(SimMachine* machine, uint8_t interruptNumber, SimInterruptHandler handler, void* userData);
+
+// Save states as written by --save-state. Return 0, or print why and return -1 if the file can't be written or read
+SIM_API int sim_save_state(SimMachine* machine, const char* filename);
+SIM_API int sim_load_state(SimMachine* machine, const char* filename);
+
+#ifdef __cplusplus
+}
+#endif
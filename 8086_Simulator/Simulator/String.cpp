@@ -1,41 +1,77 @@
 //----------------------------------------------
 // String
-// Internally refcounted to avoid copies yay
+// Internally refcounted to avoid copies yay. Short strings are stored inline
+// and copied instead, borrowed and interned strings aren't counted at all.
+// Safe to use from many threads as long as one String object isn't shared between them
 //----------------------------------------------
 #include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
+#include <mutex>
+#include <new>
 #include "String.h"
 
 String::String() {
-	refCount = new int(1);
+	// Empty strings are common enough to not be worth an allocation
+	refCount = nullptr;
 	length = 0;
-	data = new char[1];
-	data[0] = '\0';
+	data = (char*)"";
 }
 
-String::String(const char* str) {
-	refCount = new int(1);
-	length = 0;
-	while (str[length] != '\0') {
-		length++;
+String String::Borrow(const char* str) {
+	String borrowed;
+	borrowed.data = (char*)str;
+	borrowed.length = (int)strlen(str);
+	return borrowed;
+}
+
+void String::Allocate(int length) {
+	this->length = length;
+	if (length < SMALL_CAPACITY) {
+		refCount = nullptr;
+		data = small;
+		return;
 	}
-	data = new char[length + 1];
-	for (int i = 0; i <= length; i++) {
-		data[i] = str[i];
+
+	// One allocation for the count and the characters
+	char* block = new char[sizeof(std::atomic<int>) + length + 1];
+	refCount = new (block) std::atomic<int>(1);
+	data = block + sizeof(std::atomic<int>);
+}
+
+void String::Release() {
+	if (refCount == nullptr) return;
+
+	if (refCount->fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		delete[] (char*)refCount;
 	}
 }
 
+String::String(const char* str) {
+	Allocate((int)strlen(str));
+	memcpy(data, str, length + 1);
+}
+
+String::String(int length) {
+	Allocate(length);
+	data[length] = '\0';
+}
+
 void String::Set(String other) {
-	(*refCount)--;
-	if (*refCount == 0) {
-		delete[] data;
-		delete refCount;
+	if (other.data == other.small) {
+		Release();
+		length = other.length;
+		refCount = nullptr;
+		data = small;
+		memcpy(small, other.small, length + 1);
+		return;
 	}
+
+	Release();
 	data = other.data;
 	length = other.length;
 	refCount = other.refCount;
-	(*refCount)++;
+	if (refCount) refCount->fetch_add(1, std::memory_order_relaxed);
 }
 
 void String::operator=(const String& other) {
@@ -43,22 +79,24 @@ void String::operator=(const String& other) {
 }
 
 String::String(const String& other) {
-	data = other.data;
 	length = other.length;
 	refCount = other.refCount;
-	(*refCount)++;
+	if (other.data == other.small) {
+		data = small;
+		memcpy(small, other.small, length + 1);
+		return;
+	}
+
+	data = other.data;
+	if (refCount) refCount->fetch_add(1, std::memory_order_relaxed);
 }
 
 String::~String() {
-	(*refCount)--;
-	if (*refCount == 0) {
-		delete[] data;
-		delete refCount;
-	}
+	Release();
 }
 
 String String::Clone() {
-	String str(new char[length + 1]);
+	String str(length);
 	for (int i = 0; i <= length; i++) {
 		str.data[i] = data[i];
 	}
@@ -80,20 +118,66 @@ bool String::Equals(const char* other) {
 	return data[i] == '\0' && other[i] == '\0';
 }
 
-String String::Format(String format, ...) {
+String String::Format(const char* format, ...) {
+	// Most results fit on the stack, so vsnprintf only has to run twice for long ones
+	char text[256];
 	va_list args;
 	va_start(args, format);
-
-	int length = vsnprintf(nullptr, 0, format.c_str(), args);
+	int length = vsnprintf(text, sizeof(text), format, args);
 	va_end(args);
 
 	if (length <= 0) {
-		return String("");
+		return String();
+	}
+	if (length < (int)sizeof(text)) {
+		return String(text);
 	}
 
-	String str(new char[length + 1]);
+	String str(length);
 	va_start(args, format);
-	vsnprintf(str.data, str.length + 1, format.c_str(), args);
+	vsnprintf(str.data, str.length + 1, format, args);
 	va_end(args);
 	return str;
-}
\ No newline at end of file
+}
+
+int String::FormatTo(char* out, int capacity, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(out, capacity, format, args);
+	va_end(args);
+	return length;
+}
+
+//----------------------------------------------
+// Interning
+// Open addressing on a fixed table. Entries are never removed, which is what makes
+// handing out borrowed Strings to them safe
+//----------------------------------------------
+static const int INTERN_TABLE_SIZE = 1024;
+static const char* internTable[INTERN_TABLE_SIZE];
+static std::mutex internLock;
+
+String String::Intern(const char* str) {
+	unsigned int hash = 2166136261u;
+	for (const char* c = str; *c; c++) {
+		hash = (hash ^ (unsigned char)*c) * 16777619u;
+	}
+
+	std::lock_guard<std::mutex> lock(internLock);
+	for (int probe = 0; probe < INTERN_TABLE_SIZE; probe++) {
+		const char*& slot = internTable[(hash + probe) & (INTERN_TABLE_SIZE - 1)];
+		if (slot == nullptr) {
+			int length = (int)strlen(str);
+			char* copy = new char[length + 1];
+			memcpy(copy, str, length + 1);
+			slot = copy;
+			return Borrow(slot);
+		}
+		if (strcmp(slot, str) == 0) {
+			return Borrow(slot);
+		}
+	}
+
+	// Table is full, fall back to a plain counted copy
+	return String(str);
+}
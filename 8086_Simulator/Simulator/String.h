@@ -1,4 +1,5 @@
 #pragma once
+#include <atomic>
 
 class String {
 public:
@@ -6,7 +7,18 @@ public:
 	String(const char* str);
 	String(const String& other);
 	~String();
-	static String Format(String format, ...);
+	static String Format(const char* format, ...);
+
+	// Same as Format but writes into "out", cut off at "capacity". Returns the untruncated length like snprintf
+	static int FormatTo(char* out, int capacity, const char* format, ...);
+
+	// Wraps characters owned by someone else (a literal, an Arena) without copying.
+	// Copies of the result share the pointer too, so "str" has to outlive all of them
+	static String Borrow(const char* str);
+
+	// One shared copy per distinct text, kept for the life of the process.
+	// Meant for the small fixed vocabulary of names (registers, mnemonics), not arbitrary text
+	static String Intern(const char* str);
 
 	const char* c_str() const;
 	void operator=(const String& other);
@@ -18,6 +30,18 @@ public:
 	char* data;
 
 private:
-	int* refCount;
+	// Strings shorter than this live inside the object and never touch the heap
+	static const int SMALL_CAPACITY = 24;
+
+	// Uninitialized storage for "length" characters plus the terminator
+	explicit String(int length);
+
+	void Allocate(int length);
+	void Release();
+
+	// Heap strings only. Shares the allocation with the characters that follow it, and is atomic
+	// so copies of one String can be handed to and dropped on different threads
+	std::atomic<int>* refCount;
 	int length;
-};
\ No newline at end of file
+	char small[SMALL_CAPACITY];
+};
@@ -2,75 +2,49 @@
 #include <stdio.h>
 #include "Executor.h"
 
-String RegisterToString(Register reg) {
-	static String names[] = {
-		"al", "cl", "dl", "bl",
-		"ah", "ch", "dh", "bh",
-		"ax", "cx", "dx", "bx",
-		"sp", "bp", "si", "di",
-		"cs", "ds", "ss", "es",
-		"IP", "FLAGS", "INVALID"
-	};
-	String strReg = names[(int)reg];
-	return strReg;
-}
-
-String EffectiveAddressToString(EffectiveAddress addr) {
-	static String effectiveAddresses[] = {
-		"[bx+si]",
-		"[bx+di]",
-		"[bp+si]",
-		"[bp+di]",
-		"[si]",
-		"[di]",
-		"[bp]",
-		"[bx]",
-		"[DIRECT ADDRESS]",
-		"INVALID"
-	};
-	return effectiveAddresses[(int)addr];
-}
+//----------------------------------------------
+// Names
+// Plain tables, so formatting an instruction doesn't build any Strings on the way
+//----------------------------------------------
+static const char* registerNames[] = {
+	"al", "cl", "dl", "bl",
+	"ah", "ch", "dh", "bh",
+	"ax", "cx", "dx", "bx",
+	"sp", "bp", "si", "di",
+	"cs", "ds", "ss", "es",
+	"IP", "FLAGS", "INVALID"
+};
 
-String EffectiveAddressWithOffsetToString(EffectiveAddress addr, int offset) {
-	if (offset == 0) {
-		return EffectiveAddressToString(addr);
-	}
-
-	static String effectiveAddresses[] = {
-		"[bx+si%s%i]",
-		"[bx+di%s%i]",
-		"[bp+si%s%i]",
-		"[bp+di%s%i]",
-		"[si%s%i]",
-		"[di%s%i]",
-		"[bp%s%i]",
-		"[bx%s%i]",
-		"[%i]", // Direct address
-		"INVALID"
-	};
+static const char* effectiveAddressNames[] = {
+	"[bx+si]",
+	"[bx+di]",
+	"[bp+si]",
+	"[bp+di]",
+	"[si]",
+	"[di]",
+	"[bp]",
+	"[bx]",
+	"[DIRECT ADDRESS]",
+	"INVALID"
+};
 
-	if (offset < 0) {
-		return String::Format(effectiveAddresses[(int)addr], "-", -offset);
-	}
+// Everything up to the displacement, which is followed by the closing bracket
+static const char* effectiveAddressOpenings[] = {
+	"[bx+si",
+	"[bx+di",
+	"[bp+si",
+	"[bp+di",
+	"[si",
+	"[di",
+	"[bp",
+	"[bx",
+	"[", // Direct address
+	"INVALID"
+};
 
-	if (addr == EffectiveAddress::DIRECT_ADDRESS) {
-		return String::Format(effectiveAddresses[(int)addr], offset);
-	}
-
-	return String::Format(effectiveAddresses[(int)addr], "+", offset);
-}
-
-String DataSizeToString(ExplicitDataSize s) {
-	if (s == ExplicitDataSize::BYTE) {
-		return "byte ";
-	}
-	else {
-		return "word ";
-	}
-}
-
-String ConditionToString(InstructionJump::Condition cond) {
+const char* ConditionName(InstructionJump::Condition cond) {
 	switch (cond) {
+	case InstructionJump::JumpAlways: return "jmp";
 	case InstructionJump::JumpOnEqualOrZero: return "je";
 	case InstructionJump::JumpOnLess: return "jl";
 	case InstructionJump::JumpOnLessOrEqual: return "jle";
@@ -95,24 +69,161 @@ String ConditionToString(InstructionJump::Condition cond) {
 	return "";
 }
 
-String OperandToString(Operand const& o) {
-	String prefix = "";
+//----------------------------------------------
+// Formatting into a caller's buffer
+// Output is cut off at "capacity", the return value is the untruncated length like snprintf.
+// Built by hand rather than with printf, formatting is most of the cost of a decode
+//----------------------------------------------
+struct TextWriter {
+	char* out;
+	int capacity;
+	int length;
+
+	TextWriter(char* out, int capacity) : out(out), capacity(capacity), length(0) {}
+
+	void Append(const char* text) {
+		for (; *text; text++) {
+			if (length < capacity - 1) out[length] = *text;
+			length++;
+		}
+	}
+
+	void AppendInt(int value) {
+		char digits[12];
+		int count = 0;
+		unsigned int magnitude = (value < 0) ? 0u - (unsigned int)value : (unsigned int)value;
+		do {
+			digits[count++] = (char)('0' + magnitude % 10);
+			magnitude /= 10;
+		} while (magnitude);
+		if (value < 0) digits[count++] = '-';
+
+		while (count > 0) {
+			if (length < capacity - 1) out[length] = digits[count - 1];
+			length++;
+			count--;
+		}
+	}
+
+	int Finish() {
+		if (capacity > 0) out[(length < capacity) ? length : capacity - 1] = '\0';
+		return length;
+	}
+};
+
+void WriteEffectiveAddress(TextWriter& writer, EffectiveAddress addr, int offset) {
+	if (offset == 0 || addr == EffectiveAddress::INVALID) {
+		writer.Append(effectiveAddressNames[(int)addr]);
+		return;
+	}
+
+	writer.Append(effectiveAddressOpenings[(int)addr]);
+	if (offset < 0) {
+		writer.Append("-");
+		writer.AppendInt(-offset);
+	}
+	else {
+		if (addr != EffectiveAddress::DIRECT_ADDRESS) writer.Append("+");
+		writer.AppendInt(offset);
+	}
+	writer.Append("]");
+}
+
+void WriteOperand(TextWriter& writer, Operand const& o) {
+	int start = writer.length;
 	switch (o.dataSize) {
-	case ExplicitDataSize::WORD: prefix = "word "; break;
-	case ExplicitDataSize::BYTE: prefix = "byte "; break;
+	case ExplicitDataSize::WORD: writer.Append("word "); break;
+	case ExplicitDataSize::BYTE: writer.Append("byte "); break;
 	}
 
-	String operation = "";
 	switch (o.type) {
-	case Operand::Type::REGISTER: operation = RegisterToString(o.reg); break;
-	case Operand::Type::MEMORY_LOC: operation = EffectiveAddressWithOffsetToString(o.mem.effectiveAddress, o.mem.memoryOffset); break;
-	case Operand::Type::IMMEDIATE: operation = String::Format("%i", o.immediate); break;
+	case Operand::Type::REGISTER: writer.Append(registerNames[(int)o.reg]); break;
+	case Operand::Type::MEMORY_LOC: WriteEffectiveAddress(writer, o.mem.effectiveAddress, o.mem.memoryOffset); break;
+	case Operand::Type::IMMEDIATE: writer.AppendInt(o.immediate); break;
 	case Operand::Type::NONE:
 		printf("OPERATION HAS NO TYPE\n");
-		return "";
+		writer.length = start;
+		break;
+	}
+}
+
+void WriteTwoOperands(TextWriter& writer, const char* mnemonic, Operand const& dest, Operand const& source) {
+	writer.Append(mnemonic);
+	writer.Append(" ");
+	WriteOperand(writer, dest);
+	writer.Append(", ");
+	WriteOperand(writer, source);
+}
+
+int FormatEffectiveAddress(EffectiveAddress addr, int offset, char* out, int capacity) {
+	TextWriter writer(out, capacity);
+	WriteEffectiveAddress(writer, addr, offset);
+	return writer.Finish();
+}
+
+int FormatOperand(Operand const& o, char* out, int capacity) {
+	TextWriter writer(out, capacity);
+	WriteOperand(writer, o);
+	return writer.Finish();
+}
+
+int FormatInstruction(InstructionGeneric const& inst, char* out, int capacity) {
+	TextWriter writer(out, capacity);
+	switch (inst.type) {
+	case InstructionType::MOVE: WriteTwoOperands(writer, "mov", inst.move.dest, inst.move.source); break;
+	case InstructionType::ADD: WriteTwoOperands(writer, "add", inst.add.dest, inst.add.source); break;
+	case InstructionType::SUB: WriteTwoOperands(writer, "sub", inst.sub.dest, inst.sub.source); break;
+	case InstructionType::COMPARE: WriteTwoOperands(writer, "cmp", inst.compare.dest, inst.compare.source); break;
+	case InstructionType::JUMP:
+		writer.Append(ConditionName(inst.jump.condition));
+		writer.Append(" ");
+		writer.AppendInt(inst.jump.instructionIndex);
+		break;
+	case InstructionType::INTERRUPT:
+		writer.Append("int ");
+		writer.AppendInt(inst.interrupt.interruptNumber);
+		break;
+	default:
+		writer.Append("INVALID INSTRUCTION STRING");
+		break;
+	}
+	return writer.Finish();
+}
+
+//----------------------------------------------
+// Strings
+//----------------------------------------------
+String RegisterToString(Register reg) {
+	return String::Intern(registerNames[(int)reg]);
+}
+
+String EffectiveAddressToString(EffectiveAddress addr) {
+	return String::Intern(effectiveAddressNames[(int)addr]);
+}
+
+String EffectiveAddressWithOffsetToString(EffectiveAddress addr, int offset) {
+	char text[32];
+	FormatEffectiveAddress(addr, offset, text, sizeof(text));
+	return text;
+}
+
+String DataSizeToString(ExplicitDataSize s) {
+	if (s == ExplicitDataSize::BYTE) {
+		return String::Intern("byte ");
 	}
+	else {
+		return String::Intern("word ");
+	}
+}
 
-	return String::Format("%s%s", prefix.c_str(), operation.c_str());
+String ConditionToString(InstructionJump::Condition cond) {
+	return String::Intern(ConditionName(cond));
+}
+
+String OperandToString(Operand const& o) {
+	char text[64];
+	FormatOperand(o, text, sizeof(text));
+	return text;
 }
 
 void PrintMove(InstructionMove const& move) {
@@ -136,15 +247,9 @@ void PrintJump(InstructionJump const& jump) {
 }
 
 String InstructionToString(InstructionGeneric const& inst) {
-	switch (inst.type) {
-	case InstructionType::MOVE: return String::Format("mov %s, %s", OperandToString(inst.move.dest).c_str(), OperandToString(inst.move.source).c_str());
-	case InstructionType::ADD: return String::Format("add %s, %s", OperandToString(inst.add.dest).c_str(), OperandToString(inst.add.source).c_str());
-	case InstructionType::SUB: return String::Format("sub %s, %s", OperandToString(inst.sub.dest).c_str(), OperandToString(inst.sub.source).c_str());
-	case InstructionType::COMPARE: return String::Format("cmp %s, %s", OperandToString(inst.compare.dest).c_str(), OperandToString(inst.compare.source).c_str());
-	case InstructionType::JUMP: return String::Format("%s %i", ConditionToString(inst.jump.condition).c_str(), inst.jump.instructionIndex);
-	case InstructionType::INTERRUPT: return String::Format("int %i", inst.interrupt.interruptNumber);
-	}
-	return "INVALID INSTRUCTION STRING";
+	char text[128];
+	FormatInstruction(inst, text, sizeof(text));
+	return text;
 }
 
 void PrintInstruction(InstructionGeneric& instruction) {
@@ -17,4 +17,9 @@ void PrintJump(InstructionJump const& jump);
 
 void PrintInstruction(InstructionGeneric& instruction);
 String InstructionToString(InstructionGeneric const& inst);
-String FlagsToString(word flags);
\ No newline at end of file
+String FlagsToString(word flags);
+
+// Writes into "out" without allocating, returns the length like snprintf
+int FormatOperand(Operand const& o, char* out, int capacity);
+int FormatInstruction(InstructionGeneric const& inst, char* out, int capacity);
+const char* ConditionName(InstructionJump::Condition cond);
\ No newline at end of file
@@ -0,0 +1,124 @@
+#include "ThreadPool.h"
+
+// Index of the worker running on this thread, -1 on threads outside the pool
+static thread_local int currentWorker = -1;
+static thread_local ThreadPool* currentPool = nullptr;
+
+ThreadPool::ThreadPool(int threadCount)
+	: nextWorker(0), queued(0), pending(0), stopping(false)
+{
+	if (threadCount <= 0) {
+		threadCount = (int)std::thread::hardware_concurrency();
+		if (threadCount <= 0) threadCount = 1;
+	}
+
+	workerCount = threadCount;
+	workers = new Worker[workerCount];
+	for (int i = 0; i < workerCount; i++) {
+		workers[i].capacity = 64;
+		workers[i].tasks = new Task[workers[i].capacity];
+		workers[i].head = 0;
+		workers[i].count = 0;
+	}
+	for (int i = 0; i < workerCount; i++) {
+		workers[i].thread = std::thread(&ThreadPool::WorkerLoop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	Wait();
+	{
+		std::lock_guard<std::mutex> guard(sleepLock);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (int i = 0; i < workerCount; i++) {
+		workers[i].thread.join();
+		delete[] workers[i].tasks;
+	}
+	delete[] workers;
+}
+
+void ThreadPool::Push(Worker& worker, Task task) {
+	std::lock_guard<std::mutex> guard(worker.lock);
+	if (worker.count == worker.capacity) {
+		Task* grown = new Task[worker.capacity * 2];
+		for (int i = 0; i < worker.count; i++) {
+			grown[i] = worker.tasks[(worker.head + i) % worker.capacity];
+		}
+		delete[] worker.tasks;
+		worker.tasks = grown;
+		worker.head = 0;
+		worker.capacity *= 2;
+	}
+	worker.tasks[(worker.head + worker.count) % worker.capacity] = task;
+	worker.count++;
+}
+
+bool ThreadPool::PopBack(Worker& worker, Task& task) {
+	std::lock_guard<std::mutex> guard(worker.lock);
+	if (worker.count == 0) return false;
+	worker.count--;
+	task = worker.tasks[(worker.head + worker.count) % worker.capacity];
+	return true;
+}
+
+bool ThreadPool::PopFront(Worker& worker, Task& task) {
+	std::lock_guard<std::mutex> guard(worker.lock);
+	if (worker.count == 0) return false;
+	task = worker.tasks[worker.head];
+	worker.head = (worker.head + 1) % worker.capacity;
+	worker.count--;
+	return true;
+}
+
+void ThreadPool::Submit(TaskFunction function, void* userData) {
+	pending++;
+
+	int index = (currentPool == this) ? currentWorker : (nextWorker++ % workerCount);
+	Push(workers[index], { function, userData });
+	{
+		// Taken so a worker can't check "queued" and go to sleep between the increment and the notify
+		std::lock_guard<std::mutex> guard(sleepLock);
+		queued++;
+	}
+	wake.notify_one();
+}
+
+bool ThreadPool::FindTask(int index, Task& task) {
+	if (PopBack(workers[index], task)) return true;
+
+	for (int i = 1; i < workerCount; i++) {
+		if (PopFront(workers[(index + i) % workerCount], task)) return true;
+	}
+	return false;
+}
+
+void ThreadPool::WorkerLoop(int index) {
+	currentWorker = index;
+	currentPool = this;
+
+	while (true) {
+		Task task;
+		if (FindTask(index, task)) {
+			queued--;
+			task.function(task.userData);
+
+			if (--pending == 0) {
+				std::lock_guard<std::mutex> guard(sleepLock);
+				idle.notify_all();
+			}
+			continue;
+		}
+
+		std::unique_lock<std::mutex> guard(sleepLock);
+		wake.wait(guard, [this] { return stopping || queued > 0; });
+		if (stopping && queued == 0) return;
+	}
+}
+
+void ThreadPool::Wait() {
+	std::unique_lock<std::mutex> guard(sleepLock);
+	idle.wait(guard, [this] { return pending == 0; });
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+typedef void (*TaskFunction)(void* userData);
+
+//----------------------------------------------
+// ThreadPool
+// Every worker has its own queue. Tasks submitted from a worker go on its own
+// queue, others are dealt out round robin. A worker takes the newest task from
+// its own queue and, when that runs dry, steals the oldest from someone else's
+//----------------------------------------------
+class ThreadPool {
+public:
+	// 0 uses every hardware thread
+	explicit ThreadPool(int threadCount = 0);
+	~ThreadPool();
+
+	void Submit(TaskFunction function, void* userData);
+
+	// Blocks until every submitted task has finished
+	void Wait();
+
+	int ThreadCount() const { return workerCount; }
+
+private:
+	ThreadPool(const ThreadPool&) = delete;
+	void operator=(const ThreadPool&) = delete;
+
+	struct Task {
+		TaskFunction function;
+		void* userData;
+	};
+
+	// Ring buffer, the owner works at the back and thieves take from the front
+	struct Worker {
+		std::mutex lock;
+		Task* tasks;
+		int head;
+		int count;
+		int capacity;
+		std::thread thread;
+	};
+
+	void Push(Worker& worker, Task task);
+	bool PopBack(Worker& worker, Task& task);
+	bool PopFront(Worker& worker, Task& task);
+	bool FindTask(int index, Task& task);
+	void WorkerLoop(int index);
+
+	Worker* workers;
+	int workerCount;
+	std::atomic<int> nextWorker;
+
+	// Tasks sitting in queues, and tasks submitted but not finished yet
+	std::atomic<int> queued;
+	std::atomic<int> pending;
+
+	std::mutex sleepLock;
+	std::condition_variable wake;
+	std::condition_variable idle;
+	bool stopping;
+};
@@ -4,6 +4,7 @@
 
 typedef unsigned char byte;
 typedef unsigned short word;
+typedef unsigned long long qword;
 
 //----------------------------------------------
 // Registers
@@ -110,9 +111,11 @@ enum class ExplicitDataSize {
 	WORD
 };
 
+// Address and Operand only ever live inside InstructionGeneric's union, which zero initializes them.
+// They have no default member initializers, those would make the unions ill-formed for GCC and Clang
 struct Address {
-	EffectiveAddress effectiveAddress = EffectiveAddress::INVALID;
-	word memoryOffset = 0;
+	EffectiveAddress effectiveAddress;
+	word memoryOffset;
 };
 
 struct Operand {
@@ -123,10 +126,10 @@ struct Operand {
 		IMMEDIATE
 	};
 
-	Type type = Type::NONE;
-	ExplicitDataSize dataSize = ExplicitDataSize::NONE;
+	Type type;
+	ExplicitDataSize dataSize;
 	union {
-		Register reg = Register::INVALID;
+		Register reg;
 		Address mem;
 		word immediate;
 	};
@@ -199,6 +202,9 @@ struct InstructionInterrupt {
 struct InstructionGeneric {
 	InstructionType type = InstructionType::NONE;
 	int index;
+	int address;
+	int size;
+	bool isWide;
 	String asString;
 	union {
 		InstructionMove move{};
@@ -0,0 +1,250 @@
+#include "Workloads.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "BatchRunner.h"
+#include "BufferedWriter.h"
+#include "DosServices.h"
+
+namespace Workloads {
+	//----------------------------------------------
+	// Reading results
+	// Expected results and baselines are files this program wrote, one flat JSON object per line.
+	// Values are found by key, so a line can have keys that aren't read and they can come in any order
+	//----------------------------------------------
+	bool ReadLines(const char* filename, List<String>& lines) {
+		FILE* file = fopen(filename, "rb");
+		if (file == nullptr) {
+			printf("Error: Could not open %s\n", filename);
+			return false;
+		}
+		char line[4096];
+		while (fgets(line, sizeof(line), file)) {
+			if (line[0] == '{') lines.Add(line);
+		}
+		fclose(file);
+		return true;
+	}
+
+	// The text after "key": on the line, or nullptr
+	const char* FindValue(const char* line, const char* key) {
+		char pattern[64];
+		int length = String::FormatTo(pattern, sizeof(pattern), "\"%s\": ", key);
+		const char* found = strstr(line, pattern);
+		return found ? found + length : nullptr;
+	}
+
+	bool ReadNumber(const char* line, const char* key, double& value) {
+		const char* text = FindValue(line, key);
+		if (text == nullptr) return false;
+		char* end;
+		value = strtod(text, &end);
+		return end != text;
+	}
+
+	// Takes the quotes off and undoes the escapes BatchRunner::WriteJsonString makes
+	bool ReadString(const char* line, const char* key, char* out, int capacity) {
+		const char* text = FindValue(line, key);
+		if (text == nullptr || *text != '"') return false;
+		int length = 0;
+		for (text++; *text && *text != '"'; text++) {
+			if (*text == '\\' && text[1]) text++;
+			if (length == capacity - 1) return false;
+			out[length++] = *text;
+		}
+		out[length] = '\0';
+		return *text == '"';
+	}
+
+	//----------------------------------------------
+	// Checking
+	//----------------------------------------------
+	// The expected line is the one for the same job, as long as it names the same program
+	const char* FindExpected(List<String>& expected, int jobIndex, BatchRunner::Job& job) {
+		char program[1024];
+		for (int i = 0; i < expected.Size(); i++) {
+			const char* line = expected[i].c_str();
+			double index;
+			if (!ReadNumber(line, "job", index) || (int)index != jobIndex) continue;
+			if (!ReadString(line, "program", program, sizeof(program)) || !job.programFilename.Equals(program)) return nullptr;
+			return line;
+		}
+		return nullptr;
+	}
+
+	// Prints every value that differs, returns true if none did
+	bool CheckState(const char* expected, BatchRunner::Job& job) {
+		const char* name = job.programFilename.c_str();
+		BatchRunner::Result& r = job.result;
+		bool same = true;
+
+		char text[64];
+		const char* exitName = BatchRunner::ExitReasonName(r);
+		if (!ReadString(expected, "exit", text, sizeof(text)) || strcmp(text, exitName) != 0) {
+			printf("Error: %s exited with %s, expected %s\n", name, exitName, FindValue(expected, "exit") ? text : "nothing");
+			same = false;
+		}
+
+		struct Value {
+			const char* key;
+			qword actual;
+		};
+		const Value values[] = {
+			{ "exit_code", (qword)r.exitCode }, { "steps", r.steps },
+			{ "ax", r.ax }, { "bx", r.bx }, { "cx", r.cx }, { "dx", r.dx },
+			{ "sp", r.sp }, { "bp", r.bp }, { "si", r.si }, { "di", r.di },
+			{ "cs", r.cs }, { "ds", r.ds }, { "ss", r.ss }, { "es", r.es },
+			{ "ip", r.ip }, { "flags", r.flags },
+		};
+		for (Value const& value : values) {
+			double number = 0;
+			if (!ReadNumber(expected, value.key, number) || (qword)number != value.actual) {
+				printf("Error: %s ended with %s = %llu, expected %s\n", name, value.key, (unsigned long long)value.actual,
+					FindValue(expected, value.key) ? String::Format("%llu", (unsigned long long)number).c_str() : "nothing");
+				same = false;
+			}
+		}
+
+		char hash[32];
+		String::FormatTo(hash, sizeof(hash), "%016llx", (unsigned long long)r.memoryHash);
+		if (!ReadString(expected, "memory_hash", text, sizeof(text)) || strcmp(text, hash) != 0) {
+			printf("Error: %s ended with memory hash %s, expected %s\n", name, hash, FindValue(expected, "memory_hash") ? text : "nothing");
+			same = false;
+		}
+		return same;
+	}
+
+	// The baseline line for a workload, or nullptr if it has none
+	const char* FindBaseline(List<String>& baseline, const char* name) {
+		char workload[1024];
+		for (int i = 0; i < baseline.Size(); i++) {
+			const char* line = baseline[i].c_str();
+			if (ReadString(line, "workload", workload, sizeof(workload)) && strcmp(workload, name) == 0) return line;
+		}
+		return nullptr;
+	}
+
+	//----------------------------------------------
+	// Running
+	//----------------------------------------------
+	double NowSeconds() {
+		using namespace std::chrono;
+		return duration<double>(steady_clock::now().time_since_epoch()).count();
+	}
+
+	// Best time of each workload over the repetitions. They take turns, so a stretch where the machine is busy
+	// costs every workload one repetition rather than one workload all of them. Every workload keeps its own CPU,
+	// which has its instruction cache filled from the first repetition on, as a long run would
+	void TimeWorkloads(BatchRunner::Batch& batch, int repetitions, List<double>& best) {
+		CPU* cpus = new CPU[batch.jobCount];
+		BufferedWriter discard(nullptr, 256);
+		for (int rep = 0; rep < repetitions; rep++) {
+			for (int i = 0; i < batch.jobCount; i++) {
+				BatchRunner::Job& job = batch.jobs[i];
+				BatchRunner::PrepareJob(job, cpus[i]);
+				Dos::Install(cpus[i], discard);
+				double start = NowSeconds();
+				cpus[i].Run(job.stepLimit);
+				double elapsed = NowSeconds() - start;
+				if (rep == 0) best.Add(elapsed);
+				else if (elapsed < best[i]) best[i] = elapsed;
+			}
+		}
+		for (int i = 0; i < batch.jobCount; i++) {
+			BatchRunner::FinishJob(batch.jobs[i], cpus[i]);
+		}
+		delete[] cpus;
+	}
+
+	bool Run(Options const& options, Result& result) {
+		result = { 0, 0, 0 };
+
+		// Every file is read before the output is opened, which may be one of them
+		BatchRunner::Batch batch;
+		if (!BatchRunner::ReadManifest(options.manifestFilename, batch)) return false;
+		List<String> expected;
+		if (options.expectedFilename && !ReadLines(options.expectedFilename, expected)) return false;
+		List<String> baseline;
+		if (options.baselineFilename && !ReadLines(options.baselineFilename, baseline)) return false;
+
+		FILE* file = stdout;
+		if (options.outputFilename) {
+			file = fopen(options.outputFilename, "wb");
+			if (file == nullptr) {
+				printf("Error: Could not open %s for writing\n", options.outputFilename);
+				return false;
+			}
+		}
+
+		List<double> times;
+		TimeWorkloads(batch, options.repetitions < 1 ? 1 : options.repetitions, times);
+
+		// Errors are printed next to the line of the workload they're about
+		const int lineCapacity = 512;
+		for (int i = 0; i < batch.jobCount; i++) {
+			BatchRunner::Job& job = batch.jobs[i];
+			const char* name = job.programFilename.c_str();
+			double seconds = times[i];
+			qword instructions = job.result.steps;
+			double nsPerInstruction = instructions ? seconds * 1e9 / instructions : 0;
+			double mips = seconds > 0 ? instructions / seconds / 1e6 : 0;
+			result.workloads++;
+
+			const char* state = "unchecked";
+			if (options.expectedFilename) {
+				const char* line = FindExpected(expected, i, job);
+				if (line == nullptr) printf("Error: %s has no expected result for job %i\n", options.expectedFilename, i);
+				bool same = line && CheckState(line, job);
+				if (!same) result.stateMismatches++;
+				state = same ? "ok" : "differs";
+			}
+
+			// A tolerance on the baseline line overrides --tolerance and is written out again, so it survives
+			// the output becoming the next baseline. Without one the line carries none, and --tolerance applies
+			double tolerance = options.tolerance;
+			bool lineTolerance = false;
+			double baselineNs = 0;
+			const char* status = "new";
+			const char* baselineLine = options.baselineFilename ? FindBaseline(baseline, name) : nullptr;
+			if (baselineLine && ReadNumber(baselineLine, "ns_per_instruction", baselineNs) && baselineNs > 0) {
+				lineTolerance = ReadNumber(baselineLine, "tolerance", tolerance);
+				double change = (nsPerInstruction - baselineNs) * 100 / baselineNs;
+				status = "ok";
+				if (change > tolerance) {
+					printf("Error: %s takes %.3f ns per instruction, %.1f%% slower than the baseline's %.3f\n", name, nsPerInstruction, change, baselineNs);
+					result.regressions++;
+					status = "slower";
+				}
+				else if (change < -tolerance) {
+					status = "faster";
+				}
+			}
+
+			// Flushed a line at a time, so the errors stay next to it
+			BufferedWriter output(file, 4096);
+			char* out = output.Reserve(lineCapacity);
+			output.Commit(String::FormatTo(out, lineCapacity, "{\"workload\": "));
+			BatchRunner::WriteJsonString(output, name);
+			out = output.Reserve(lineCapacity);
+			output.Commit(String::FormatTo(out, lineCapacity, ", \"instructions\": %llu, \"mips\": %.3f, \"ns_per_instruction\": %.3f",
+				(unsigned long long)instructions, mips, nsPerInstruction));
+			if (lineTolerance) {
+				out = output.Reserve(lineCapacity);
+				output.Commit(String::FormatTo(out, lineCapacity, ", \"tolerance\": %.1f", tolerance));
+			}
+			out = output.Reserve(lineCapacity);
+			output.Commit(String::FormatTo(out, lineCapacity, ", \"state\": \"%s\"", state));
+			if (baselineLine && baselineNs > 0) {
+				out = output.Reserve(lineCapacity);
+				output.Commit(String::FormatTo(out, lineCapacity, ", \"baseline_ns_per_instruction\": %.3f, \"change_percent\": %.1f",
+					baselineNs, (nsPerInstruction - baselineNs) * 100 / baselineNs));
+			}
+			out = output.Reserve(lineCapacity);
+			output.Commit(String::FormatTo(out, lineCapacity, ", \"status\": \"%s\"}\n", status));
+		}
+
+		if (options.outputFilename) fclose(file);
+		return result.stateMismatches == 0 && result.regressions == 0;
+	}
+}
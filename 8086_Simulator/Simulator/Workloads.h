@@ -0,0 +1,31 @@
+#pragma once
+#include "Types.h"
+
+//----------------------------------------------
+// Workloads
+// Performance regression check over a corpus of guest programs (Testing/Workloads). The corpus is a
+// BatchRunner manifest, each job is one workload, run on its own several times and timed.
+// Its final state has to match the expected results, which are --run-batch output for the same manifest,
+// and its best time per instruction has to stay within a tolerance of the baseline.
+// Measurements are written one JSON object per line in the baseline's format, so the output of a run can be
+// checked in as the next baseline. A baseline only means something on the machine it was recorded on
+//----------------------------------------------
+namespace Workloads {
+	struct Options {
+		const char* manifestFilename = nullptr;
+		const char* expectedFilename = nullptr;   // nullptr skips checking the final state
+		const char* baselineFilename = nullptr;   // nullptr skips the comparison
+		const char* outputFilename = nullptr;     // nullptr writes to stdout. Opened after the baseline is read, so it can be the baseline
+		double tolerance = 25;                    // Percent slower than the baseline that still passes, unless its line has a "tolerance"
+		int repetitions = 10;                     // The best of these is measured
+	};
+
+	struct Result {
+		int workloads;
+		int stateMismatches;
+		int regressions;
+	};
+
+	// Prints every mismatch and regression, returns false if there was one or a file couldn't be read
+	bool Run(Options const& options, Result& result);
+}
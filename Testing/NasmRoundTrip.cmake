@@ -0,0 +1,39 @@
+# Steps 1 and 2 of run_tests.bat for ctest: assembles SOURCE, decompiles the binary with the simulator
+# (MODE "recursive" or "stream"), assembles the result and fails if the two binaries differ.
+# With EXPECTED set, the first binary also has to match it
+file(MAKE_DIRECTORY ${WORK_DIR})
+set(REAL ${WORK_DIR}/test_suite_binary_real)
+set(DECOMPILED ${WORK_DIR}/test_suite_decompiled.asm)
+set(RECREATION ${WORK_DIR}/test_suite_binary_recreation)
+
+execute_process(COMMAND ${NASM} ${SOURCE} -o ${REAL} RESULT_VARIABLE result)
+if(result)
+	message(FATAL_ERROR "nasm failed on ${SOURCE}")
+endif()
+
+# A binary checked in next to its source (EXPECTED) has to be what nasm makes from it
+if(EXPECTED)
+	execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${EXPECTED} ${REAL} RESULT_VARIABLE result)
+	if(result)
+		message(FATAL_ERROR "${EXPECTED} isn't what nasm makes from ${SOURCE}")
+	endif()
+endif()
+
+if(MODE STREQUAL "stream")
+	execute_process(COMMAND ${SIMULATOR} --decompile --stream --output ${DECOMPILED} ${REAL} RESULT_VARIABLE result)
+else()
+	execute_process(COMMAND ${SIMULATOR} --decompile --recursive ${REAL} OUTPUT_FILE ${DECOMPILED} RESULT_VARIABLE result)
+endif()
+if(result)
+	message(FATAL_ERROR "decompiling ${REAL} failed")
+endif()
+
+execute_process(COMMAND ${NASM} ${DECOMPILED} -o ${RECREATION} RESULT_VARIABLE result)
+if(result)
+	message(FATAL_ERROR "nasm failed on ${DECOMPILED}")
+endif()
+
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${REAL} ${RECREATION} RESULT_VARIABLE result)
+if(result)
+	message(FATAL_ERROR "${REAL} and ${RECREATION} differ")
+endif()
@@ -0,0 +1,24 @@
+; Framebuffer clear
+; Fills the 64x64 RGBA framebuffer at 0x00f0 with one colour, a word at a time, once a frame for 128 frames.
+; Every frame is a different colour, the last one leaves red 0x7f, green 0x20, blue 0x80 and alpha 0xff on screen
+bits 16
+
+FRAMEBUFFER equ 0x00f0
+FRAMES equ 128
+
+mov dx, 0                 ; frame
+frame_loop:
+mov ax, dx                ; red from the frame number
+add ax, 0x2000            ; green
+mov bx, FRAMEBUFFER
+
+pixel_loop:
+mov [bx], ax              ; red, green
+mov word [bx + 2], 0xff80 ; blue, alpha
+add bx, 4
+cmp bx, FRAMEBUFFER + 64*64*4
+jnz pixel_loop
+
+add dx, 1
+cmp dx, FRAMES
+jnz frame_loop
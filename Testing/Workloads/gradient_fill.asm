@@ -0,0 +1,49 @@
+; Gradient fill
+; Draws a gradient over the 64x64 RGBA framebuffer at 0x00f0 for 32 frames, moving it along every frame.
+; Red follows x, green follows y and blue the diagonal. There's no multiply, so the scaling is done by adding
+bits 16
+
+FRAMEBUFFER equ 0x00f0
+
+mov si, 0                 ; frame offset, 3 more each frame
+frame_loop:
+mov bp, FRAMEBUFFER
+mov dx, 0                 ; y
+
+y_loop:
+mov cx, 0                 ; x
+
+x_loop:
+; Red, x * 4 + offset
+mov ax, cx
+add ax, ax
+add ax, ax
+add ax, si
+mov [bp], al
+
+; Green, y * 4 + offset
+mov ax, dx
+add ax, ax
+add ax, ax
+add ax, si
+mov [bp + 1], al
+
+; Blue, (x + y) * 2
+mov ax, cx
+add ax, dx
+add ax, ax
+mov [bp + 2], al
+mov byte [bp + 3], 255    ; Alpha
+
+add bp, 4
+add cx, 1
+cmp cx, 64
+jnz x_loop
+
+add dx, 1
+cmp dx, 64
+jnz y_loop
+
+add si, 3
+cmp si, 32*3
+jnz frame_loop
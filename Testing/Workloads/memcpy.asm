@@ -0,0 +1,65 @@
+; memcpy style loops
+; Fills 8KB at 0x6000 with a pattern, then 32 times over copies it a byte at a time to 0x8000, from there
+; a word at a time to 0xa000, and back to 0x6000 four words per iteration. All three blocks end up holding the pattern
+bits 16
+
+BLOCK_A equ 0x6000
+BLOCK_B equ 0x8000
+BLOCK_C equ 0xa000
+SIZE equ 0x2000
+PASSES equ 32
+
+; Pattern, a word that counts up by 0x0101
+mov bx, BLOCK_A
+mov ax, 0x1234
+fill_loop:
+mov [bx], ax
+add ax, 0x0101
+add bx, 2
+cmp bx, BLOCK_A + SIZE
+jnz fill_loop
+
+mov bp, PASSES
+pass_loop:
+
+; Bytes, A to B
+mov si, BLOCK_A
+mov di, BLOCK_B
+mov cx, SIZE
+byte_loop:
+mov al, [si]
+mov [di], al
+add si, 1
+add di, 1
+loop byte_loop
+
+; Words, B to C
+mov si, BLOCK_B
+mov di, BLOCK_C
+mov cx, SIZE / 2
+word_loop:
+mov ax, [si]
+mov [di], ax
+add si, 2
+add di, 2
+loop word_loop
+
+; Unrolled words, C back to A
+mov si, BLOCK_C
+mov di, BLOCK_A
+mov cx, SIZE / 8
+unrolled_loop:
+mov ax, [si]
+mov [di], ax
+mov ax, [si + 2]
+mov [di + 2], ax
+mov ax, [si + 4]
+mov [di + 4], ax
+mov ax, [si + 6]
+mov [di + 6], ax
+add si, 8
+add di, 8
+loop unrolled_loop
+
+sub bp, 1
+jnz pass_loop
@@ -0,0 +1,54 @@
+; Prime sieve
+; Sieve of Eratosthenes for the numbers below 30000, one byte each at 0x6000, run 8 times over from a cleared
+; table. Only the primes up to 173 (the square root) cross off their multiples, then the primes left are
+; counted. Ends with dx = 3245
+bits 16
+
+SIEVE equ 0x6000
+LIMIT equ 30000
+PASSES equ 8
+
+mov bp, PASSES
+pass_loop:
+
+; Clear the table a word at a time
+mov bx, SIEVE
+mov ax, 0
+clear_loop:
+mov [bx], ax
+add bx, 2
+cmp bx, SIEVE + LIMIT
+jb clear_loop
+
+; Every number still clear is a prime, cross off its multiples from twice it up
+mov si, 2
+prime_loop:
+cmp byte [si + SIEVE], 0
+jnz next_prime
+mov bx, si
+add bx, si
+add bx, SIEVE
+multiple_loop:
+mov byte [bx], 1
+add bx, si
+cmp bx, SIEVE + LIMIT
+jb multiple_loop
+next_prime:
+add si, 1
+cmp si, 174
+jnz prime_loop
+
+; Count the primes from 2 up
+mov dx, 0
+mov bx, SIEVE + 2
+count_loop:
+cmp byte [bx], 0
+jnz count_next
+add dx, 1
+count_next:
+add bx, 1
+cmp bx, SIEVE + LIMIT
+jb count_loop
+
+sub bp, 1
+jnz pass_loop
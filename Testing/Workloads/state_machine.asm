@@ -0,0 +1,101 @@
+; Branch heavy state machine
+; A tokenizer run 48 times over 8KB of pseudo random text at 0x6000. Bytes below 64 are letters, below 128
+; digits, below 192 spaces and the rest punctuation. The state is where the code is: between tokens, in a word
+; or in a number. Words end up in si, numbers in di and punctuation in dx, counted over the last pass, and all
+; three added up in ax.
+; The branches follow the text, so they don't settle into a pattern
+bits 16
+
+TEXT equ 0x6000
+SIZE equ 0x2000
+PASSES equ 48
+
+; Text from x = x * 5 + 13849, the high byte of each step
+mov bx, TEXT
+mov ax, 1
+text_loop:
+mov dx, ax
+add ax, ax
+add ax, ax
+add ax, dx
+add ax, 13849
+mov [bx], ah
+add bx, 1
+cmp bx, TEXT + SIZE
+jnz text_loop
+
+mov bp, PASSES
+pass_loop:
+mov bx, TEXT
+mov cx, SIZE
+mov si, 0
+mov di, 0
+mov dx, 0
+mov ax, 0                 ; bytes are read into al and compared as ax
+
+between:
+mov al, [bx]
+add bx, 1
+cmp ax, 64
+jb start_word
+cmp ax, 128
+jb start_number
+cmp ax, 192
+jb between_next
+add dx, 1
+between_next:
+loop between
+jmp near pass_done
+
+start_word:
+add si, 1
+loop in_word
+jmp near pass_done
+
+start_number:
+add di, 1
+loop in_number
+jmp near pass_done
+
+in_word:
+mov al, [bx]
+add bx, 1
+cmp ax, 64
+jb in_word_next
+cmp ax, 128
+jb start_number
+cmp ax, 192
+jb in_word_end
+add dx, 1
+in_word_end:
+loop between
+jmp near pass_done
+in_word_next:
+loop in_word
+jmp near pass_done
+
+in_number:
+mov al, [bx]
+add bx, 1
+cmp ax, 64
+jb start_word
+cmp ax, 128
+jb in_number_next
+cmp ax, 192
+jb in_number_end
+add dx, 1
+in_number_end:
+loop between
+jmp near pass_done
+in_number_next:
+loop in_number
+
+pass_done:
+sub bp, 1
+jz finished
+jmp near pass_loop
+
+finished:
+mov ax, si
+add ax, di
+add ax, dx
@@ -1,6 +1,24 @@
 rem 1. Compile the test suite to binary, then compile the decompiled test suite to binary, then compare the two binaries
 
 nasm.exe Testing/full_test_suite.asm -o Testing/test_suite_binary_real
-"8086_Simulator/x64/Debug/Simulator.exe" Testing/test_suite_binary_real > Testing/test_suite_decompiled.asm
+"8086_Simulator/x64/Debug/Simulator.exe" --decompile --recursive Testing/test_suite_binary_real > Testing/test_suite_decompiled.asm
 nasm.exe Testing/test_suite_decompiled.asm -o Testing/test_suite_binary_recreation
-fc Testing/test_suite_binary_real Testing/test_suite_binary_recreation
\ No newline at end of file
+fc Testing/test_suite_binary_real Testing/test_suite_binary_recreation
+
+rem 2. Same round trip through the streaming decompiler
+
+"8086_Simulator/x64/Debug/Simulator.exe" --decompile --stream --output Testing/test_suite_streamed.asm Testing/test_suite_binary_real
+nasm.exe Testing/test_suite_streamed.asm -o Testing/test_suite_binary_streamed
+fc Testing/test_suite_binary_real Testing/test_suite_binary_streamed
+
+rem 3. Decode, encode and decode again every supported encoding, no assembler involved
+
+"8086_Simulator/x64/Debug/Simulator.exe" --roundtrip
+
+rem 4. Run random programs on the reference step and the fast execution paths and compare them
+
+"8086_Simulator/x64/Debug/Simulator.exe" --difffuzz 2000 --output Testing/difffuzz_reproducer.bin
+
+rem 5. Run the guest workloads and check their final states. Debug times say nothing, so there is no baseline here
+
+"8086_Simulator/x64/Debug/Simulator.exe" --workloads Testing/Workloads/workloads.txt --expected Testing/Workloads/expected.jsonl